@@ -2,9 +2,29 @@
 #define _WB_CLIENTCONN_H 1
 
 #include "wbsocket.h"
+#include "wbmasterconn.h"
+
+/*
+ * State of a client that is streaming WAL. Streams can be driven by
+ * WbCCStreamStep() from an event loop, see wbengine.c.
+ */
+typedef struct WbCCStream WbCCStream;
+
+typedef enum {
+	STREAM_BUSY,	/* more work can be done right away */
+	STREAM_IDLE,	/* waiting for one of the connections */
+	STREAM_DONE		/* streaming ended, finish with WbCCEndStreaming() */
+} WbCCStreamState;
 
 void WbCCInitConnection(WbConn conn);
 void WbCCPerformAuthentication(WbConn conn);
 void WbCCCommandLoop(WbConn conn);
 
+MasterConn* WbCCStartSession(WbConn conn);
+WbCCStream* WbCCRunCommands(WbConn conn, MasterConn *master, bool detachStream);
+WbCCStreamState WbCCStreamStep(WbCCStream *stream);
+int WbCCStreamGetEvents(WbCCStream *stream, bool *wantSource, bool *wantWrite, bool *ready);
+void WbCCEndStreaming(WbCCStream *stream);
+void WbCCAbortStream(WbCCStream *stream);
+
 #endif
@@ -18,7 +18,22 @@ typedef struct {
 		int n_include_databases;
 		char **exclude_databases;
 		int n_exclude_databases;
+		/* database.schema.relation */
+		char **include_relations;
+		int n_include_relations;
+		char **exclude_relations;
+		int n_exclude_relations;
+		/* Bitmask of ForkNumbers, see wb_fork_name() */
+		int exclude_forks;
 	} filter;
+	/* For synchronous replicas, whose replies hold up commits */
+	struct {
+		bool enabled;
+		/* Microseconds for SO_BUSY_POLL, 0 to not busy poll */
+		int busy_poll;
+		/* CPU to spin on instead of sleeping, -1 if not spinning */
+		int spin_cpu;
+	} latency_mode;
 } wb_config_entry;
 
 typedef struct wb_config_list_entry {
@@ -28,10 +43,33 @@ typedef struct wb_config_list_entry {
 
 typedef struct {
 	int listen_port;
+	int worker_threads;
+	int prefork_workers;
+	int prefork_replication_connections;
+	int oid_refresh_interval;
+	int metadata_cache_ttl;
+	bool verify_crc;
+	int zerocopy_threshold;
+	bool pipeline;
 	struct {
 		char *host;
 		int port;
+		char *user;
 	} master;
+	struct {
+		bool enabled;
+		int buffer_size;
+		int max_replicas;
+		int max_filter_profiles;
+		char *spool_directory;
+		int spool_size;
+		bool prefill;
+	} hub;
+	struct {
+		int buffer_size;
+		char *spill_directory;
+		int spill_size;
+	} read_ahead;
 	wb_config_list_entry *configurations;
 } wb_configuration;
 
@@ -40,5 +78,9 @@ extern wb_configuration *CurrentConfig;
 wb_configuration* wb_new_config();
 wb_configuration* wb_read_config(wb_configuration* config, char *filename);
 void wb_delete_config(wb_configuration* config);
+bool wb_filter_name_matches(char **patterns, int n, const char *name);
+int wb_filter_count_patterns(char **patterns, int n);
+bool wb_relation_rules_apply(char **patterns, int n, const char *name);
+const char *wb_fork_name(int fork);
 
 #endif
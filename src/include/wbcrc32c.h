@@ -42,21 +42,36 @@
 #define EQ_CRC32C(c1, c2) ((c1) == (c2))
 
 /*
- * Use slicing-by-8 algorithm.
+ * Use the best implementation the CPU supports, chosen on first use. The
+ * slicing-by-8 algorithm is the fallback.
  *
  * On big-endian systems, the intermediate value is kept in reverse byte
  * order, to avoid byte-swapping during the calculation. FIN_CRC32C reverses
  * the bytes to the final order.
  */
 #define COMP_CRC32C(crc, data, len) \
-    ((crc) = pg_comp_crc32c_sb8((crc), (data), (len)))
-#define COMP_CRC32C_ZERO(crc, data, len) \
-    ((crc) = pg_comp_crc32c_sb8_zero((crc), (data), (len)))
+    ((crc) = pg_comp_crc32c((crc), (data), (len)))
+#define COMP_CRC32C_ZERO(crc, len) \
+    ((crc) = pg_comp_crc32c_zero((crc), (len)))
 
 #define FIN_CRC32C(crc) ((crc) ^= 0xFFFFFFFF)
 
 
 extern pg_crc32c pg_comp_crc32c_sb8(pg_crc32c crc, const void *data, size_t len);
 extern pg_crc32c pg_comp_crc32c_sb8_zero(pg_crc32c crc, const void *data, size_t len);
+extern pg_crc32c pg_comp_crc32c_zero(pg_crc32c crc, size_t len);
+
+extern pg_crc32c (*pg_comp_crc32c) (pg_crc32c crc, const void *data, size_t len);
+extern const char *pg_crc32c_implementation(void);
+
+#if defined(__x86_64__)
+extern bool pg_crc32c_sse42_available(void);
+extern bool pg_crc32c_pclmul_available(void);
+extern pg_crc32c pg_comp_crc32c_sse42(pg_crc32c crc, const void *data, size_t len);
+extern pg_crc32c pg_comp_crc32c_sse42_pclmul(pg_crc32c crc, const void *data, size_t len);
+#elif defined(__aarch64__)
+extern bool pg_crc32c_armv8_available(void);
+extern pg_crc32c pg_comp_crc32c_armv8(pg_crc32c crc, const void *data, size_t len);
+#endif
 
 #endif   /* WB_CRC32C_H */
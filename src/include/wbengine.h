@@ -0,0 +1,17 @@
+#ifndef	_WB_ENGINE_H
+#define _WB_ENGINE_H 1
+
+#include "wbsocket.h"
+
+/*
+ * Threaded alternative to forking a process per client. The startup and
+ * command phase of each client runs in a short lived session thread. Once
+ * the client starts streaming, the session is handed to one of a fixed
+ * number of worker threads that drive all their streams from an epoll loop.
+ * When streaming ends the session continues in a new session thread.
+ */
+
+void WbEngineStart(int numWorkers);
+void WbEngineStartSession(WbConn conn);
+
+#endif
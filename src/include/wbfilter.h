@@ -15,18 +15,79 @@ typedef enum {
 	FS_BUFFER_BLOCK_HEADER = (6 | FS_BUFFERING_STATE),
 	FS_BUFFER_IMAGE_HEADER = (7 | FS_BUFFERING_STATE),
 	FS_BUFFER_COMPRESSION_HEADER = (8 | FS_BUFFERING_STATE),
-	FS_BUFFER_FILENODE = (9 | FS_BUFFERING_STATE)
+	FS_BUFFER_FILENODE = (9 | FS_BUFFERING_STATE),
+	FS_BUFFER_CATALOG_OID = (10 | FS_BUFFERING_STATE)
 } FilterState;
 
 #define FL_BUFFER_LEN 128
+/* Relation files created in the stream that are tracked at most */
+#define FL_MAX_PENDING_RELATIONS 1024
+/* Part of the record header covered by the CRC, up to xl_crc */
+#define FL_CRC_HEADER_LEN 20
+/* Times a record may fail the CRC check before giving up */
+#define FL_MAX_CRC_FAILURES 3
 
+/* Open addressing hash set of OIDs, free slots hold InvalidOid */
 typedef struct {
+	uint32 mask;
+	Oid *slots;
+} FilterOidSet;
+
+/* Same for relation files, keyed by database and relfilenode */
+typedef struct {
+	uint32 mask;
+	uint64 *slots;
+} FilterRelSet;
+
+/* Relation file of a database, lists of these end with a zero dbNode */
+typedef struct {
+	Oid dbNode;
+	Oid relNode;
+} FilterRelNode;
+
+/*
+ * Filtering rules compiled for lookup. A set without slots is not used.
+ * Pending objects are part of the include sets.
+ */
+typedef struct {
+	bool valid;
+	FilterOidSet includeTablespaces;
+	FilterOidSet includeDatabases;
+	FilterOidSet excludeTablespaces;
+	FilterOidSet excludeDatabases;
+	FilterOidSet includeRelationDatabases;
+	FilterOidSet excludeRelationDatabases;
+	FilterRelSet includeRelations;
+	FilterRelSet excludeRelations;
+
+	/* Decision for the last tablespace and database seen */
+	bool lastValid;
+	Oid lastSpcNode;
+	Oid lastDbNode;
+	bool lastDecision;
+} FilterRules;
+
+typedef struct FilterData FilterData;
+
+/* Parser of the WAL of one major version */
+typedef bool (*FilterParser)(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos);
+
+struct FilterData {
 	FilterState state;
 	int dataNeeded;
 	int recordRemaining;
 
 	bool synchronized;
 	XLogRecPtr requestedStartPos;
+	/* Timeline of the last page header, pages never go back in timelines */
+	TimeLineID pageTli;
+	/* WAL segment size of the master */
+	uint32 segSize;
+	/* Start of the record being processed, from when its header begins */
+	XLogRecPtr recordPtr;
+	/* Page we started on while skipping a continuation record */
+	XLogRecPtr contPagePtr;
+	TimeLineID contPageTli;
 
 	int recordStart;
 	int headerPos;
@@ -37,15 +98,99 @@ typedef struct {
 
 	int unsentBufferLen;
 	char unsentBuffer[FL_BUFFER_LEN];
+	/* Unsent data from the previous message, while it is being sent out */
+	char outputBuffer[FL_BUFFER_LEN];
+
+	/*
+	 * When starting in the middle of a record, start output at the next
+	 * record instead of asking the caller to restart at the previous one.
+	 */
+	bool syncForward;
 
 	Oid *include_tablespaces;
 	Oid *include_databases;
 	Oid *exclude_tablespaces;
 	Oid *exclude_databases;
-} FilterData;
+
+	/*
+	 * Tablespaces and databases created in the stream whose names are not
+	 * known yet. Their data is let through until they are resolved.
+	 */
+	Oid *pending_tablespaces;
+	Oid *pending_databases;
+
+	/*
+	 * Databases with relation rules and the relation files included or
+	 * excluded in them. Catalogs are always included. Relation files created
+	 * in the stream are pending until the caller resolves them.
+	 */
+	Oid *include_relation_databases;
+	Oid *exclude_relation_databases;
+	FilterRelNode *include_relations;
+	FilterRelNode *exclude_relations;
+	FilterRelNode *pending_relations;
+
+	/* Bitmask of forks whose full page images are dropped */
+	int exclude_forks;
+	/* Fork of the first block reference of the current record */
+	int blockFork;
+
+	/* Records replaced with NOOPs and their size */
+	uint64 filteredRecords;
+	uint64 filteredBytes;
+	/* Part of filteredBytes that only fork rules filtered */
+	uint64 forkFilteredBytes;
+
+	/* Built from the lists above on first use */
+	FilterRules rules;
+
+	/*
+	 * Check the CRC of records as they pass. Computed incrementally from the
+	 * data following the header, the header is added when the record ends.
+	 */
+	bool verifyCrc;
+	bool crcActive;
+	uint32 recordCrc;
+	uint32 expectedCrc;
+	char crcHeader[FL_CRC_HEADER_LEN];
+	/* Record that last failed the check and how many times in a row */
+	XLogRecPtr crcFailurePtr;
+	int crcFailures;
+
+	/* Chosen by the page magic of the stream */
+	int pageMagic;
+	FilterParser parser;
+};
+
+/*
+ * Part of the WAL stream that is ready to be sent after processing a message.
+ * Consists of data held back from the previous message followed by data
+ * from the current message.
+ */
+typedef struct {
+	XLogRecPtr dataStart;
+	XLogRecPtr walEnd;
+	TimestampTz sendTime;
+
+	char *prefix;
+	int prefixLen;
+	char *data;
+	int dataLen;
+} FilterOutput;
 
 FilterData* WbFCreateProcessingState(XLogRecPtr startPos);
+void WbFResetProcessingState(FilterData* fl, XLogRecPtr startPos);
 void WbFFreeProcessingState(FilterData* fl);
+bool WbFHasFilter(FilterData* fl);
+bool WbFIsSynchronized(FilterData* fl);
+int WbFPageMagicForVersion(int server_version);
 bool WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, int xlog_page_magic);
+bool WbFGetOutput(FilterData* fl, ReplMessage* msg, FilterOutput *out);
+bool WbFHasPendingOids(FilterData* fl);
+void WbFAddOid(Oid **list, Oid oid);
+bool WbFRemoveOid(Oid *list, Oid oid);
+void WbFRulesChanged(FilterData* fl);
+void WbFSetRelations(FilterRelNode **list, Oid dbNode, FilterRelNode *rels, int n);
+bool WbFRemoveRelation(FilterRelNode *list, Oid dbNode, Oid relNode);
 
 #endif
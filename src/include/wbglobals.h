@@ -20,6 +20,8 @@ typedef int16_t int16;
 typedef int32_t int32;
 typedef int64_t int64;
 
+#define UINT64CONST(x) ((uint64) x##ULL)
+
 /* Compatibility stuff */
 typedef uint64 XLogRecPtr;
 typedef uint32 TimeLineID;
@@ -0,0 +1,41 @@
+#ifndef	_WB_HUB_H
+#define _WB_HUB_H 1
+
+#include <sys/types.h>
+
+#include "wbglobals.h"
+#include "wbfilter.h"
+#include "wbmasterconn.h"
+#include "wbsocket.h"
+
+/*
+ * The hub receives a single WAL stream from the master and makes it available
+ * to all bouncer processes through a ring buffer in shared memory. The ring
+ * is addressed by WAL position, the byte at position X lives at offset
+ * X % size.
+ *
+ * Replicas with identical filtering rules share a filter profile. The hub
+ * filters the WAL once per profile into a ring of its own, so that each
+ * replica only has to send the result out.
+ */
+
+typedef struct WbHubSubscriber WbHubSubscriber;
+
+void WbHubInit();
+bool WbHubEnabled();
+void WbHubMain();
+void WbHubStopped();
+void WbHubReleaseSlots(pid_t pid);
+
+WbHubSubscriber* WbHubSubscribe(TimeLineID tli, XLogRecPtr startPos, FilterData *fl, int xlogPageMagic);
+void WbHubUnsubscribe(WbHubSubscriber *sub);
+bool WbHubIsFiltered(WbHubSubscriber *sub);
+int WbHubGetSocket(WbHubSubscriber *sub);
+bool WbHubHasData(WbHubSubscriber *sub);
+bool WbHubReceiveWalMessage(WbHubSubscriber *sub, ReplMessage *msg);
+bool WbHubSeek(WbHubSubscriber *sub, XLogRecPtr pos);
+XLogRecPtr WbHubGetReadPtr(WbHubSubscriber *sub);
+void WbHubSendReply(WbHubSubscriber *sub, StandbyReplyMessage *reply);
+void WbHubSendFeedback(WbHubSubscriber *sub, HSFeedbackMessage *feedback);
+
+#endif
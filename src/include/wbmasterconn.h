@@ -37,11 +37,33 @@ typedef enum {
 	OID_RESOLVE_DATABASES
 } OidResolveKind;
 
+typedef struct {
+	OidResolveKind kind;
+	Oid oid;
+	char *name;
+} NamedOid;
+
+/* Relation file of a database, named after the table it belongs to */
+typedef struct {
+	Oid relNode;
+	/* Table of an index or TOAST table */
+	Oid owner;
+	/* schema.relation of the owner */
+	char *name;
+} NamedRelation;
+
 typedef struct MasterConn MasterConn;
 
 MasterConn* WbMcOpenConnection(const char *conninfo);
+MasterConn* WbMcTryOpenConnection(const char *conninfo);
+bool WbMcCheckConnection(MasterConn *master);
+const char *WbMcGetUser(MasterConn *master);
 void WbMcCloseConnection(MasterConn *master);
+void WbMcDisconnect(MasterConn *master);
+bool WbMcIsConnected(MasterConn *master);
+void WbMcReconnect(MasterConn *master);
 int WbMcGetSocket(MasterConn *master);
+bool WbMcCanSendWhileReceiving(MasterConn *master);
 bool WbMcStartStreaming(MasterConn *master, XLogRecPtr pos, TimeLineID tli);
 void WbMcEndStreaming(MasterConn *master, TimeLineID *nextTli, char** nextTliStart);
 bool WbMcReceiveWalMessage(MasterConn *master, ReplMessage *msg);
@@ -52,6 +74,9 @@ bool WbMcIdentifySystem(MasterConn* master,
 bool WbMcGetTimelineHistory(MasterConn* master, TimeLineID timeline,
 		TimelineHistory *history);
 char *WbMcShowVariable(MasterConn* master, char *varname);
+void WbMcSetWalGeometry(const char *segSize, const char *blockSize);
 Oid * WbMcResolveOids(MasterConn *master, OidResolveKind kind, bool include, char** names, int n_items);
+NamedOid * WbMcListNamedOids(MasterConn *master, int *count);
+NamedRelation * WbMcListRelations(MasterConn *master, int *count);
 const char *WbMcParameterStatus(MasterConn *master, char *name);
 #endif
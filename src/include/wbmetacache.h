@@ -0,0 +1,26 @@
+#ifndef	_WB_METACACHE_H
+#define _WB_METACACHE_H 1
+
+#include "wbglobals.h"
+#include "wbmasterconn.h"
+
+/*
+ * Results of replication commands that replicas run before streaming,
+ * shared by all processes. When many replicas reconnect at once only the
+ * first of them has to ask the master.
+ *
+ * The current timeline and WAL position from IDENTIFY_SYSTEM expire after
+ * metadata_cache_ttl. Timeline history files and settings that can only
+ * change with a restart of the master are kept longer, and are dropped when
+ * the master reports a different system identifier.
+ */
+
+void WbMetaCacheInit();
+bool WbMetaGetIdentify(char **sysid, char **tli, char **xpos);
+void WbMetaPutIdentify(const char *sysid, const char *tli, const char *xpos);
+bool WbMetaGetTimelineHistory(TimeLineID tli, TimelineHistory *history);
+void WbMetaPutTimelineHistory(TimeLineID tli, TimelineHistory *history);
+char* WbMetaGetVariable(const char *name);
+void WbMetaPutVariable(const char *name, const char *value);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef	_WB_OIDCACHE_H
+#define _WB_OIDCACHE_H 1
+
+#include "wbglobals.h"
+#include "wbconfig.h"
+#include "wbfilter.h"
+#include "wbmasterconn.h"
+
+/*
+ * OIDs of the tablespaces and databases named in the filtering rules of all
+ * configurations. A process of its own resolves them periodically and keeps
+ * the result in shared memory, so that streams don't have to connect to the
+ * master to look them up.
+ */
+
+void WbOidCacheInit();
+bool WbOidCacheEnabled();
+void WbOidCacheMain();
+bool WbOidCacheLookup(wb_config_entry *entry, FilterData *fl);
+bool WbOidCacheResolvePending(wb_config_entry *entry, FilterData *fl, MasterConn *master);
+
+#endif
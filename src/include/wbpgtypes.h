@@ -118,14 +118,17 @@ typedef XLogLongPageHeaderData *XLogLongPageHeader;
 	(((hdr)->xlp_info & XLP_LONG_HEADER) ? SizeOfXLogLongPHD : SizeOfXLogShortPHD)
 
 /*
- * The XLOG is split into WAL segments (physical files) of the size indicated
- * by XLOG_SEG_SIZE.
+ * The XLOG is split into WAL segments (physical files) of the size the master
+ * was initialized with. Until we have asked, XLOG_SEG_SIZE is assumed, see
+ * WbMcSetWalGeometry(). Set once per process, it does not change after.
  */
-#define XLogSegSize		((uint32) XLOG_SEG_SIZE)
-#define XLogSegmentsPerXLogId	(UINT64CONST(0x100000000) / XLOG_SEG_SIZE)
+extern uint32 WalSegSize;
+
+#define XLogSegSize		WalSegSize
+#define XLogSegmentsPerXLogId	(UINT64CONST(0x100000000) / XLogSegSize)
 
 #define XLogSegNoOffsetToRecPtr(segno, offset, dest) \
-		(dest) = (segno) * XLOG_SEG_SIZE + (offset)
+		(dest) = (segno) * XLogSegSize + (offset)
 
 /*
  * Compute ID and segment from an XLogRecPtr.
@@ -248,13 +251,30 @@ typedef struct XLogRecord
 
 #define XLOG_NOOP 0x20
 #define XLOG_SWITCH 0x40
-#define XLOG_FPI 0xA0
+#define XLOG_FPI_FOR_HINT 0xA0
+#define XLOG_FPI 0xB0
 
 #define XLOG_SMGR_CREATE	0x10
 #define XLOG_SMGR_TRUNCATE	0x20
 
 #define XLOG_SEQ_LOG			0x00
 
+/* Page magic of the supported major versions */
+#define XLOG_PAGE_MAGIC_13		0xD106
+#define XLOG_PAGE_MAGIC_14		0xD10D
+#define XLOG_PAGE_MAGIC_15		0xD110
+#define XLOG_PAGE_MAGIC_16		0xD113
+#define XLOG_PAGE_MAGIC_17		0xD116
+#define XLOG_PAGE_MAGIC_18		0xD118
+
+/* Database records were renumbered in 15 when WAL logged creation was added */
+#define XLOG_DBASE_CREATE		0x00
+#define XLOG_DBASE_DROP_OLD		0x10
+#define XLOG_DBASE_DROP			0x20
+
+#define XLOG_TBLSPC_CREATE		0x00
+#define XLOG_TBLSPC_DROP		0x10
+
 #define REC_HEADER_LEN 24
 
 #define XLR_MAX_BLOCK_ID			32
@@ -306,9 +326,14 @@ typedef struct XLogRecordBlockImageHeader
 #define BKPIMAGE_COMPRESS_LZ4	0x08
 #define BKPIMAGE_COMPRESS_ZSTD	0x10
 
-#define	BKPIMAGE_COMPRESSED(info) \
-	((info & (BKPIMAGE_COMPRESS_PGLZ | BKPIMAGE_COMPRESS_LZ4 | \
-			  BKPIMAGE_COMPRESS_ZSTD)) != 0)
+/* Before 15 there was one compression method, and APPLY was 0x04 */
+#define BKPIMAGE_IS_COMPRESSED_14	0x02
+
+#define	BKPIMAGE_COMPRESSED(info, magic) \
+	((magic) >= XLOG_PAGE_MAGIC_15 ? \
+	 ((info) & (BKPIMAGE_COMPRESS_PGLZ | BKPIMAGE_COMPRESS_LZ4 | \
+				BKPIMAGE_COMPRESS_ZSTD)) != 0 : \
+	 ((info) & BKPIMAGE_IS_COMPRESSED_14) != 0)
 
 /*
  * Extra header information used when page image has "hole" and
@@ -0,0 +1,29 @@
+#ifndef	_WB_PIPELINE_H
+#define _WB_PIPELINE_H 1
+
+#include "wbglobals.h"
+#include "wbmasterconn.h"
+#include "wbsocket.h"
+
+/*
+ * Receiver and sender threads of a stream, so that network I/O overlaps
+ * with filtering. The stream's own thread keeps all filtering state. It
+ * takes the messages received from the master from one single producer,
+ * single consumer queue and hands output for the replica to another.
+ */
+
+typedef struct WbPipeline WbPipeline;
+
+WbPipeline* WbPipeCreate(WbConn conn);
+bool WbPipeFree(WbPipeline *pl, bool drain);
+int WbPipeGetSocket(WbPipeline *pl);
+bool WbPipeIsReady(WbPipeline *pl, bool wantReceive, bool wantFlush);
+
+void WbPipeStartReceiving(WbPipeline *pl, MasterConn *master);
+void WbPipeStopReceiving(WbPipeline *pl);
+bool WbPipeIsReceiving(WbPipeline *pl);
+bool WbPipeReceiveWalMessage(WbPipeline *pl, ReplMessage *msg);
+
+void WbPipeFlush(WbPipeline *pl);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef	_WB_POOL_H
+#define _WB_POOL_H 1
+
+#include "wbglobals.h"
+#include "wbmasterconn.h"
+
+/*
+ * Idle worker processes forked ahead of time. Each one connects to the
+ * master while waiting, then gets an accepted client socket passed from the
+ * main process and serves that client like a freshly forked process would.
+ */
+
+void __attribute__((noreturn)) WbPoolWorkerMain(int channel, bool replication);
+MasterConn* WbPoolTakeMasterConn(const char *user, bool replication);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef	_WB_READAHEAD_H
+#define _WB_READAHEAD_H 1
+
+#include "wbglobals.h"
+#include "wbfilter.h"
+
+/*
+ * Queue of WAL messages that are ready to be sent to a replica. Lets us keep
+ * receiving and filtering WAL while the replica is slow to accept it, so
+ * that the master is not held up. Messages are kept in memory up to a limit
+ * and optionally spilled to a file after that.
+ */
+
+typedef struct WbReadAhead WbReadAhead;
+
+WbReadAhead* WbRaCreate();
+void WbRaFree(WbReadAhead *ra);
+bool WbRaIsEmpty(WbReadAhead *ra);
+bool WbRaIsFull(WbReadAhead *ra);
+void WbRaPut(WbReadAhead *ra, FilterOutput *out);
+bool WbRaGet(WbReadAhead *ra, FilterOutput *out);
+
+#endif
@@ -48,6 +48,17 @@ typedef struct {
 	int sendBufLen;
 	int sendBufMsgLenPtr;
 	int sendBufFlushPtr;
+	/*
+	 * Data sent straight from the caller's memory after sendBuffer. Only
+	 * valid until the next ConnFlush, unsent data is copied then.
+	 */
+	const char *sendExtData;
+	int sendExtLen;
+	bool sendExtStable;
+	/* MSG_ZEROCOPY for stable data at least this large, 0 if disabled */
+	int zeroCopyThreshold;
+	/* Zero copy sends the kernel has not reported complete */
+	uint32 zeroCopyOutstanding;
 
 	ProtocolVersion proto;
 
@@ -91,12 +102,24 @@ OpenServerSocket(int port);
 WbConn
 ConnCreate(WbSocket server);
 
+bool
+ConnSendToProcess(int channel, WbConn conn);
+
+WbConn
+ConnReceiveFromProcess(int channel);
+
 bool
 ConnHasDataToFlush(WbConn conn);
 
 int
 ConnFlush(WbConn conn, ConnFlushMode mode);
 
+int
+ConnTakeOutput(WbConn conn, char *buf, int len);
+
+void
+ConnCopyExtData(WbConn conn);
+
 void
 CloseConn(WbConn);
 
@@ -121,6 +144,15 @@ ConnSendString(WbConn conn, const char *str);
 void
 ConnSendBytes(WbConn conn, const char *str, int n);
 
+void
+ConnSendBytesNoCopy(WbConn conn, const char *data, int n, bool stable);
+
+bool
+ConnEnableZeroCopy(WbConn conn, int threshold);
+
+bool
+SocketSetLowLatency(int fd, int busyPoll);
+
 void
 ConnEndMessage(WbConn conn);
 
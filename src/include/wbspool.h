@@ -0,0 +1,27 @@
+#ifndef	_WB_SPOOL_H
+#define _WB_SPOOL_H 1
+
+#include "wbglobals.h"
+#include "wbmasterconn.h"
+
+/*
+ * Local copy of the WAL received by the hub, kept as segment files in the
+ * spool directory. Replicas that are behind the hub buffer are served from
+ * the spool instead of the master. Segments are written under a .partial
+ * name and renamed once complete, only complete segments are read.
+ */
+
+typedef struct WbSpoolReader WbSpoolReader;
+
+void WbSpoolInit();
+bool WbSpoolEnabled();
+
+void WbSpoolWrite(TimeLineID tli, XLogRecPtr dataStart, const char *data, int len);
+
+WbSpoolReader* WbSpoolOpen(TimeLineID tli, XLogRecPtr startPos);
+void WbSpoolClose(WbSpoolReader *reader);
+bool WbSpoolReceiveWalMessage(WbSpoolReader *reader, ReplMessage *msg);
+void WbSpoolSeek(WbSpoolReader *reader, XLogRecPtr pos);
+XLogRecPtr WbSpoolGetReadPtr(WbSpoolReader *reader);
+
+#endif
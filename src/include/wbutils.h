@@ -1,6 +1,8 @@
 #ifndef	_WB_UTILS_H
 #define _WB_UTILS_H 1
 
+#include <setjmp.h>
+
 #include "wbglobals.h"
 
 typedef enum LogLevel {
@@ -14,6 +16,7 @@ typedef enum LogLevel {
 #define LOG_LOWEST_LEVEL LOG_DEBUG3
 
 extern LogLevel loggingLevel;
+extern __thread jmp_buf *errorHandler;
 
 #define wb_log(level, levelStr, ...) if (loggingLevel <= level)\
 {\
@@ -29,7 +32,7 @@ extern LogLevel loggingLevel;
 
 void do_wb_log(LogLevel logLevel, const char* logLevelStr, const char* file, const char* message, ...);
 void __attribute__((noreturn)) error(const char *message, ...);
-void showPQerror(PGconn *mc, char *message);
+void __attribute__((noreturn)) showPQerror(PGconn *mc, char *message);
 
 
 void *wballoc(size_t amount);
@@ -54,6 +57,7 @@ void write64(char *buf, uint64 v);
 void write32(char *buf, uint32 v);
 
 const char * timestamptz_to_str(TimestampTz t);
+TimestampTz GetCurrentTimestamp();
 
 typedef struct {
 	uint32 addr;
@@ -62,5 +66,6 @@ typedef struct {
 
 bool parse_hostmask(char *string, hostmask *result);
 bool match_hostmask(hostmask *match, uint32 host);
+bool parse_byte_size(const char *string, uint64 *result);
 
 #endif
@@ -0,0 +1,17 @@
+#ifndef	_WB_WALINDEX_H
+#define _WB_WALINDEX_H 1
+
+#include "wbglobals.h"
+
+/*
+ * Index of WAL pages that begin with a continuation record, remembering
+ * where that record starts. Filled in by every process while filtering, so
+ * that a stream starting on such a page can start at the record right away
+ * instead of restarting replication once it has found the record.
+ */
+
+void WbWalIndexInit();
+void WbWalIndexAdd(TimeLineID tli, XLogRecPtr pagePtr, XLogRecPtr recordPtr);
+bool WbWalIndexLookup(TimeLineID tli, XLogRecPtr pagePtr, XLogRecPtr *recordPtr);
+
+#endif
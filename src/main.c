@@ -5,23 +5,41 @@
 
 
 #include <getopt.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 
 #include "wbconfig.h"
+#include "wbcrc32c.h"
 #include "wbutils.h"
 #include "wbsocket.h"
 #include "wbsignals.h"
 #include "wbclientconn.h"
+#include "wbengine.h"
+#include "wbhub.h"
+#include "wbmetacache.h"
+#include "wboidcache.h"
+#include "wbpool.h"
+#include "wbspool.h"
+#include "wbwalindex.h"
+
+/* Seconds between attempts at starting the hub and OID cache processes */
+#define HELPER_RESTART_INTERVAL 5
 
 typedef enum {
 	SLOT_UNUSED,
+	SLOT_IDLE,
 	SLOT_ACTIVE
 } BouncerSlotState;
 
 typedef struct {
 	pid_t pid;
 	BouncerSlotState state;
+	/* Where to pass a client to an idle worker */
+	int channel;
+	/* Idle worker holds a replication connection */
+	bool warm;
 } BouncerSlot;
 typedef struct {
 	BouncerSlot* slots;
@@ -30,6 +48,10 @@ typedef struct {
 
 char* config_filename = NULL;
 BouncerArrayStruct BouncerArray;
+pid_t HubPid = 0;
+time_t HubStartTime = 0;
+pid_t OidCachePid = 0;
+time_t OidCacheStartTime = 0;
 
 static pid_t fork_process();
 static void InitializeBouncerArray();
@@ -69,6 +91,7 @@ ResizeBouncerArray(int newSize)
 	{
 		BouncerArray.slots[i].pid = 0;
 		BouncerArray.slots[i].state = SLOT_UNUSED;
+		BouncerArray.slots[i].channel = -1;
 	}
 	BouncerArray.numSlots = newSize;
 }
@@ -110,10 +133,37 @@ CleanupBackend(int pid, int exitstatus)
 	{
 		log_warning("Backend with PID %d crashed with exit code %d", pid, exitstatus);
 	}
-	
+
+	if (slot->state == SLOT_IDLE)
+	{
+		close(slot->channel);
+		slot->channel = -1;
+	}
+
 	/* Mark the slot as empty */
 	slot->pid = 0;
 	slot->state = SLOT_UNUSED;
+
+	WbHubReleaseSlots(pid);
+}
+
+static void
+CleanupHub(int exitstatus)
+{
+	if (exitstatus != 0)
+		log_warning("Hub process with PID %d exited with code %d", HubPid, exitstatus);
+
+	HubPid = 0;
+	WbHubStopped();
+}
+
+static void
+CleanupOidCache(int exitstatus)
+{
+	if (exitstatus != 0)
+		log_warning("OID cache process with PID %d exited with code %d", OidCachePid, exitstatus);
+
+	OidCachePid = 0;
 }
 
 static void
@@ -136,7 +186,14 @@ reaper(int signum)
 	log_debug2("Reaping dead child process");
 
 	while ((pid = waitpid(-1, &exitstatus, WNOHANG)) > 0)
-		CleanupBackend(pid, exitstatus);
+	{
+		if (pid == HubPid)
+			CleanupHub(exitstatus);
+		else if (pid == OidCachePid)
+			CleanupOidCache(exitstatus);
+		else
+			CleanupBackend(pid, exitstatus);
+	}
 
 	UnblockSignals();
 	errno = save_errno;
@@ -156,6 +213,161 @@ InitMasks(fd_set *rmask, WbSocket server)
 	return maxsock + 1;
 }
 
+static void
+StartHubProcess(WbSocket server)
+{
+	pid_t pid;
+
+	HubStartTime = time(NULL);
+
+	pid = fork_process();
+	if (pid == 0) /* hub */
+	{
+		CloseSocket(server);
+		CloseDeathwatchPort();
+
+		WbHubMain();
+		exit(0);
+	}
+
+	if (pid < 0)
+	{
+		log_error("Could not fork hub process");
+	}
+	else
+		HubPid = pid;
+}
+
+static void
+StartOidCacheProcess(WbSocket server)
+{
+	pid_t pid;
+
+	OidCacheStartTime = time(NULL);
+
+	pid = fork_process();
+	if (pid == 0) /* OID cache */
+	{
+		CloseSocket(server);
+		CloseDeathwatchPort();
+
+		WbOidCacheMain();
+		exit(0);
+	}
+
+	if (pid < 0)
+	{
+		log_error("Could not fork OID cache process");
+	}
+	else
+		OidCachePid = pid;
+}
+
+/*
+ * Fork a worker that waits for a client while connecting to master ahead of
+ * time. Only prefork_replication_connections workers connect for
+ * replication, each of them takes up a WAL sender on the master.
+ */
+static void
+StartIdleWorker(WbSocket server)
+{
+	BouncerSlot *slot;
+	int channel[2];
+	pid_t pid;
+	int warm = 0;
+	int i;
+
+	for (i = 0; i < BouncerArray.numSlots; i++)
+		if (BouncerArray.slots[i].state == SLOT_IDLE && BouncerArray.slots[i].warm)
+			warm++;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, channel))
+	{
+		log_error("Could not create channel to worker process");
+		return;
+	}
+
+	pid = fork_process();
+	if (pid == 0) /* idle worker */
+	{
+		CloseSocket(server);
+		CloseDeathwatchPort();
+		close(channel[0]);
+		for (i = 0; i < BouncerArray.numSlots; i++)
+			if (BouncerArray.slots[i].state == SLOT_IDLE)
+				close(BouncerArray.slots[i].channel);
+
+		WbPoolWorkerMain(channel[1], warm < CurrentConfig->prefork_replication_connections);
+	}
+
+	close(channel[1]);
+
+	if (pid < 0)
+	{
+		log_error("Could not fork worker process");
+		close(channel[0]);
+		return;
+	}
+
+	slot = FindBouncerSlot();
+	slot->pid = pid;
+	slot->channel = channel[0];
+	slot->state = SLOT_IDLE;
+	slot->warm = warm < CurrentConfig->prefork_replication_connections;
+}
+
+static void
+MaintainIdleWorkers(WbSocket server)
+{
+	int idle = 0;
+	int i;
+
+	for (i = 0; i < BouncerArray.numSlots; i++)
+		if (BouncerArray.slots[i].state == SLOT_IDLE)
+			idle++;
+
+	for (; idle < CurrentConfig->prefork_workers; idle++)
+		StartIdleWorker(server);
+}
+
+/*
+ * Pass the client to an idle worker, preferring one with a replication
+ * connection. Returns false if there is none.
+ */
+static bool
+DispatchToIdleWorker(WbConn conn)
+{
+	int pass;
+	int i;
+
+	/* Workers with a replication connection in the first pass */
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (i = 0; i < BouncerArray.numSlots; i++)
+		{
+			BouncerSlot *slot = &(BouncerArray.slots[i]);
+			bool sent;
+
+			if (slot->state != SLOT_IDLE || (pass == 0 && !slot->warm))
+				continue;
+
+			sent = ConnSendToProcess(slot->channel, conn);
+
+			/* Either way the worker is no longer idle, it exits if it failed */
+			close(slot->channel);
+			slot->channel = -1;
+			slot->state = SLOT_ACTIVE;
+
+			if (sent)
+			{
+				log_debug2("Passed connection to worker process %d", slot->pid);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
 void WalBouncerMain()
 {
 	// set up signals for child reaper, etc.
@@ -170,15 +382,34 @@ void WalBouncerMain()
 
 	nSock = InitMasks(&readmask, server);
 
+	if (CurrentConfig->worker_threads > 0)
+		WbEngineStart(CurrentConfig->worker_threads);
 
 	while (!stopRequested)
 	{
 		pid_t pid;
+		bool helperDown;
+
+		if (WbOidCacheEnabled() && OidCachePid == 0 &&
+				time(NULL) - OidCacheStartTime >= HELPER_RESTART_INTERVAL)
+			StartOidCacheProcess(server);
+
+		if (WbHubEnabled() && HubPid == 0 &&
+				time(NULL) - HubStartTime >= HELPER_RESTART_INTERVAL)
+			StartHubProcess(server);
+
+		helperDown = (WbHubEnabled() && HubPid == 0) ||
+				(WbOidCacheEnabled() && OidCachePid == 0);
+
+		if (CurrentConfig->worker_threads == 0)
+			MaintainIdleWorkers(server);
+
 		{
 			fd_set rmask;
 			int selres;
 			struct timeval timeout;
-			timeout.tv_sec = 60;
+			/* Wake up in time to restart the hub or OID cache if not running */
+			timeout.tv_sec = helperDown ? HELPER_RESTART_INTERVAL : 60;
 			timeout.tv_usec = 0;
 
 			memcpy((char*) &rmask, (char*)&readmask, sizeof(fd_set));
@@ -198,6 +429,18 @@ void WalBouncerMain()
 
 		log_debug2("Received new connection");
 
+		if (CurrentConfig->worker_threads > 0)
+		{
+			WbEngineStartSession(conn);
+			continue;
+		}
+
+		if (DispatchToIdleWorker(conn))
+		{
+			CloseConn(conn);
+			continue;
+		}
+
 		pid = fork_process();
 		if (pid == 0) /* child */
 		{
@@ -250,6 +493,7 @@ int
 main(int argc, char **argv)
 {
 	int c;
+	const char *crcImpl;
 	progname = "walbouncer";
 
 	CurrentConfig = wb_new_config();
@@ -305,6 +549,15 @@ main(int argc, char **argv)
 
 	InitializeBouncerArray();
 	InitDeathWatchHandle();
+	WbHubInit();
+	WbSpoolInit();
+	WbWalIndexInit();
+	WbOidCacheInit();
+	WbMetaCacheInit();
+
+	/* Pick the CRC implementation once, children inherit the choice */
+	crcImpl = pg_crc32c_implementation();
+	log_debug1("Using %s CRC-32C implementation", crcImpl);
 
 	WalBouncerMain();
 	return 0;
@@ -1,11 +1,169 @@
 #include <stdio.h>
+#include <string.h>
+#include "wbcrc32c.h"
+#include "wbfilter.h"
+#include "wbpgtypes.h"
 #include "wbutils.h"
+#include "wbwalindex.h"
 
 #define FAIL(...) { printf(__VA_ARGS__); printf(" on line %d\n", __LINE__); return false; }
 #define EXPECT_TRUE(x) if (!x) FAIL("Expected true, got false")
 #define EXPECT_FALSE(x) if (!!x) FAIL("Expected false, got true")
 #define ASSERT_INT_EQUALS(x, y) if (x != y) FAIL("%d != %d", x, y)
 
+/* Taken from the master by wbmasterconn.c */
+uint32 WalSegSize = XLOG_SEG_SIZE;
+
+/* WAL built by the tests, starting at a segment boundary on timeline 1 */
+#define TEST_WAL_START 0x1000000
+#define TEST_WAL_LEN (4 * XLOG_BLCKSZ)
+static char testWal[TEST_WAL_LEN];
+static int testWalLen;
+static XLogRecPtr testWalPrev;
+
+static void
+test_wal_reset()
+{
+	memset(testWal, 0, sizeof(testWal));
+	testWalLen = 0;
+	testWalPrev = 0;
+}
+
+/*
+ * Start a new page, remLen is what is left of the record continued on it.
+ */
+static void
+test_wal_page(uint32 remLen)
+{
+	XLogLongPageHeader header = (XLogLongPageHeader) (testWal + testWalLen);
+	XLogRecPtr pageAddr = TEST_WAL_START + testWalLen;
+
+	header->std.xlp_magic = XLOG_PAGE_MAGIC_16;
+	header->std.xlp_tli = 1;
+	header->std.xlp_pageaddr = pageAddr;
+	if (remLen)
+	{
+		header->std.xlp_info |= XLP_FIRST_IS_CONTRECORD;
+		header->std.xlp_rem_len = remLen;
+	}
+	if (pageAddr % WalSegSize == 0)
+	{
+		header->std.xlp_info |= XLP_LONG_HEADER;
+		header->xlp_seg_size = WalSegSize;
+		header->xlp_xlog_blcksz = XLOG_BLCKSZ;
+	}
+	testWalLen += XLogPageHeaderSize(&header->std);
+}
+
+/*
+ * Append a record, with a page header in front of every page it continues on.
+ */
+static void
+test_wal_write(char *data, int len)
+{
+	while (len > 0)
+	{
+		int amount;
+
+		if (testWalLen % XLOG_BLCKSZ == 0)
+			test_wal_page(len);
+
+		amount = XLOG_BLCKSZ - testWalLen % XLOG_BLCKSZ;
+		if (amount > len)
+			amount = len;
+		memcpy(testWal + testWalLen, data, amount);
+		testWalLen += amount;
+		data += amount;
+		len -= amount;
+	}
+}
+
+/*
+ * Append a NOOP record of totalLen bytes and return where it starts.
+ */
+static XLogRecPtr
+test_wal_record(uint32 totalLen)
+{
+	char rec[XLOG_BLCKSZ];
+	XLogRecord *header = (XLogRecord *) rec;
+	uint32 dataLen = totalLen - REC_HEADER_LEN - SizeOfXLogRecordDataHeaderLong;
+	XLogRecPtr recordPtr;
+	int i;
+
+	testWalLen = MAXALIGN(testWalLen);
+	if (testWalLen % XLOG_BLCKSZ == 0)
+		test_wal_page(0);
+
+	memset(rec, 0, sizeof(rec));
+	header->xl_tot_len = totalLen;
+	header->xl_prev = testWalPrev;
+	header->xl_info = XLOG_NOOP;
+	header->xl_rmid = RM_XLOG_ID;
+	rec[REC_HEADER_LEN] = (char) XLR_BLOCK_ID_DATA_LONG;
+	memcpy(rec + REC_HEADER_LEN + 1, &dataLen, sizeof(dataLen));
+	for (i = REC_HEADER_LEN + SizeOfXLogRecordDataHeaderLong; i < totalLen; i++)
+		rec[i] = (char) i;
+
+	INIT_CRC32C(header->xl_crc);
+	COMP_CRC32C(header->xl_crc, rec + REC_HEADER_LEN, totalLen - REC_HEADER_LEN);
+	COMP_CRC32C(header->xl_crc, rec, offsetof(XLogRecord, xl_crc));
+	FIN_CRC32C(header->xl_crc);
+
+	recordPtr = TEST_WAL_START + testWalLen;
+	test_wal_write(rec, totalLen);
+	testWalPrev = recordPtr;
+	return recordPtr;
+}
+
+/*
+ * Run the filter over the test WAL from start, in messages of msgLen bytes.
+ * Returns false if it asked for a restart, at retryPos.
+ */
+static bool
+test_wal_filter(FilterData *fl, XLogRecPtr start, int msgLen, XLogRecPtr *retryPos)
+{
+	int pos = start - TEST_WAL_START;
+
+	while (pos < testWalLen)
+	{
+		ReplMessage msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.type = MSG_WAL_DATA;
+		msg.dataStart = TEST_WAL_START + pos;
+		msg.dataLen = pos + msgLen < testWalLen ? msgLen : testWalLen - pos;
+		msg.data = testWal + pos;
+		msg.nextPageBoundary = (XLOG_BLCKSZ - msg.dataStart) & (XLOG_BLCKSZ-1);
+
+		if (!WbFProcessWalDataBlock(&msg, fl, retryPos, XLOG_PAGE_MAGIC_16))
+			return false;
+		pos += msg.dataLen;
+	}
+	return true;
+}
+
+/*
+ * Run the filter over all of the test WAL in one message. Returns false if
+ * it was rejected.
+ */
+static bool
+test_wal_accepted()
+{
+	FilterData *fl = WbFCreateProcessingState(TEST_WAL_START);
+	jmp_buf handler;
+	XLogRecPtr retryPos;
+	volatile bool accepted = false;
+
+	if (setjmp(handler) == 0)
+	{
+		errorHandler = &handler;
+		accepted = test_wal_filter(fl, TEST_WAL_START, testWalLen, &retryPos);
+	}
+	errorHandler = NULL;
+	WbFFreeProcessingState(fl);
+	return accepted;
+}
+
 bool
 test_inet_parsing()
 {
@@ -50,6 +208,283 @@ test_hostmask_match()
 	return true;
 }
 
+bool
+test_byte_size_parsing()
+{
+	uint64 size = 0;
+
+	EXPECT_TRUE(parse_byte_size("8192", &size));
+	ASSERT_INT_EQUALS((int) size, 8192);
+	EXPECT_TRUE(parse_byte_size("16MB", &size));
+	ASSERT_INT_EQUALS((int) size, 16 * 1024 * 1024);
+	EXPECT_TRUE(parse_byte_size("1GB", &size));
+	ASSERT_INT_EQUALS((int) size, 1024 * 1024 * 1024);
+	EXPECT_TRUE(parse_byte_size("64kB", &size));
+	ASSERT_INT_EQUALS((int) size, 64 * 1024);
+
+	EXPECT_FALSE(parse_byte_size("", &size));
+	EXPECT_FALSE(parse_byte_size("MB", &size));
+	EXPECT_FALSE(parse_byte_size("16 MB", &size));
+	EXPECT_FALSE(parse_byte_size("-1", &size));
+
+	return true;
+}
+
+bool
+test_wal_index()
+{
+	XLogRecPtr recordPtr = 0;
+
+	WbWalIndexInit();
+
+	EXPECT_FALSE(WbWalIndexLookup(1, 0x1000000, &recordPtr));
+
+	WbWalIndexAdd(1, 0x1000000, 0xFFFF28);
+	EXPECT_TRUE(WbWalIndexLookup(1, 0x1000000, &recordPtr));
+	ASSERT_INT_EQUALS((int) recordPtr, 0xFFFF28);
+
+	/* Other timelines and pages are not found */
+	EXPECT_FALSE(WbWalIndexLookup(2, 0x1000000, &recordPtr));
+	EXPECT_FALSE(WbWalIndexLookup(1, 0x1002000, &recordPtr));
+
+	/* Newer page in the same entry replaces the old one */
+	WbWalIndexAdd(1, 0x1000000 + 65536 * 8192L, 0x5000100);
+	EXPECT_FALSE(WbWalIndexLookup(1, 0x1000000, &recordPtr));
+	EXPECT_TRUE(WbWalIndexLookup(1, 0x1000000 + 65536 * 8192L, &recordPtr));
+	ASSERT_INT_EQUALS((int) recordPtr, 0x5000100);
+
+	/*
+	 * A record starting in the last bytes of a page has its header split by
+	 * the next page header. The index still points at its beginning.
+	 */
+	{
+		FilterData *fl = WbFCreateProcessingState(TEST_WAL_START);
+		XLogRecPtr retryPos;
+		XLogRecPtr splitPtr;
+
+		WbWalIndexInit();
+		test_wal_reset();
+		test_wal_record(XLOG_BLCKSZ - SizeOfXLogLongPHD - 16);
+		splitPtr = test_wal_record(200);
+		ASSERT_INT_EQUALS((int) splitPtr, TEST_WAL_START + XLOG_BLCKSZ - 16);
+		test_wal_record(104);
+
+		EXPECT_TRUE(test_wal_filter(fl, TEST_WAL_START, testWalLen, &retryPos));
+		EXPECT_TRUE(WbWalIndexLookup(1, TEST_WAL_START + XLOG_BLCKSZ, &recordPtr));
+		ASSERT_INT_EQUALS((int) recordPtr, (int) splitPtr);
+
+		/* Same with a message ending inside the record header */
+		WbWalIndexInit();
+		WbFResetProcessingState(fl, TEST_WAL_START);
+		EXPECT_TRUE(test_wal_filter(fl, TEST_WAL_START, XLOG_BLCKSZ - 8, &retryPos));
+		EXPECT_TRUE(WbWalIndexLookup(1, TEST_WAL_START + XLOG_BLCKSZ, &recordPtr));
+		ASSERT_INT_EQUALS((int) recordPtr, (int) splitPtr);
+
+		WbFFreeProcessingState(fl);
+	}
+
+	return true;
+}
+
+bool
+test_crc32c_zero()
+{
+	static const char zeros[20000];
+	size_t lengths[] = {0, 1, 7, 8, 13, 64, 255, 4096, 8170, 19999};
+	int i;
+
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+	{
+		pg_crc32c expected;
+		pg_crc32c crc;
+
+		INIT_CRC32C(expected);
+		COMP_CRC32C(expected, "walbouncer", 10);
+		crc = expected;
+
+		expected = pg_comp_crc32c_sb8_zero(expected, zeros, lengths[i]);
+		COMP_CRC32C_ZERO(crc, lengths[i]);
+		ASSERT_INT_EQUALS(crc, expected);
+	}
+
+	return true;
+}
+
+/*
+ * Every CRC-32C implementation the CPU supports gives the same results as
+ * slicing-by-8, for all alignments and lengths around the lane boundaries.
+ */
+bool
+test_crc32c_variants()
+{
+	pg_crc32c (*variants[4]) (pg_crc32c crc, const void *data, size_t len);
+	static unsigned char buf[4096 + 8];
+	size_t lengths[] = {0, 1, 3, 4, 7, 8, 9, 31, 767, 768, 769, 1543, 4096};
+	int nvariants = 0;
+	pg_crc32c crc;
+	int i, j, k;
+
+	/* Known answer for the standard check string */
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, "123456789", 9);
+	FIN_CRC32C(crc);
+	ASSERT_INT_EQUALS(crc, 0xE3069283);
+
+	variants[nvariants++] = pg_comp_crc32c;
+#if defined(__x86_64__)
+	if (pg_crc32c_sse42_available())
+		variants[nvariants++] = pg_comp_crc32c_sse42;
+	if (pg_crc32c_pclmul_available())
+		variants[nvariants++] = pg_comp_crc32c_sse42_pclmul;
+#elif defined(__aarch64__)
+	if (pg_crc32c_armv8_available())
+		variants[nvariants++] = pg_comp_crc32c_armv8;
+#endif
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = (unsigned char) (i * 2654435761U >> 13);
+
+	for (i = 0; i < nvariants; i++)
+		for (j = 0; j < sizeof(lengths) / sizeof(lengths[0]); j++)
+			for (k = 0; k < 8; k++)
+			{
+				pg_crc32c expected = 0xFFFFFFFF;
+
+				if (k + lengths[j] > sizeof(buf))
+					continue;
+				expected = pg_comp_crc32c_sb8(expected, buf + k, lengths[j]);
+				crc = variants[i](0xFFFFFFFF, buf + k, lengths[j]);
+				ASSERT_INT_EQUALS(crc, expected);
+			}
+
+	return true;
+}
+
+/*
+ * A record failing the CRC check is fetched again. The records before it
+ * that were not sent yet are not skipped, the output stays contiguous.
+ */
+bool
+test_crc_retry()
+{
+	/* Within a message of 3000 bytes, and across the end of one */
+	int corrupted[] = {4, 5};
+	int c;
+
+	for (c = 0; c < sizeof(corrupted) / sizeof(corrupted[0]); c++)
+	{
+		FilterData *fl = WbFCreateProcessingState(TEST_WAL_START);
+		XLogRecPtr records[10];
+		XLogRecPtr sentPtr = TEST_WAL_START;
+		XLogRecPtr pos = TEST_WAL_START;
+		int corruptAt;
+		int restarts = 0;
+		int i;
+
+		test_wal_reset();
+		for (i = 0; i < 10; i++)
+			records[i] = test_wal_record(1000);
+		fl->verifyCrc = true;
+
+		corruptAt = records[corrupted[c]] + 100 - TEST_WAL_START;
+		testWal[corruptAt] ^= 0xFF;
+
+		while (pos < TEST_WAL_START + testWalLen)
+		{
+			ReplMessage msg;
+			FilterOutput out;
+			XLogRecPtr retryPos;
+			int offset = pos - TEST_WAL_START;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.type = MSG_WAL_DATA;
+			msg.dataStart = pos;
+			msg.dataLen = offset + 3000 < testWalLen ? 3000 : testWalLen - offset;
+			msg.data = testWal + offset;
+			msg.nextPageBoundary = (XLOG_BLCKSZ - msg.dataStart) & (XLOG_BLCKSZ-1);
+
+			if (!WbFProcessWalDataBlock(&msg, fl, &retryPos, XLOG_PAGE_MAGIC_16))
+			{
+				/* The master sends it intact the next time */
+				testWal[corruptAt] ^= 0xFF;
+				restarts++;
+				EXPECT_TRUE((retryPos <= sentPtr));
+				pos = retryPos;
+				continue;
+			}
+
+			if (WbFGetOutput(fl, &msg, &out))
+			{
+				ASSERT_INT_EQUALS((int) out.dataStart, (int) sentPtr);
+				if (out.prefixLen &&
+						memcmp(out.prefix, testWal + (out.dataStart - TEST_WAL_START), out.prefixLen))
+					FAIL("Held back data does not match the WAL");
+				sentPtr += out.prefixLen + out.dataLen;
+			}
+			pos += msg.dataLen;
+		}
+
+		ASSERT_INT_EQUALS(restarts, 1);
+		ASSERT_INT_EQUALS((int) sentPtr, TEST_WAL_START + testWalLen);
+		WbFFreeProcessingState(fl);
+	}
+
+	return true;
+}
+
+/*
+ * Page headers that don't match their position or the records around them
+ * are rejected.
+ */
+bool
+test_page_header_checks()
+{
+	XLogPageHeader first = (XLogPageHeader) testWal;
+	XLogPageHeader second = (XLogPageHeader) (testWal + XLOG_BLCKSZ);
+	int c;
+
+	for (c = 0; c < 6; c++)
+	{
+		int i;
+
+		test_wal_reset();
+		/* The third record continues on the second page */
+		for (i = 0; i < 4; i++)
+			test_wal_record(3000);
+
+		switch (c)
+		{
+			case 0:
+				EXPECT_TRUE(test_wal_accepted());
+				break;
+			case 1:
+				second->xlp_pageaddr += XLOG_BLCKSZ;
+				EXPECT_FALSE(test_wal_accepted());
+				break;
+			case 2:
+				second->xlp_magic = XLOG_PAGE_MAGIC_15;
+				EXPECT_FALSE(test_wal_accepted());
+				break;
+			case 3:
+				/* Segments start with a long header */
+				first->xlp_info &= ~XLP_LONG_HEADER;
+				EXPECT_FALSE(test_wal_accepted());
+				break;
+			case 4:
+				second->xlp_info &= ~XLP_FIRST_IS_CONTRECORD;
+				EXPECT_FALSE(test_wal_accepted());
+				break;
+			case 5:
+				/* Flag and length agree, but not with the record */
+				second->xlp_rem_len += 8;
+				EXPECT_FALSE(test_wal_accepted());
+				break;
+		}
+	}
+
+	return true;
+}
+
 int
 main()
 {
@@ -57,6 +492,12 @@ main()
 
 	failures += !test_inet_parsing();
 	failures += !test_hostmask_match();
+	failures += !test_byte_size_parsing();
+	failures += !test_wal_index();
+	failures += !test_crc32c_zero();
+	failures += !test_crc32c_variants();
+	failures += !test_crc_retry();
+	failures += !test_page_header_checks();
 
 	printf("Got %d failures\n", failures);
 	return failures > 0 ? 1 : 0;
@@ -1,19 +1,45 @@
+// For sched_setaffinity()
+#define _GNU_SOURCE
 #include "wbclientconn.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
 
 #include "wbsocket.h"
 #include "wbutils.h"
 #include "wbfilter.h"
+#include "wbhub.h"
+#include "wbmetacache.h"
+#include "wboidcache.h"
 #include "wbmasterconn.h"
+#include "wbpipeline.h"
+#include "wbpool.h"
+#include "wbreadahead.h"
+#include "wbspool.h"
+#include "wbwalindex.h"
+#include "wb_pg_config.h"
 
 #include "parser/parser.h"
+#include "parser/stringinfo.h"
 
 #define MAX_CONNINFO_LEN 4000
 #define NAPTIME 60000
+/* How often to look for names of objects created while streaming */
+#define CATALOG_CHECK_INTERVAL 1000000
+#define CATALOG_MAX_CHECK_INTERVAL 60000000
+/* Objects with lower OIDs are created by initdb */
+#define FIRST_NORMAL_OBJECT_ID 16384
+/* Steps a stream takes without waiting when it has a process of its own */
+#define STREAM_MAX_STEPS 64
+/* WAL is batched up to an eighth of the client lag, at most STREAM_MAX_BATCH */
+#define STREAM_BATCH_LAG_SHIFT 3
+#define STREAM_MAX_BATCH (256*1024)
+/* A client further behind than this is catching up */
+#define STREAM_CATCHUP_LAG (1024*1024)
 
 typedef struct {
 	int qtype;
@@ -27,6 +53,63 @@ typedef struct {
 	int valueLen;
 } ResultCol;
 
+/* Delay walbouncer adds, in microseconds */
+typedef struct {
+	uint64 count;
+	TimestampTz total;
+	TimestampTz max;
+} WbCCLatency;
+
+struct WbCCStream {
+	WbConn conn;
+	MasterConn *master;
+	ReplicationCommand *cmd;
+	ReplMessage *msg;
+	WbHubSubscriber *hubsub;
+	WbSpoolReader *spool;
+	FilterData *fl;
+	/* Nothing to filter or check, WAL is relayed as it is received */
+	bool passthrough;
+	int xlog_page_magic;
+	XLogRecPtr startReceivingFrom;
+	/* WAL waiting for the client to accept it, NULL if disabled */
+	WbReadAhead *readahead;
+	/* Receiver and sender threads, NULL if not pipelined */
+	WbPipeline *pipeline;
+	/* Source has ended, CopyDone is sent once the read-ahead is drained */
+	bool endPending;
+	bool endofwal;
+	/* Connection for looking up new databases and tablespaces, opened on demand */
+	MasterConn *catalog;
+	TimestampTz nextCatalogCheck;
+	/* Zero while nothing has stayed pending */
+	TimestampTz catalogCheckInterval;
+
+	/* WAL added to the output since the last flush, sent as one batch */
+	int batchBytes;
+	/* Batching while the client is behind, sending right away otherwise */
+	bool catchingUp;
+	uint64 lag;
+	TimestampTz regimeStart;
+	uint64 regimeBytes;
+	uint64 sentMessages;
+	uint64 sentBytes;
+	uint64 sends;
+	uint64 batchedMessages;
+
+	/* Synchronous replica, see latency_mode in the configuration */
+	bool latencyMode;
+	/* Poll without sleeping, on a CPU of our own */
+	bool spin;
+	/* When the WAL being sent was received, 0 if not timed */
+	TimestampTz walReceivedAt;
+	WbCCLatency walLatency;
+	WbCCLatency replyLatency;
+};
+
+/* The replication command parser is not reentrant */
+static pthread_mutex_t parserLock = PTHREAD_MUTEX_INITIALIZER;
+
 
 static int WbCCProcessStartupPacket(WbConn conn, bool SSLdone);
 static int WbCCReadCommand(WbConn conn, XfCommand *cmd);
@@ -35,13 +118,35 @@ static MasterConn* WbCCOpenConnectionToMaster(WbConn conn);
 static void ForbiddenInWalBouncer();
 static void WbCCBeginReportingGUCOptions(WbConn conn, MasterConn* master);
 static void WbCCReportGuc(WbConn conn, MasterConn* master, char *name);
-static void WbCCExecCommand(WbConn conn, MasterConn *master, char *query_string);
+static ReplicationCommand* WbCCParseCommand(char *query_string);
+static WbCCStream* WbCCExecCommand(WbConn conn, MasterConn *master, char *query_string, bool detachStream);
+static void WbCCCompleteCommand(WbConn conn, ReplicationCommand *cmd);
 static void WbCCExecIdentifySystem(WbConn conn, MasterConn *master);
-static bool WbCCWaitForData(WbConn conn, MasterConn *master);
-static void WbCCExecStartPhysical(WbConn conn, MasterConn *master, ReplicationCommand *cmd);
+static bool WbCCWaitForData(WbCCStream *stream);
+static bool WbCCWaitForPipeline(WbCCStream *stream);
+static WbCCStream* WbCCBeginStreaming(WbConn conn, MasterConn *master, ReplicationCommand *cmd);
+static void WbCCStartSource(WbCCStream *stream, FilterData *fl);
+static void WbCCFinishStream(WbCCStream *stream);
+static bool WbCCCanReadAhead(WbCCStream *stream);
+static bool WbCCHasQueuedOutput(WbCCStream *stream);
+static WbCCStreamState WbCCEndOfWal(WbCCStream *stream);
 static void WbCCExecTimeline(WbConn conn, MasterConn *master, ReplicationCommand *cmd);
 static void WbCCExecShow(WbConn conn, MasterConn *master, ReplicationCommand *cmd);
+static char* WbCCShowVariable(MasterConn *master, char *name);
+static void WbCCBuildCatalogConninfo(WbConn conn, const char *dbname, char *conninfo);
+static bool WbCCHasFilterClauses(wb_config_entry *entry);
 static void WbCCLookupFilteringOids(WbConn conn, FilterData *fl);
+static void WbCCLookupRelations(WbConn conn, FilterData *fl);
+static bool WbCCResolveRelations(WbConn conn, FilterData *fl, Oid dbOid, const char *dbName);
+static bool WbCCResolvePendingRelations(WbCCStream *stream);
+static void WbCCResolvePendingOids(WbCCStream *stream);
+static void WbCCReportFiltering(WbConn conn);
+static void WbCCReportNames(StringInfo buf, const char *title, char **names, int n);
+static void WbCCLogFilterStats(FilterData *fl);
+static void WbCCLogStreamStats(WbCCStream *stream);
+static void WbCCStartLatencyMode(WbCCStream *stream, wb_config_entry *entry);
+static void WbCCRecordLatency(WbCCLatency *latency, TimestampTz start);
+static void WbCCLogLatency(WbCCStream *stream);
 //static void WbCCSendWALRecord(XfConn conn, char *data, int len, XLogRecPtr sentPtr, TimestampTz lastSend);
 //static void WbCCSendEndOfWal(XfConn conn);
 static void WbCCProcessRepliesIfAny(WbConn conn);
@@ -49,9 +154,16 @@ static void WbCCProcessReplyMessage(WbConn conn);
 static void WbCCProcessStandbyReplyMessage(WbConn conn, WbMessage *msg);
 static void WbCCSendKeepalive(WbConn conn, bool request_reply);
 static void WbCCProcessStandbyHSFeedbackMessage(WbConn conn, WbMessage *msg);
-static void WbCCForwardPendingReplies(WbConn conn, MasterConn* master);
+static void WbCCForwardPendingReplies(WbConn conn, MasterConn* master, WbHubSubscriber *hubsub);
 static void WbCCSendCopyBothResponse(WbConn conn);
-static void WbCCSendWalBlock(WbConn conn, ReplMessage *msg, FilterData *fl);
+static void WbCCSendWalBlock(WbCCStream *stream, ReplMessage *msg);
+static void WbCCRelayBlock(WbCCStream *stream, ReplMessage *msg);
+static void WbCCQueueWalOutput(WbCCStream *stream, FilterOutput *out);
+static bool WbCCBatchWalOutput(WbCCStream *stream, FilterOutput *out, bool stable);
+static void WbCCUpdateRegime(WbCCStream *stream, uint64 lag);
+static void WbCCFlushBatch(WbCCStream *stream);
+static void WbCCFlush(WbCCStream *stream);
+static void WbCCSendWalOutput(WbCCStream *stream, FilterOutput *out, bool stable, bool flush);
 static void WbCCSendResultset(WbConn conn, int ncols, ResultCol *cols);
 static void WbCCSendErrorReport(WbConn conn, LogLevel level, char *message, char* detail);
 
@@ -328,8 +440,17 @@ retry1:
 void
 WbCCCommandLoop(WbConn conn)
 {
-	int firstchar;
-	bool send_ready_for_query = true;
+	MasterConn* master = WbCCStartSession(conn);
+
+	WbCCRunCommands(conn, master, false);
+}
+
+/*
+ * Connect to master on behalf of an authenticated client.
+ */
+MasterConn*
+WbCCStartSession(WbConn conn)
+{
 	MasterConn* master = WbCCOpenConnectionToMaster(conn);
 
 	WbCCBeginReportingGUCOptions(conn, master);
@@ -340,6 +461,21 @@ WbCCCommandLoop(WbConn conn)
 	ConnSendInt(conn, 0, 4); // Cancel key
 	ConnEndMessage(conn);
 
+	return master;
+}
+
+/*
+ * Execute commands until the client disconnects. With detachStream the
+ * stream is returned as soon as the client starts streaming, instead of
+ * being run to completion here. The caller has to finish it with
+ * WbCCEndStreaming() and then continue by calling us again.
+ */
+WbCCStream*
+WbCCRunCommands(WbConn conn, MasterConn *master, bool detachStream)
+{
+	int firstchar;
+	bool send_ready_for_query = true;
+
 	// set up error handling
 
 	for (;;)
@@ -359,7 +495,14 @@ WbCCCommandLoop(WbConn conn)
 		{
 			case 'Q':
 				{
-					WbCCExecCommand(conn, master, cmd.msg->data);
+					WbCCStream *stream;
+
+					stream = WbCCExecCommand(conn, master, cmd.msg->data, detachStream);
+					if (stream)
+					{
+						ConnFreeMessage(cmd.msg);
+						return stream;
+					}
 					send_ready_for_query = true;
 
 					/*char *query_string = pq_getmsgstgring(msg);
@@ -389,7 +532,7 @@ WbCCCommandLoop(WbConn conn)
 				// TODO: do something here?
 				if (cmd.msg)
 					ConnFreeMessage(cmd.msg);
-				return;
+				return NULL;
 			case 'd':
 			case 'c':
 			case 'f':
@@ -458,6 +601,13 @@ WbCCOpenConnectionToMaster(WbConn conn)
 
 	buf += snprintf(buf, buf_end - buf, "dbname=replication replication=true application_name=walbouncer");
 
+	master = WbPoolTakeMasterConn(conn->user_name, true);
+	if (master)
+	{
+		log_info("Connected to master ahead of time");
+		return master;
+	}
+
 	log_info("Start connecting to %s", conninfo);
 	master = WbMcOpenConnection(conninfo);
 	log_info("Connected to master");
@@ -493,19 +643,44 @@ WbCCReportGuc(WbConn conn, MasterConn* master, char *name)
 	ConnEndMessage(conn);
 }
 
-static void
-WbCCExecCommand(WbConn conn, MasterConn *master, char *query_string)
+static ReplicationCommand*
+WbCCParseCommand(char *query_string)
 {
-	int parse_rc;
 	ReplicationCommand *cmd;
+	jmp_buf *outerHandler = errorHandler;
+	jmp_buf parseErrorHandler;
+	int parse_rc;
+
+	pthread_mutex_lock(&parserLock);
+
+	// Release the parser before passing on syntax errors
+	if (setjmp(parseErrorHandler))
+	{
+		errorHandler = outerHandler;
+		pthread_mutex_unlock(&parserLock);
+		error("Parse failed");
+	}
+	errorHandler = &parseErrorHandler;
 
 	replication_scanner_init(query_string);
 	parse_rc = replication_yyparse();
+	cmd = replication_parse_result;
+
+	errorHandler = outerHandler;
+	pthread_mutex_unlock(&parserLock);
 
 	if (parse_rc != 0)
 		error("Parse failed");
 
-	cmd = replication_parse_result;
+	return cmd;
+}
+
+static WbCCStream*
+WbCCExecCommand(WbConn conn, MasterConn *master, char *query_string, bool detachStream)
+{
+	ReplicationCommand *cmd;
+
+	cmd = WbCCParseCommand(query_string);
 
 	log_info("Received query from client: %s", query_string);
 
@@ -520,8 +695,34 @@ WbCCExecCommand(WbConn conn, MasterConn *master, char *query_string)
 			error("Command not supported");
 			break;
 		case REPL_START_PHYSICAL:
-			WbCCExecStartPhysical(conn, master, cmd);
+		{
+			WbCCStream *stream = WbCCBeginStreaming(conn, master, cmd);
+
+			// Command is completed by WbCCEndStreaming()
+			if (detachStream)
+				return stream;
+
+			for (;;)
+			{
+				WbCCStreamState state = STREAM_BUSY;
+				int steps;
+
+				if (!DaemonIsAlive())
+					error("Master died, exiting!");
+
+				if (!WbCCWaitForData(stream))
+					continue;
+
+				/* Drain what can be received without waiting */
+				for (steps = 0; steps < STREAM_MAX_STEPS && state == STREAM_BUSY; steps++)
+					state = WbCCStreamStep(stream);
+
+				if (state == STREAM_DONE)
+					break;
+			}
+			WbCCFinishStream(stream);
 			break;
+		}
 		case REPL_START_LOGICAL:
 			error("Command not supported");
 			break;
@@ -533,7 +734,13 @@ WbCCExecCommand(WbConn conn, MasterConn *master, char *query_string)
 			break;
 	}
 
+	WbCCCompleteCommand(conn, cmd);
+	return NULL;
+}
 
+static void
+WbCCCompleteCommand(WbConn conn, ReplicationCommand *cmd)
+{
 	ConnBeginMessage(conn, 'C');
 	ConnSendString(conn, "SELECT");
 	ConnEndMessage(conn);
@@ -555,11 +762,19 @@ WbCCExecIdentifySystem(WbConn conn, MasterConn *master)
 	char *primary_xpos;
 	char *dbname = NULL;
 
-	if (!WbMcIdentifySystem(master,
-			&primary_sysid,
-			&primary_tli,
-			&primary_xpos))
-		error("Identify system failed.");
+	if (WbMetaGetIdentify(&primary_sysid, &primary_tli, &primary_xpos))
+	{
+		log_debug1("Using cached system information");
+	}
+	else
+	{
+		if (!WbMcIdentifySystem(master,
+				&primary_sysid,
+				&primary_tli,
+				&primary_xpos))
+			error("Identify system failed.");
+		WbMetaPutIdentify(primary_sysid, primary_tli, primary_xpos);
+	}
 
 	log_info("Received system information from master:\n"
 			"    System identifier: %s\n"
@@ -590,34 +805,132 @@ WbCCExecIdentifySystem(WbConn conn, MasterConn *master)
  * Returns true if anything interesting happened.
  */
 static bool
-WbCCWaitForData(WbConn conn, MasterConn *master)
+WbCCWaitForData(WbCCStream *stream)
 {
+	WbConn conn = stream->conn;
+	WbHubSubscriber *hubsub = stream->hubsub;
 	struct pollfd fds[2];
 	int ret;
 	int numfds = 0;
+	/* Spinning checks again right away */
+	int timeout = stream->spin ? 0 : NAPTIME;
+
+	if (stream->pipeline)
+		return WbCCWaitForPipeline(stream);
 
 	fds[numfds].fd = ConnGetSocket(conn);
 	fds[numfds].events = POLLIN | POLLERR;
 	fds[numfds].revents = 0;
 	numfds++;
 
-	if (ConnHasDataToFlush(conn))
+	if (ConnHasDataToFlush(conn) && !WbCCCanReadAhead(stream))
 	{
 		/*
-		 * If we are in process of flushing out a message to slave we only
-		 * care if we can resume sending or the slave has sent us a reply
-		 * message we need to relay back to the master.
+		 * If we are in process of flushing out a message to slave and have
+		 * no room to read ahead, we only care if we can resume sending or
+		 * the slave has sent us a reply message we need to relay back to
+		 * the master.
 		 *
 		 * We don't care about failed master connections at this point as we
 		 * want to finish sending processed WAL out.
 		 **/
 		 fds[0].events |= POLLOUT;
+	} else if (!ConnHasDataToFlush(conn) && WbCCHasQueuedOutput(stream)) {
+		/* Client is ready for WAL we have read ahead */
+		timeout = 0;
+	} else if (hubsub) {
+		/*
+		 * When reading from the hub we get woken up when new data is added
+		 * to the buffer. The wakeup might have been consumed already while
+		 * there is still data left, don't sleep in that case.
+		 */
+		fds[numfds].fd = WbHubGetSocket(hubsub);
+		fds[numfds].events = POLLIN | POLLERR;
+		fds[numfds].revents = 0;
+		numfds++;
+
+		if (WbHubHasData(hubsub))
+			timeout = 0;
+		if (ConnHasDataToFlush(conn))
+			fds[0].events |= POLLOUT;
+	} else if (stream->spool) {
+		/* Spooled WAL can be read right away */
+		timeout = 0;
 	} else {
 		/*
 		 * If we are finished forwarding data to the the slave we want to get
 		 * a new message from the master.
 		 */
-		fds[numfds].fd = WbMcGetSocket(master);
+		fds[numfds].fd = WbMcGetSocket(stream->master);
+		if (fds[numfds].fd == -1)
+			error("Master socket has been closed");
+		fds[numfds].events = POLLIN | POLLERR;
+		fds[numfds].revents = 0;
+		numfds++;
+		if (ConnHasDataToFlush(conn))
+			fds[0].events |= POLLOUT;
+	}
+
+	log_debug2("Waiting up to %dms on %d file descriptors", timeout, numfds);
+	ret = poll(fds, numfds, timeout);
+
+	if ((ret == 0 && timeout != 0) || (ret < 0 && errno == EINTR))
+		return false;
+
+	return true;
+}
+
+/*
+ * WbCCWaitForData() for pipelined streams. The pipeline threads wake us up
+ * when WAL has been received or the client has taken output.
+ */
+static bool
+WbCCWaitForPipeline(WbCCStream *stream)
+{
+	WbConn conn = stream->conn;
+	WbPipeline *pipeline = stream->pipeline;
+	struct pollfd fds[3];
+	int ret;
+	int numfds = 0;
+	int timeout = NAPTIME;
+	/* Output the send queue had no room for */
+	bool blocked = ConnHasDataToFlush(conn) && !stream->batchBytes;
+	bool wantSource;
+
+	if (blocked)
+		wantSource = WbCCCanReadAhead(stream);
+	else
+		wantSource = !WbCCHasQueuedOutput(stream);
+
+	fds[numfds].fd = ConnGetSocket(conn);
+	fds[numfds].events = POLLIN | POLLERR;
+	fds[numfds].revents = 0;
+	numfds++;
+
+	fds[numfds].fd = WbPipeGetSocket(pipeline);
+	fds[numfds].events = POLLIN;
+	fds[numfds].revents = 0;
+	numfds++;
+
+	if (!blocked && !wantSource) {
+		/* Read-ahead WAL goes out first */
+		timeout = 0;
+	} else if (WbPipeIsReady(pipeline, wantSource && WbPipeIsReceiving(pipeline), blocked)) {
+		timeout = 0;
+	} else if (!wantSource || WbPipeIsReceiving(pipeline)) {
+		/* Nothing else to wait for */
+	} else if (stream->hubsub) {
+		fds[numfds].fd = WbHubGetSocket(stream->hubsub);
+		fds[numfds].events = POLLIN | POLLERR;
+		fds[numfds].revents = 0;
+		numfds++;
+
+		if (WbHubHasData(stream->hubsub))
+			timeout = 0;
+	} else if (stream->spool) {
+		timeout = 0;
+	} else {
+		fds[numfds].fd = WbMcGetSocket(stream->master);
 		if (fds[numfds].fd == -1)
 			error("Master socket has been closed");
 		fds[numfds].events = POLLIN | POLLERR;
@@ -625,10 +938,10 @@ WbCCWaitForData(WbConn conn, MasterConn *master)
 		numfds++;
 	}
 
-	log_debug2("Waiting up to %dms on %d file descriptors", NAPTIME, numfds);
-	ret = poll(fds, numfds, NAPTIME);
+	log_debug2("Waiting up to %dms on %d file descriptors", timeout, numfds);
+	ret = poll(fds, numfds, timeout);
 
-	if (ret == 0 || (ret < 0 && errno == EINTR))
+	if ((ret == 0 && timeout != 0) || (ret < 0 && errno == EINTR))
 		return false;
 
 	return true;
@@ -702,150 +1015,536 @@ WbCCSendResultset(WbConn conn, int ncols, ResultCol *cols)
 }
 
 
-static void
-WbCCExecStartPhysical(WbConn conn, MasterConn *master, ReplicationCommand *cmd)
+/*
+ * Start streaming WAL to the client. The stream is then driven by
+ * WbCCStreamStep() until it is done.
+ */
+static WbCCStream*
+WbCCBeginStreaming(WbConn conn, MasterConn *master, ReplicationCommand *cmd)
 {
-	bool endofwal = false;
-	XLogRecPtr startReceivingFrom;
-	ReplMessage *msg = wballoc(sizeof(ReplMessage));
-	FilterData *fl = WbFCreateProcessingState(cmd->startpoint);
+	WbCCStream *stream = wballoc0(sizeof(WbCCStream));
 	int server_version, xlog_page_magic;
 
+	stream->conn = conn;
+	stream->master = master;
+	stream->cmd = cmd;
+	stream->msg = wballoc(sizeof(ReplMessage));
+
+	{
+		char *segSize = WbCCShowVariable(master, "wal_segment_size");
+		char *blockSize = WbCCShowVariable(master, "wal_block_size");
+
+		WbMcSetWalGeometry(segSize, blockSize);
+		wbfree(segSize);
+		wbfree(blockSize);
+	}
+	stream->fl = WbFCreateProcessingState(cmd->startpoint);
+	stream->fl->verifyCrc = CurrentConfig->verify_crc;
+
 	/*
 	 * Each page of XLOG file has a header like this:
 	 */
-	server_version = atoi(WbMcShowVariable(master, "server_version_num"));
-	if (server_version >= 180000)
-		xlog_page_magic = 0xD118;
-	else if (server_version >= 170000)
-		xlog_page_magic = 0xD116;
-	else if (server_version >= 160000)
-		xlog_page_magic = 0xD113;
-	else if (server_version >= 150000)
-		xlog_page_magic = 0xD110;
-	else if (server_version >= 140000)
-		xlog_page_magic = 0xD10D;
-	else if (server_version >= 130000)
-		xlog_page_magic = 0xD106;
-	else
+	{
+		char *version = WbCCShowVariable(master, "server_version_num");
+
+		server_version = atoi(version);
+		wbfree(version);
+	}
+	xlog_page_magic = WbFPageMagicForVersion(server_version);
+	if (!xlog_page_magic)
 		error("Unsupported master version %d", server_version);
+	stream->xlog_page_magic = xlog_page_magic;
+
+	WbCCLookupFilteringOids(conn, stream->fl);
+
+	stream->passthrough = !WbCCHasFilterClauses(conn->configEntry) &&
+			!stream->fl->verifyCrc;
+	if (stream->passthrough)
+		log_info("No filtering configured, relaying WAL as received");
+
+	if (conn->configEntry && conn->configEntry->latency_mode.enabled)
+		WbCCStartLatencyMode(stream, conn->configEntry);
+
+	/* Synchronous replicas would wait for the handoffs between threads */
+	if (CurrentConfig->pipeline && !stream->latencyMode)
+	{
+		if (CurrentConfig->worker_threads)
+		{
+			log_warning("Pipelined streaming is not available with worker threads");
+		}
+		else
+			stream->pipeline = WbPipeCreate(conn);
+	}
 
-	WbCCLookupFilteringOids(conn, fl);
+	/* The sender thread sends copies */
+	if (CurrentConfig->zerocopy_threshold && WbSpoolEnabled() && !stream->pipeline &&
+			!ConnEnableZeroCopy(conn, CurrentConfig->zerocopy_threshold * 1024))
+		log_warning("Zero copy sending is not supported, sending spooled WAL normally");
 
 	WbCCSendCopyBothResponse(conn);
 
-	startReceivingFrom = cmd->startpoint;
-again:
-	WbMcStartStreaming(master, startReceivingFrom, cmd->timeline);
+	stream->startReceivingFrom = cmd->startpoint;
+	stream->readahead = WbRaCreate();
+	stream->regimeStart = GetCurrentTimestamp();
+	WbCCStartSource(stream, stream->fl);
 
-	while (!endofwal)
+	return stream;
+}
+
+/*
+ * Start receiving WAL at startReceivingFrom. The hub is preferred, then the
+ * spool, and the master only when neither has the WAL. If fl is given the
+ * hub may provide WAL that is already filtered.
+ */
+static void
+WbCCStartSource(WbCCStream *stream, FilterData *fl)
+{
+	/* The hub would report our progress to the master in its own time */
+	if (!stream->latencyMode)
+		stream->hubsub = WbHubSubscribe(stream->cmd->timeline,
+				stream->startReceivingFrom, fl, stream->xlog_page_magic);
+	if (stream->hubsub)
 	{
-		if (!DaemonIsAlive())
-			error("Master died, exiting!");
+		/* Our WAL sender on the master would only sit idle */
+		if (WbMcIsConnected(stream->master))
+		{
+			log_info("Streaming from the hub, disconnecting from master");
+			WbMcDisconnect(stream->master);
+		}
+		return;
+	}
 
-		if (!WbCCWaitForData(conn, master))
-			continue;
+	stream->spool = WbSpoolOpen(stream->cmd->timeline, stream->startReceivingFrom);
+	if (stream->spool)
+		return;
 
-		WbCCProcessRepliesIfAny(conn);
-		WbCCForwardPendingReplies(conn, master);
+	/*
+	 * Starting on a continuation record makes the filter ask for a restart
+	 * at the beginning of the record. If we already know where it begins,
+	 * start there right away. Relayed WAL starts where the client asked.
+	 */
+	if (!stream->passthrough && !WbFIsSynchronized(stream->fl) &&
+			stream->startReceivingFrom % XLOG_BLCKSZ == 0)
+	{
+		XLogRecPtr recordPtr;
 
-		if (ConnHasDataToFlush(conn))
+		if (WbWalIndexLookup(stream->cmd->timeline, stream->startReceivingFrom, &recordPtr) &&
+				recordPtr < stream->startReceivingFrom)
 		{
-			ConnFlush(conn, FLUSH_ASYNC);
-			continue;
+			log_info("Starting at record beginning at %X/%X instead of %X/%X",
+					FormatRecPtr(recordPtr), FormatRecPtr(stream->startReceivingFrom));
+			stream->startReceivingFrom = recordPtr;
 		}
+	}
 
-		if (conn->copyDoneSent && conn->copyDoneReceived)
-			break;
+	if (!WbMcIsConnected(stream->master))
+	{
+		log_info("Reconnecting to master");
+		WbMcReconnect(stream->master);
+	}
+	WbMcStartStreaming(stream->master, stream->startReceivingFrom,
+			stream->cmd->timeline);
+	if (stream->pipeline)
+		WbPipeStartReceiving(stream->pipeline, stream->master);
+}
+
+/*
+ * Do one round of work on the stream without waiting: process replies from
+ * the client, flush pending output, or receive and send out one message.
+ */
+WbCCStreamState
+WbCCStreamStep(WbCCStream *stream)
+{
+	WbConn conn = stream->conn;
+	MasterConn *master = stream->master;
+	ReplMessage *msg = stream->msg;
+	FilterData *fl = stream->fl;
+	bool received;
+	TimestampTz replyStart;
+	bool timeReply;
+
+	if (stream->endofwal)
+		return STREAM_DONE;
+
+	/* Replies go to the master before anything else */
+	replyStart = stream->latencyMode ? GetCurrentTimestamp() : 0;
+	WbCCProcessRepliesIfAny(conn);
+	timeReply = replyStart && !conn->replyForwarded;
+	WbCCForwardPendingReplies(conn, master, stream->hubsub);
+	if (timeReply)
+		WbCCRecordLatency(&stream->replyLatency, replyStart);
+
+	/* A batch being collected is not waiting for the client */
+	if (ConnHasDataToFlush(conn) && !stream->batchBytes)
+	{
+		WbCCFlush(stream);
+		if (!ConnHasDataToFlush(conn))
+		{
+			if (stream->walReceivedAt)
+				WbCCRecordLatency(&stream->walLatency, stream->walReceivedAt);
+			stream->walReceivedAt = 0;
+			return STREAM_BUSY;
+		}
+		/* Keep receiving while the client catches up, if there is room */
+		if (!WbCCCanReadAhead(stream))
+			return STREAM_IDLE;
+	}
+	else if (stream->readahead && !WbRaIsEmpty(stream->readahead))
+	{
+		FilterOutput out;
+
+		WbRaGet(stream->readahead, &out);
+		WbCCSendWalOutput(stream, &out, false, true);
+		return STREAM_BUSY;
+	}
+	else if (stream->endPending)
+		return WbCCEndOfWal(stream);
+
+	if (conn->copyDoneSent && conn->copyDoneReceived)
+		return STREAM_DONE;
+
+	if (stream->hubsub)
+		received = WbHubReceiveWalMessage(stream->hubsub, msg);
+	else if (stream->spool)
+		received = WbSpoolReceiveWalMessage(stream->spool, msg);
+	else if (stream->pipeline && WbPipeIsReceiving(stream->pipeline))
+		received = WbPipeReceiveWalMessage(stream->pipeline, msg);
+	else
+		received = WbMcReceiveWalMessage(master, msg);
+
+	if (!received)
+	{
+		/* Nothing more without waiting, send out what we have */
+		WbCCFlushBatch(stream);
+		return STREAM_IDLE;
+	}
+
+	/* Timed from the earliest WAL the client does not have yet */
+	if (stream->latencyMode && msg->type == MSG_WAL_DATA &&
+			!stream->walReceivedAt)
+		stream->walReceivedAt = GetCurrentTimestamp();
 
-		if (WbMcReceiveWalMessage(master, msg))
+	switch (msg->type)
+	{
+		case MSG_END_OF_WAL:
+			if (stream->hubsub && WbHubIsFiltered(stream->hubsub))
+			{
+				/*
+				 * Shared filtered stream is gone. Our own filter has
+				 * not seen any of the data, so resynchronize it from
+				 * the start of the page, sending only what the client
+				 * does not have yet.
+				 */
+				XLogRecPtr resumePtr = WbHubGetReadPtr(stream->hubsub);
+
+				WbHubUnsubscribe(stream->hubsub);
+				WbFResetProcessingState(fl, resumePtr);
+				stream->startReceivingFrom = resumePtr - resumePtr % XLOG_BLCKSZ;
+				log_info("Lost filtered hub stream, filtering from %X/%X",
+						FormatRecPtr(stream->startReceivingFrom));
+				WbCCStartSource(stream, NULL);
+				break;
+			}
+			if (stream->hubsub)
+			{
+				/*
+				 * We fell behind the hub buffer or the hub went away.
+				 * Continue seamlessly with our own master connection.
+				 */
+				stream->startReceivingFrom = WbHubGetReadPtr(stream->hubsub);
+				WbHubUnsubscribe(stream->hubsub);
+				stream->hubsub = NULL;
+				log_info("Lost hub stream at %X/%X",
+						FormatRecPtr(stream->startReceivingFrom));
+				WbCCStartSource(stream, NULL);
+				break;
+			}
+			if (stream->spool)
+			{
+				/* Caught up with the spool, continue with live WAL */
+				stream->startReceivingFrom = WbSpoolGetReadPtr(stream->spool);
+				WbSpoolClose(stream->spool);
+				stream->spool = NULL;
+				log_info("Reached end of spool at %X/%X",
+						FormatRecPtr(stream->startReceivingFrom));
+				WbCCStartSource(stream, NULL);
+				break;
+			}
+			if (stream->readahead && !WbRaIsEmpty(stream->readahead))
+			{
+				/* Send out what we have read ahead first */
+				stream->endPending = true;
+				break;
+			}
+			return WbCCEndOfWal(stream);
+		case MSG_WAL_DATA:
 		{
-			switch (msg->type)
+			XLogRecPtr restartPos;
+			if (stream->passthrough ||
+					(stream->hubsub && WbHubIsFiltered(stream->hubsub)))
 			{
-				case MSG_END_OF_WAL:
-					log_info("End of WAL");
-					log_debug1("Sending CopyDone to client");
-					ConnBeginMessage(conn, 'c');
-					ConnEndMessage(conn);
-					// TODO handle waiting for client CopyDone reply.
-					endofwal = true;
-					break;
-				case MSG_WAL_DATA:
+				WbCCRelayBlock(stream, msg);
+				break;
+			}
+			if (!WbFProcessWalDataBlock(msg, fl, &restartPos, stream->xlog_page_magic))
+			{
+				stream->startReceivingFrom = restartPos;
+				if (stream->hubsub)
 				{
-					XLogRecPtr restartPos;
-					if (!WbFProcessWalDataBlock(msg, fl, &restartPos, xlog_page_magic))
-					{
-						WbMcEndStreaming(master, NULL, NULL);
-						startReceivingFrom = restartPos;
-						goto again;
-					}
-					WbCCSendWalBlock(conn, msg, fl);
-					break;
+					if (WbHubSeek(stream->hubsub, restartPos))
+						break;
+					WbHubUnsubscribe(stream->hubsub);
+					stream->hubsub = NULL;
 				}
-				case MSG_KEEPALIVE:
-					conn->lastSend = msg->sendTime;
-					WbCCSendKeepalive(conn, msg->replyRequested);
-					break;
-				case MSG_NOTHING:
-					// Nothing received, we loop back around and wait for data.
+				else if (stream->spool)
+				{
+					WbSpoolSeek(stream->spool, restartPos);
 					break;
+				}
+				else
+				{
+					if (stream->pipeline)
+						WbPipeStopReceiving(stream->pipeline);
+					WbMcEndStreaming(master, NULL, NULL);
+				}
+				WbCCStartSource(stream, NULL);
+				break;
 			}
+			if (WbFHasPendingOids(fl))
+				WbCCResolvePendingOids(stream);
+			WbCCSendWalBlock(stream, msg);
+			break;
 		}
+		case MSG_KEEPALIVE:
+			conn->lastSend = msg->sendTime;
+			WbCCSendKeepalive(conn, msg->replyRequested);
+			WbCCFlushBatch(stream);
+			break;
+		case MSG_NOTHING:
+			// Nothing received, we loop back around and wait for data.
+			break;
 	}
-	{
-		TimeLineID nextTli;
-		char *nextTliStart;
-		WbMcEndStreaming(master, &nextTli, &nextTliStart);
 
-		if (nextTli && nextTliStart)
-		{
-			ResultCol cols[2] = {
-					{ "next_tli", INT8OID, &nextTli, 0},
-					{ "next_tli_startpos", TEXTOID, nextTliStart, 0}
-			};
-			WbCCSendResultset(conn, 2, cols);
-			wbfree(nextTliStart);
-		}
-		ConnBeginMessage(conn, 'C');
-		ConnSendString(conn, "START_STREAMING");
-		ConnEndMessage(conn);
-	}
+	return STREAM_BUSY;
+}
 
-	WbFFreeProcessingState(fl);
-	wbfree(msg);
+static WbCCStreamState
+WbCCEndOfWal(WbCCStream *stream)
+{
+	log_info("End of WAL");
+	WbCCFlushBatch(stream);
+	log_debug1("Sending CopyDone to client");
+	ConnBeginMessage(stream->conn, 'c');
+	ConnEndMessage(stream->conn);
+	// TODO handle waiting for client CopyDone reply.
+	stream->endPending = false;
+	stream->endofwal = true;
+	return STREAM_DONE;
 }
 
-static void
-WbCCExecTimeline(WbConn conn, MasterConn *master, ReplicationCommand *cmd)
+/*
+ * True if we may receive more WAL while the client has not accepted what we
+ * sent so far.
+ */
+static bool
+WbCCCanReadAhead(WbCCStream *stream)
 {
-	TimelineHistory history;
+	return stream->readahead && !stream->endPending &&
+			!WbRaIsFull(stream->readahead);
+}
 
-	log_info("Received request for timeline %d", cmd->timeline);
+/*
+ * True if there is something to send before receiving more WAL.
+ */
+static bool
+WbCCHasQueuedOutput(WbCCStream *stream)
+{
+	return stream->endPending ||
+			(stream->readahead && !WbRaIsEmpty(stream->readahead));
+}
 
-	WbMcGetTimelineHistory(master, cmd->timeline, &history);
+/*
+ * Tell an event loop what the stream is waiting for, the counterpart of
+ * WbCCWaitForData(). Returns the descriptor WAL is received from and sets
+ * wantSource if it should be waited on, wantWrite if we wait for the client
+ * to accept more data, and ready if there is work to do without waiting.
+ */
+int
+WbCCStreamGetEvents(WbCCStream *stream, bool *wantSource, bool *wantWrite, bool *ready)
+{
+	int fd;
 
+	*wantWrite = ConnHasDataToFlush(stream->conn) && !stream->batchBytes;
+	if (*wantWrite)
 	{
-		ResultCol cols[2] = {
-				{ "filename", TEXTOID, history.filename, 0},
-				{ "content", BYTEAOID, history.content, history.contentLen}
-		};
-		WbCCSendResultset(conn, 2, cols);
+		*wantSource = WbCCCanReadAhead(stream);
+		*ready = false;
+	}
+	else
+	{
+		/* Read-ahead WAL goes out before we receive more */
+		*ready = WbCCHasQueuedOutput(stream);
+		*wantSource = !*ready;
 	}
 
-	log_info("Sending out timeline history file %s", history.filename);
+	if (stream->hubsub)
+	{
+		fd = WbHubGetSocket(stream->hubsub);
+		*ready |= *wantSource && WbHubHasData(stream->hubsub);
+	}
+	else if (stream->spool)
+	{
+		/* Nothing to wait for but the client */
+		fd = -1;
+		*ready |= *wantSource;
+	}
+	else
+	{
+		fd = WbMcGetSocket(stream->master);
+		if (fd == -1)
+			error("Master socket has been closed");
+	}
 
-	wbfree(history.filename);
-	wbfree(history.content);
+	return fd;
 }
 
 static void
-WbCCExecShow(WbConn conn, MasterConn *master, ReplicationCommand *cmd)
+WbCCFinishStream(WbCCStream *stream)
 {
-	char	*value;
+	WbConn conn = stream->conn;
 
-	log_info("Received request for variable %s", cmd->varname);
+	/* Queued output goes out before the rest, directly */
+	if (stream->pipeline)
+	{
+		bool sent = WbPipeFree(stream->pipeline, true);
 
-	value = WbMcShowVariable(master, cmd->varname);
+		stream->pipeline = NULL;
+		if (!sent)
+			error("Could not send the remaining WAL to client");
+	}
+
+	if (stream->hubsub)
+	{
+		/* Master connection is not streaming, nothing to end there */
+		WbHubUnsubscribe(stream->hubsub);
+		stream->hubsub = NULL;
+	}
+	else if (stream->spool)
+	{
+		WbSpoolClose(stream->spool);
+		stream->spool = NULL;
+	}
+	else
+	{
+		TimeLineID nextTli;
+		char *nextTliStart;
+		WbMcEndStreaming(stream->master, &nextTli, &nextTliStart);
+
+		if (nextTli && nextTliStart)
+		{
+			ResultCol cols[2] = {
+					{ "next_tli", INT8OID, &nextTli, 0},
+					{ "next_tli_startpos", TEXTOID, nextTliStart, 0}
+			};
+			WbCCSendResultset(conn, 2, cols);
+			wbfree(nextTliStart);
+		}
+	}
+
+	/* Further commands go to the master */
+	if (!WbMcIsConnected(stream->master))
+		WbMcReconnect(stream->master);
+
+	ConnBeginMessage(conn, 'C');
+	ConnSendString(conn, "START_STREAMING");
+	ConnEndMessage(conn);
+
+	if (stream->readahead)
+		WbRaFree(stream->readahead);
+	if (stream->catalog)
+		WbMcCloseConnection(stream->catalog);
+	WbCCLogStreamStats(stream);
+	WbCCLogLatency(stream);
+	WbCCLogFilterStats(stream->fl);
+	WbFFreeProcessingState(stream->fl);
+	wbfree(stream->msg);
+	wbfree(stream);
+}
+
+/*
+ * Finish a stream returned by WbCCRunCommands() once it is done.
+ */
+void
+WbCCEndStreaming(WbCCStream *stream)
+{
+	WbConn conn = stream->conn;
+	ReplicationCommand *cmd = stream->cmd;
+
+	WbCCFinishStream(stream);
+	WbCCCompleteCommand(conn, cmd);
+}
+
+/*
+ * Release resources of a stream after an error. Connections are closed by
+ * the caller.
+ */
+void
+WbCCAbortStream(WbCCStream *stream)
+{
+	if (stream->pipeline)
+		WbPipeFree(stream->pipeline, false);
+	if (stream->hubsub)
+		WbHubUnsubscribe(stream->hubsub);
+	if (stream->spool)
+		WbSpoolClose(stream->spool);
+	if (stream->readahead)
+		WbRaFree(stream->readahead);
+	if (stream->catalog)
+		WbMcCloseConnection(stream->catalog);
+	WbCCLogStreamStats(stream);
+	WbCCLogLatency(stream);
+	WbCCLogFilterStats(stream->fl);
+	WbFFreeProcessingState(stream->fl);
+	wbfree(stream->msg);
+	wbfree(stream->cmd);
+	wbfree(stream);
+}
+
+static void
+WbCCExecTimeline(WbConn conn, MasterConn *master, ReplicationCommand *cmd)
+{
+	TimelineHistory history;
+
+	log_info("Received request for timeline %d", cmd->timeline);
+
+	if (!WbMetaGetTimelineHistory(cmd->timeline, &history))
+	{
+		WbMcGetTimelineHistory(master, cmd->timeline, &history);
+		WbMetaPutTimelineHistory(cmd->timeline, &history);
+	}
+
+	{
+		ResultCol cols[2] = {
+				{ "filename", TEXTOID, history.filename, 0},
+				{ "content", BYTEAOID, history.content, history.contentLen}
+		};
+		WbCCSendResultset(conn, 2, cols);
+	}
+
+	log_info("Sending out timeline history file %s", history.filename);
+
+	wbfree(history.filename);
+	wbfree(history.content);
+}
+
+static void
+WbCCExecShow(WbConn conn, MasterConn *master, ReplicationCommand *cmd)
+{
+	char	*value;
+
+	log_info("Received request for variable %s", cmd->varname);
+
+	value = WbCCShowVariable(master, cmd->varname);
 
 	{
 		ResultCol cols[1] = {
@@ -859,25 +1558,34 @@ WbCCExecShow(WbConn conn, MasterConn *master, ReplicationCommand *cmd)
 	wbfree(value);
 }
 
+/*
+ * Value of a setting on the master, settings that can't change while the
+ * master runs are shared between replicas.
+ */
+static char*
+WbCCShowVariable(MasterConn *master, char *name)
+{
+	char *value = WbMetaGetVariable(name);
+
+	if (value)
+		return value;
+
+	value = WbMcShowVariable(master, name);
+	WbMetaPutVariable(name, value);
+	return value;
+}
+
+/*
+ * Connection string for catalog queries on behalf of the client.
+ */
 static void
-WbCCLookupFilteringOids(WbConn conn, FilterData *fl)
+WbCCBuildCatalogConninfo(WbConn conn, const char *dbname, char *conninfo)
 {
 	// TODO: take in other options
-	char conninfo[MAX_CONNINFO_LEN+1];
 	char *buf = conninfo;
 	char *buf_end = &(conninfo[MAX_CONNINFO_LEN]);
-	MasterConn* master;
 
-	if (!conn->configEntry)
-		return;
-
-	if ((conn->configEntry->filter.n_include_tablespaces +
-		 conn->configEntry->filter.n_include_databases +
-		 conn->configEntry->filter.n_exclude_tablespaces +
-		 conn->configEntry->filter.n_exclude_databases) == 0)
-		return;
-
-	memset(conninfo, 0, sizeof(conninfo));
+	memset(conninfo, 0, MAX_CONNINFO_LEN+1);
 
 	if (conn->master_host) {
 		buf += snprintf(buf, buf_end - buf, "host=%s ", conn->master_host);
@@ -889,79 +1597,473 @@ WbCCLookupFilteringOids(WbConn conn, FilterData *fl)
 	if (conn->user_name)
 		buf += snprintf(buf, buf_end - buf, "user=%s ", conn->user_name);
 
-	buf += snprintf(buf, buf_end - buf, "dbname=postgres application_name=walbouncer");
+	buf += snprintf(buf, buf_end - buf, "dbname='");
+	for (; *dbname && buf < buf_end - 2; dbname++)
+	{
+		if (*dbname == '\'' || *dbname == '\\')
+			*buf++ = '\\';
+		*buf++ = *dbname;
+	}
+	buf += snprintf(buf, buf_end - buf, "' application_name=walbouncer");
+}
+
+/*
+ * Decided by the configuration rather than the filter state, relation rules
+ * only reach the filter once the names are resolved.
+ */
+static bool
+WbCCHasFilterClauses(wb_config_entry *entry)
+{
+	if (!entry)
+		return false;
+
+	return (entry->filter.n_include_tablespaces +
+			entry->filter.n_include_databases +
+			entry->filter.n_exclude_tablespaces +
+			entry->filter.n_exclude_databases +
+			entry->filter.n_include_relations +
+			entry->filter.n_exclude_relations) != 0 ||
+			entry->filter.exclude_forks;
+}
+
+static void
+WbCCLookupFilteringOids(WbConn conn, FilterData *fl)
+{
+	wb_config_entry *entry = conn->configEntry;
+	char conninfo[MAX_CONNINFO_LEN+1];
+	MasterConn* master;
+
+	if (!WbCCHasFilterClauses(entry))
+		return;
 
+	fl->exclude_forks = entry->filter.exclude_forks;
+
+	if ((entry->filter.n_include_tablespaces +
+		 entry->filter.n_include_databases +
+		 entry->filter.n_exclude_tablespaces +
+		 entry->filter.n_exclude_databases) == 0)
+	{
+		/* Only relation rules */
+	}
+	// Resolved by the main process unless it has not succeeded yet
+	else if (WbOidCacheLookup(entry, fl))
+	{
+		log_debug1("Using cached filtering OIDs");
+	}
+	else
+	{
+		WbCCBuildCatalogConninfo(conn, "postgres", conninfo);
+
+		master = WbPoolTakeMasterConn(conn->user_name, false);
+		if (!master)
+			master = WbMcOpenConnection(conninfo);
+
+		if (entry->filter.n_include_tablespaces)
+			fl->include_tablespaces = WbMcResolveOids(master,
+					OID_RESOLVE_TABLESPACES, true,
+					entry->filter.include_tablespaces,
+					entry->filter.n_include_tablespaces);
+		if (entry->filter.n_include_databases)
+			fl->include_databases = WbMcResolveOids(master,
+					OID_RESOLVE_DATABASES, true,
+					entry->filter.include_databases,
+					entry->filter.n_include_databases);
+		if (entry->filter.n_exclude_tablespaces)
+			fl->exclude_tablespaces = WbMcResolveOids(master,
+					OID_RESOLVE_TABLESPACES, false,
+					entry->filter.exclude_tablespaces,
+					entry->filter.n_exclude_tablespaces);
+		if (entry->filter.n_exclude_databases)
+			fl->exclude_databases = WbMcResolveOids(master,
+					OID_RESOLVE_DATABASES, false,
+					entry->filter.exclude_databases,
+					entry->filter.n_exclude_databases);
+
+		WbMcCloseConnection(master);
+	}
+
+	if (entry->filter.n_include_relations + entry->filter.n_exclude_relations)
+		WbCCLookupRelations(conn, fl);
+
+	WbCCReportFiltering(conn);
+}
+
+/*
+ * Resolve the relation rules for every database they name.
+ */
+static void
+WbCCLookupRelations(WbConn conn, FilterData *fl)
+{
+	char conninfo[MAX_CONNINFO_LEN+1];
+	MasterConn *master;
+	NamedOid *objects;
+	int count;
+	int i;
+
+	WbCCBuildCatalogConninfo(conn, "postgres", conninfo);
 	master = WbMcOpenConnection(conninfo);
+	objects = WbMcListNamedOids(master, &count);
+	WbMcCloseConnection(master);
+	if (!objects)
+		error("Could not look up databases for relation filtering");
 
-	if (conn->configEntry->filter.n_include_tablespaces)
-		fl->include_tablespaces = WbMcResolveOids(master,
-				OID_RESOLVE_TABLESPACES, true,
-				conn->configEntry->filter.include_tablespaces,
-				conn->configEntry->filter.n_include_tablespaces);
-	if (conn->configEntry->filter.n_include_databases)
-		fl->include_databases = WbMcResolveOids(master,
-				OID_RESOLVE_DATABASES, true,
-				conn->configEntry->filter.include_databases,
-				conn->configEntry->filter.n_include_databases);
-	if (conn->configEntry->filter.n_exclude_tablespaces)
-		fl->exclude_tablespaces = WbMcResolveOids(master,
-				OID_RESOLVE_TABLESPACES, false,
-				conn->configEntry->filter.exclude_tablespaces,
-				conn->configEntry->filter.n_exclude_tablespaces);
-	if (conn->configEntry->filter.n_exclude_databases)
-		fl->exclude_databases = WbMcResolveOids(master,
-				OID_RESOLVE_DATABASES, false,
-				conn->configEntry->filter.exclude_databases,
-				conn->configEntry->filter.n_exclude_databases);
-
-	{
-		char buf[32000];
-		int i;
-		int pos = 0;
-
-		if (conn->configEntry->filter.n_include_tablespaces)
-		{
-			if (pos)
-				pos += snprintf(buf+pos, sizeof(buf) - pos, " ");
-			pos += snprintf(buf+pos, sizeof(buf) - pos, "Tablespaces included: ");
-			for (i = 0; i < conn->configEntry->filter.n_include_tablespaces; i++)
-				pos += snprintf(buf+pos, sizeof(buf) - pos, i ? ", %s" : "%s",
-						conn->configEntry->filter.include_tablespaces[i]);
-		}
+	for (i = 0; i < count; i++)
+	{
+		if (objects[i].kind != OID_RESOLVE_DATABASES)
+			continue;
 
-		if (conn->configEntry->filter.n_exclude_tablespaces)
-		{
-			if (pos)
-				pos += snprintf(buf+pos, sizeof(buf) - pos, " ");
-			pos += snprintf(buf+pos, sizeof(buf) - pos, "Tablespaces excluded: ");
-			for (i = 0; i < conn->configEntry->filter.n_exclude_tablespaces; i++)
-				pos += snprintf(buf+pos, sizeof(buf) - pos, i ? ", %s" : "%s",
-						conn->configEntry->filter.exclude_tablespaces[i]);
+		/* Not fatal, e.g. template0 does not accept connections */
+		if (!WbCCResolveRelations(conn, fl, objects[i].oid, objects[i].name))
+			log_warning("Relations of database %s are not filtered", objects[i].name);
+	}
+
+	wbfree(objects);
+}
+
+/*
+ * Resolve the relation rules of the client for one database, replacing what
+ * was resolved for it before. Relation files that were pending are resolved
+ * if they exist now. Returns false if the database could not be queried.
+ */
+static bool
+WbCCResolveRelations(WbConn conn, FilterData *fl, Oid dbOid, const char *dbName)
+{
+	wb_config_entry *entry = conn->configEntry;
+	char conninfo[MAX_CONNINFO_LEN+1];
+	char fullName[MAX_CONNINFO_LEN];
+	MasterConn *master;
+	NamedRelation *rels;
+	FilterRelNode *included;
+	FilterRelNode *excluded;
+	int nincluded = 0;
+	int nexcluded = 0;
+	bool include;
+	bool exclude;
+	int count;
+	int i;
+
+	include = wb_relation_rules_apply(entry->filter.include_relations,
+			entry->filter.n_include_relations, dbName);
+	exclude = wb_relation_rules_apply(entry->filter.exclude_relations,
+			entry->filter.n_exclude_relations, dbName);
+	if (!include && !exclude)
+		return true;
+
+	WbCCBuildCatalogConninfo(conn, dbName, conninfo);
+	master = WbMcTryOpenConnection(conninfo);
+	if (!master)
+		return false;
+	rels = WbMcListRelations(master, &count);
+	WbMcCloseConnection(master);
+	if (!rels)
+		return false;
+
+	included = wballoc(sizeof(FilterRelNode) * (count + 1));
+	excluded = wballoc(sizeof(FilterRelNode) * (count + 1));
+	for (i = 0; i < count; i++)
+	{
+		snprintf(fullName, sizeof(fullName), "%s.%s", dbName, rels[i].name);
 
+		/* Catalogs are needed to make any sense of the rest */
+		if (include && (rels[i].owner < FIRST_NORMAL_OBJECT_ID ||
+				wb_filter_name_matches(entry->filter.include_relations,
+						entry->filter.n_include_relations, fullName)))
+		{
+			included[nincluded].dbNode = dbOid;
+			included[nincluded++].relNode = rels[i].relNode;
 		}
-		if (conn->configEntry->filter.n_include_databases)
+		if (exclude && wb_filter_name_matches(entry->filter.exclude_relations,
+				entry->filter.n_exclude_relations, fullName))
 		{
-			if (pos)
-				pos += snprintf(buf+pos, sizeof(buf) - pos, " ");
-			pos += snprintf(buf+pos, sizeof(buf) - pos, "Databases included: ");
-			for (i = 0; i < conn->configEntry->filter.n_include_databases; i++)
-				pos += snprintf(buf+pos, sizeof(buf) - pos, i ? ", %s" : "%s",
-						conn->configEntry->filter.include_databases[i]);
+			excluded[nexcluded].dbNode = dbOid;
+			excluded[nexcluded++].relNode = rels[i].relNode;
 		}
-		if (conn->configEntry->filter.n_exclude_databases)
+
+		if (fl->pending_relations)
+			WbFRemoveRelation(fl->pending_relations, dbOid, rels[i].relNode);
+	}
+
+	if (include)
+	{
+		WbFAddOid(&(fl->include_relation_databases), dbOid);
+		WbFSetRelations(&(fl->include_relations), dbOid, included, nincluded);
+	}
+	if (exclude)
+	{
+		WbFAddOid(&(fl->exclude_relation_databases), dbOid);
+		WbFSetRelations(&(fl->exclude_relations), dbOid, excluded, nexcluded);
+	}
+	WbFRulesChanged(fl);
+
+	log_debug1("Database %s has %d included and %d excluded relation files",
+			dbName, nincluded, nexcluded);
+
+	wbfree(included);
+	wbfree(excluded);
+	wbfree(rels);
+	return true;
+}
+
+/*
+ * Find out which relations the files created in the stream belong to.
+ */
+static bool
+WbCCResolvePendingRelations(WbCCStream *stream)
+{
+	FilterData *fl = stream->fl;
+	NamedOid *objects;
+	int count;
+	int i;
+
+	objects = WbMcListNamedOids(stream->catalog, &count);
+	if (!objects)
+		return false;
+
+	for (i = 0; i < count; i++)
+	{
+		FilterRelNode *rel;
+
+		if (objects[i].kind != OID_RESOLVE_DATABASES)
+			continue;
+
+		for (rel = fl->pending_relations; rel && rel->dbNode; rel++)
+			if (rel->dbNode == objects[i].oid)
+				break;
+		if (!rel || !rel->dbNode)
+			continue;
+
+		WbCCResolveRelations(stream->conn, fl, objects[i].oid, objects[i].name);
+	}
+
+	wbfree(objects);
+	return true;
+}
+
+/*
+ * Look up databases, tablespaces and relation files created in the stream,
+ * so that the filtering rules apply to them. They are only visible once the
+ * creating transaction commits. We check after CATALOG_CHECK_INTERVAL and
+ * back off while something stays pending, e.g. after a rollback. The
+ * connection is kept for the next time.
+ */
+static void
+WbCCResolvePendingOids(WbCCStream *stream)
+{
+	FilterData *fl = stream->fl;
+	TimestampTz now = GetCurrentTimestamp();
+	bool ok;
+
+	if (!stream->conn->configEntry || now < stream->nextCatalogCheck)
+		return;
+
+	if (!stream->catalogCheckInterval)
+		stream->catalogCheckInterval = CATALOG_CHECK_INTERVAL;
+	else if (stream->catalogCheckInterval < CATALOG_MAX_CHECK_INTERVAL / 2)
+		stream->catalogCheckInterval *= 2;
+	else
+		stream->catalogCheckInterval = CATALOG_MAX_CHECK_INTERVAL;
+	stream->nextCatalogCheck = now + stream->catalogCheckInterval;
+
+	if (!stream->catalog)
+	{
+		char conninfo[MAX_CONNINFO_LEN+1];
+
+		WbCCBuildCatalogConninfo(stream->conn, "postgres", conninfo);
+		stream->catalog = WbMcTryOpenConnection(conninfo);
+		if (!stream->catalog)
+			return;
+	}
+
+	ok = WbOidCacheResolvePending(stream->conn->configEntry, fl, stream->catalog);
+	if (ok && fl->pending_relations && fl->pending_relations->dbNode)
+		ok = WbCCResolvePendingRelations(stream);
+
+	if (!ok)
+	{
+		WbMcCloseConnection(stream->catalog);
+		stream->catalog = NULL;
+	}
+
+	/* Resolved everything, react quickly to the next one */
+	if (!WbFHasPendingOids(fl))
+		stream->catalogCheckInterval = 0;
+}
+
+/*
+ * Log how much WAL the filter replaced with NOOP records.
+ */
+static void
+WbCCLogFilterStats(FilterData *fl)
+{
+	if (!fl->filteredRecords)
+		return;
+
+	log_info("Filtered %llu records with %llu bytes of WAL, %llu bytes of them by fork rules",
+			(unsigned long long) fl->filteredRecords,
+			(unsigned long long) fl->filteredBytes,
+			(unsigned long long) fl->forkFilteredBytes);
+}
+
+static void
+WbCCLogStreamStats(WbCCStream *stream)
+{
+	log_info("Sent %llu bytes of WAL in %llu messages with %llu sends, %llu messages batched, %s with lag of %llu bytes",
+			(unsigned long long) stream->sentBytes,
+			(unsigned long long) stream->sentMessages,
+			(unsigned long long) stream->sends,
+			(unsigned long long) stream->batchedMessages,
+			stream->catchingUp ? "catching up" : "caught up",
+			(unsigned long long) stream->lag);
+}
+
+/*
+ * Set up a stream whose replies hold up commits on the master. Small
+ * messages are not delayed on either connection and WAL is not batched.
+ * With spin_cpu the process polls without sleeping on a CPU of its own.
+ */
+static void
+WbCCStartLatencyMode(WbCCStream *stream, wb_config_entry *entry)
+{
+	int busyPoll = entry->latency_mode.busy_poll;
+	int cpu = entry->latency_mode.spin_cpu;
+
+	stream->latencyMode = true;
+
+	if (!SocketSetLowLatency(ConnGetSocket(stream->conn), busyPoll))
+		log_warning("Could not set all low latency options on the client connection");
+	if (!SocketSetLowLatency(WbMcGetSocket(stream->master), busyPoll))
+		log_warning("Could not set all low latency options on the master connection");
+
+	if (cpu >= 0 && CurrentConfig->worker_threads)
+	{
+		log_warning("spin_cpu is ignored with worker threads");
+	}
+	else if (cpu >= 0)
+	{
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) == 0)
+			stream->spin = true;
+		else
+			log_warning("Could not move replica process to CPU %d: %s", cpu, strerror(errno));
+	}
+
+	if (stream->spin)
+	{
+		log_info("Latency mode enabled, spinning on CPU %d", cpu);
+	}
+	else
+		log_info("Latency mode enabled");
+}
+
+static void
+WbCCRecordLatency(WbCCLatency *latency, TimestampTz start)
+{
+	TimestampTz delay = GetCurrentTimestamp() - start;
+
+	latency->count++;
+	latency->total += delay;
+	if (delay > latency->max)
+		latency->max = delay;
+}
+
+/*
+ * Report the round trip time walbouncer added to synchronous commits: the
+ * time from receiving WAL to having sent it to the client plus the time
+ * from reading the client's reply to having sent it to the master.
+ */
+static void
+WbCCLogLatency(WbCCStream *stream)
+{
+	WbCCLatency *wal = &stream->walLatency;
+	WbCCLatency *reply = &stream->replyLatency;
+	double walAvg = wal->count ? (double) wal->total / wal->count : 0;
+	double replyAvg = reply->count ? (double) reply->total / reply->count : 0;
+
+	if (!stream->latencyMode)
+		return;
+
+	log_info("Added round trip latency %.1fus: WAL %.1fus average, %lldus max over %llu messages, replies %.1fus average, %lldus max over %llu replies",
+			walAvg + replyAvg,
+			walAvg, (long long) wal->max, (unsigned long long) wal->count,
+			replyAvg, (long long) reply->max, (unsigned long long) reply->count);
+}
+
+/*
+ * Tell the client what is being filtered out.
+ */
+static void
+WbCCReportFiltering(WbConn conn)
+{
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+	WbCCReportNames(&buf, "Tablespaces included",
+			conn->configEntry->filter.include_tablespaces,
+			conn->configEntry->filter.n_include_tablespaces);
+	WbCCReportNames(&buf, "Tablespaces excluded",
+			conn->configEntry->filter.exclude_tablespaces,
+			conn->configEntry->filter.n_exclude_tablespaces);
+	WbCCReportNames(&buf, "Databases included",
+			conn->configEntry->filter.include_databases,
+			conn->configEntry->filter.n_include_databases);
+	WbCCReportNames(&buf, "Databases excluded",
+			conn->configEntry->filter.exclude_databases,
+			conn->configEntry->filter.n_exclude_databases);
+	WbCCReportNames(&buf, "Relations included",
+			conn->configEntry->filter.include_relations,
+			conn->configEntry->filter.n_include_relations);
+	WbCCReportNames(&buf, "Relations excluded",
+			conn->configEntry->filter.exclude_relations,
+			conn->configEntry->filter.n_exclude_relations);
+	if (conn->configEntry->filter.exclude_forks)
+	{
+		int fork;
+		bool first = true;
+
+		if (buf.len)
+			appendStringInfoChar(&buf, ' ');
+		appendStringInfoString(&buf, "Forks excluded: ");
+		for (fork = 0; fork < 32; fork++)
 		{
-			if (pos)
-				pos += snprintf(buf+pos, sizeof(buf) - pos, " ");
-			pos += snprintf(buf+pos, sizeof(buf) - pos, "Databases excluded: ");
-			for (i = 0; i < conn->configEntry->filter.n_exclude_databases; i++)
-				pos += snprintf(buf+pos, sizeof(buf) - pos, i ? ", %s" : "%s",
-						conn->configEntry->filter.exclude_databases[i]);
+			if (!(conn->configEntry->filter.exclude_forks & (1 << fork)))
+				continue;
+			if (!first)
+				appendStringInfoString(&buf, ", ");
+			appendStringInfoString(&buf, wb_fork_name(fork));
+			first = false;
 		}
-		WbCCSendErrorReport(conn, LOG_INFO, "WAL stream is being filtered", buf);
 	}
+	WbCCSendErrorReport(conn, LOG_INFO, "WAL stream is being filtered", buf.data);
+	wbfree(buf.data);
+}
 
-	WbMcCloseConnection(master);
+/*
+ * Append a list of names from the filtering rules to the report, if any.
+ * Rules with name patterns can be long, so the report grows as needed.
+ */
+static void
+WbCCReportNames(StringInfo buf, const char *title, char **names, int n)
+{
+	int i;
+
+	if (!n)
+		return;
+
+	if (buf->len)
+		appendStringInfoChar(buf, ' ');
+	appendStringInfoString(buf, title);
+	appendStringInfoString(buf, ": ");
+	for (i = 0; i < n; i++)
+	{
+		if (i)
+			appendStringInfoString(buf, ", ");
+		appendStringInfoString(buf, names[i]);
+	}
 }
+
 /* TODO: Probably not necessary
 static void
 WbCCSendWALRecord(XfConn conn, char *data, int len, XLogRecPtr sentPtr, TimestampTz lastSend)
@@ -1120,16 +2222,23 @@ WbCCProcessStandbyHSFeedbackMessage(WbConn conn, WbMessage *msg)
 }
 
 static void
-WbCCForwardPendingReplies(WbConn conn, MasterConn* master)
+WbCCForwardPendingReplies(WbConn conn, MasterConn* master, WbHubSubscriber *hubsub)
 {
+	/* When streaming from the hub, the hub reports to master on our behalf */
 	if (!conn->replyForwarded)
 	{
-		WbMcSendReply(master, &(conn->lastReply), false, false);
+		if (hubsub)
+			WbHubSendReply(hubsub, &(conn->lastReply));
+		else
+			WbMcSendReply(master, &(conn->lastReply), false, false);
 		conn->replyForwarded = true;
 	}
 	if (!conn->feedbackForwarded)
 	{
-		WbMcSendFeedback(master, &(conn->lastFeedback));
+		if (hubsub)
+			WbHubSendFeedback(hubsub, &(conn->lastFeedback));
+		else
+			WbMcSendFeedback(master, &(conn->lastFeedback));
 		conn->feedbackForwarded = true;
 	}
 }
@@ -1146,83 +2255,191 @@ WbCCSendCopyBothResponse(WbConn conn)
 }
 
 static void
-WbCCSendWalBlock(WbConn conn, ReplMessage *msg, FilterData *fl)
+WbCCSendWalBlock(WbCCStream *stream, ReplMessage *msg)
 {
-	XLogRecPtr dataStart;
-	int msgOffset = 0;
-	int buffered = 0;
-	int unsentLen = 0;
-	char unsentBuf[FL_BUFFER_LEN];
+	FilterOutput out;
 
-	// Take a local copy of the unsent buffer in case we need to rewrite it
-	if (fl->unsentBufferLen) {
-		unsentLen = fl->unsentBufferLen;
-		memcpy(unsentBuf, fl->unsentBuffer, unsentLen);
-		log_debug2("Sending %d bytes of unbuffered data", unsentLen);
-	}
+	if (WbFGetOutput(stream->fl, msg, &out))
+		WbCCQueueWalOutput(stream, &out);
+}
 
-	//'d' 'w' l(dataStart) l(walEnd) l(sendTime) s[WALdata]
-	if (fl->state & FS_BUFFERING_STATE)
-	{
-		// Chomp the buffered data off of what we send
-		buffered = fl->bufferLen;
-		// Stash it away into fl state, we will send it with the next block
-		fl->unsentBufferLen = fl->bufferLen;
-		memcpy(fl->unsentBuffer, fl->buffer, fl->bufferLen);
-		// Make note that record starts in the unsent buffer for rewriting
-		fl->recordStart = -1;
-		log_debug2("Buffering %d bytes of data", buffered);
+/*
+ * Send a block of WAL as it was received, either because the hub has
+ * already filtered it for us or because there is nothing to filter. Nothing
+ * but the 25 byte header is copied.
+ */
+static void
+WbCCRelayBlock(WbCCStream *stream, ReplMessage *msg)
+{
+	FilterOutput out;
 
-	} else {
-		// Clear out unsent buffer
-		fl->unsentBufferLen = 0;
-	}
+	out.dataStart = msg->dataStart;
+	out.walEnd = msg->walEnd;
+	out.sendTime = msg->sendTime;
+	out.prefix = NULL;
+	out.prefixLen = 0;
+	out.data = msg->data;
+	out.dataLen = msg->dataLen;
 
-	// Don't send anything if we are not synchronized, we will see this data again after replication restart
-	if (!fl->synchronized)
-	{
-		log_debug2("Skipping sending data.");
+	WbCCQueueWalOutput(stream, &out);
+}
+
+/*
+ * Send out WAL, or put it into the read-ahead queue while the client has not
+ * accepted what we sent before.
+ */
+static void
+WbCCQueueWalOutput(WbCCStream *stream, FilterOutput *out)
+{
+	bool stable = stream->spool != NULL;
+
+	if (stream->readahead && ((ConnHasDataToFlush(stream->conn) && !stream->batchBytes) ||
+			!WbRaIsEmpty(stream->readahead)))
+		WbRaPut(stream->readahead, out);
+	else
+		WbCCSendWalOutput(stream, out, stable,
+				WbCCBatchWalOutput(stream, out, stable));
+}
+
+/*
+ * Decide if WAL is sent right away or collected into a batch. The batch
+ * size follows how far the client is behind the WAL end of the source:
+ * while catching up, small messages are sent together in up to
+ * STREAM_MAX_BATCH bytes, a client that is caught up gets every message
+ * immediately. Stable data is not copied into a batch, it is cheaper to
+ * send it from where it is. Returns true if the output is to be flushed.
+ */
+static bool
+WbCCBatchWalOutput(WbCCStream *stream, FilterOutput *out, bool stable)
+{
+	XLogRecPtr endPtr = out->dataStart + out->prefixLen + out->dataLen;
+	uint64 lag = out->walEnd > endPtr ? out->walEnd - endPtr : 0;
+	uint64 target = lag >> STREAM_BATCH_LAG_SHIFT;
+
+	if (target > STREAM_MAX_BATCH)
+		target = STREAM_MAX_BATCH;
+
+	WbCCUpdateRegime(stream, lag);
+
+	stream->batchBytes += out->prefixLen + out->dataLen;
+	if (stable || stream->latencyMode || stream->batchBytes >= target)
+		return true;
+
+	stream->batchedMessages++;
+	return false;
+}
+
+/*
+ * Track whether the client is catching up. Switches to catching up when it
+ * is more than STREAM_CATCHUP_LAG behind and back once it has everything.
+ */
+static void
+WbCCUpdateRegime(WbCCStream *stream, uint64 lag)
+{
+	bool catchingUp = stream->catchingUp;
+	TimestampTz now;
+	double secs;
+
+	stream->lag = lag;
+	if (lag > STREAM_CATCHUP_LAG)
+		catchingUp = true;
+	else if (lag == 0)
+		catchingUp = false;
+
+	if (catchingUp == stream->catchingUp)
 		return;
-	}
 
-	// Include the previously unsent data
-	dataStart = msg->dataStart - unsentLen;
+	now = GetCurrentTimestamp();
+	secs = (now - stream->regimeStart) / 1000000.0;
+	log_info("%s, lag %llu bytes, sent %llu bytes in %.1fs (%.1f MB/s) before",
+			catchingUp ? "Client is catching up, batching WAL" :
+				"Client caught up, sending WAL immediately",
+			(unsigned long long) lag,
+			(unsigned long long) stream->regimeBytes, secs,
+			secs > 0 ? stream->regimeBytes / secs / (1024*1024) : 0.0);
+
+	stream->catchingUp = catchingUp;
+	stream->regimeStart = now;
+	stream->regimeBytes = 0;
+}
 
-	if (fl->requestedStartPos > dataStart) {
-		if (fl->requestedStartPos > (msg->dataStart + msg->dataLen))
-		{
-			log_info("Skipping whole WAL message as not requested");
-			return;
-		}
-		msgOffset = fl->requestedStartPos - dataStart;
-		dataStart = fl->requestedStartPos;
-		Assert(msgOffset < (msg->dataLen + unsentLen));
-		log_debug2("Chomping WAL message down to size at %d", msgOffset);
-	}
+static void
+WbCCFlushBatch(WbCCStream *stream)
+{
+	if (!stream->batchBytes)
+		return;
+
+	stream->batchBytes = 0;
+	stream->sends++;
+	WbCCFlush(stream);
+}
 
-	log_debug2("Sending data start %X/%X", FormatRecPtr(dataStart));
+/*
+ * Send pending output without waiting, through the sender thread if the
+ * stream has one.
+ */
+static void
+WbCCFlush(WbCCStream *stream)
+{
+	if (stream->pipeline)
+		WbPipeFlush(stream->pipeline);
+	else
+		ConnFlush(stream->conn, FLUSH_ASYNC);
+}
+
+/*
+ * Unless batched, the WAL data is sent from where it is and only the header
+ * is copied. Stable data, mapped from the spool, may be sent with zero copy.
+ * Batched data is copied, the source reuses its memory for the next message.
+ */
+static void
+WbCCSendWalOutput(WbCCStream *stream, FilterOutput *out, bool stable, bool flush)
+{
+	WbConn conn = stream->conn;
 
+	log_debug2("Sending data start %X/%X", FormatRecPtr(out->dataStart));
+
+	//'d' 'w' l(dataStart) l(walEnd) l(sendTime) s[WALdata]
 	ConnBeginMessage(conn, 'd');
 	ConnSendInt(conn, 'w', 1);
-	ConnSendInt64(conn, dataStart);
-	ConnSendInt64(conn, msg->walEnd - buffered);
-	ConnSendInt64(conn, msg->sendTime);
+	ConnSendInt64(conn, out->dataStart);
+	ConnSendInt64(conn, out->walEnd);
+	ConnSendInt64(conn, out->sendTime);
 	log_debug1("Sending out %d bytes of WAL at %X/%X",
-			msg->dataLen + unsentLen - msgOffset - buffered,
-			FormatRecPtr(dataStart));
+			out->prefixLen + out->dataLen,
+			FormatRecPtr(out->dataStart));
 
-	if (unsentLen && msgOffset < unsentLen) {
-		log_debug2("Sending unsent data at offset %d, %d bytes", msgOffset, unsentLen-msgOffset);
-		ConnSendBytes(conn, unsentBuf + msgOffset, unsentLen-msgOffset);
-		msgOffset = msgOffset < unsentLen ? 0 : msgOffset - unsentLen;
+	if (out->prefixLen) {
+		log_debug2("Sending unsent data, %d bytes", out->prefixLen);
+		ConnSendBytes(conn, out->prefix, out->prefixLen);
 	}
 
-	ConnSendBytes(conn, msg->data + msgOffset, msg->dataLen - msgOffset - buffered);
+	if (flush)
+		ConnSendBytesNoCopy(conn, out->data, out->dataLen, stable);
+	else
+		ConnSendBytes(conn, out->data, out->dataLen);
 	ConnEndMessage(conn);
 
-	conn->sentPtr = msg->dataStart + msg->dataLen - buffered;
-	conn->lastSend = msg->sendTime;
-	ConnFlush(conn, FLUSH_ASYNC);
+	conn->sentPtr = out->dataStart + out->prefixLen + out->dataLen;
+	conn->lastSend = out->sendTime;
+
+	stream->sentMessages++;
+	stream->sentBytes += out->prefixLen + out->dataLen;
+	stream->regimeBytes += out->prefixLen + out->dataLen;
+
+	if (flush)
+	{
+		stream->batchBytes = 0;
+		stream->sends++;
+		WbCCFlush(stream);
+
+		/* Otherwise timed once the rest is flushed */
+		if (stream->walReceivedAt && !ConnHasDataToFlush(conn))
+		{
+			WbCCRecordLatency(&stream->walLatency, stream->walReceivedAt);
+			stream->walReceivedAt = 0;
+		}
+	}
 }
 
 static char*
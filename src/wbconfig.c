@@ -1,9 +1,16 @@
+#include <fnmatch.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 
 #include <yaml.h>
 #include "wbconfig.h"
+#include "wbpgtypes.h"
 #include "wbutils.h"
 
+/* Longest database name part of a relation rule we look at */
+#define RULE_NAME_LEN 255
+
 typedef struct {
 	yaml_parser_t parser;
 	yaml_event_t event;
@@ -14,8 +21,12 @@ wb_configuration *CurrentConfig = NULL;
 
 static int wb_read_main_config(wb_config_parser_state *state, wb_configuration* config);
 static int wb_read_master_config(wb_config_parser_state *state, wb_configuration* config);
+static int wb_read_hub_config(wb_config_parser_state *state, wb_configuration* config);
+static int wb_read_read_ahead_config(wb_config_parser_state *state, wb_configuration* config);
 static int wb_read_configurations(wb_config_parser_state *state, wb_configuration* config);
 static int wb_read_configuration_entry(wb_config_parser_state *state, wb_config_entry *entry);
+static void wb_check_relation_names(char **names, int n);
+static int wb_read_forks(wb_config_parser_state *state);
 
 
 static wb_config_list_entry*
@@ -24,6 +35,7 @@ wb_new_config_entry()
 	wb_config_list_entry *item = wballoc(sizeof(wb_config_list_entry));
 	item->next = NULL;
 	memset(&(item->entry), 0, sizeof(wb_config_entry));
+	item->entry.latency_mode.spin_cpu = -1;
 	return item;
 }
 
@@ -154,6 +166,34 @@ wb_read_int(wb_config_parser_state *state)
 	return result;
 }
 
+static bool
+wb_read_bool(wb_config_parser_state *state)
+{
+	bool result = false;
+	char *value;
+	if (!yaml_parser_parse(&(state->parser), &(state->event)))
+	{
+		state->done = true;
+		return false;
+	}
+	if (state->event.type != YAML_SCALAR_EVENT)
+		error("Unexpected event type while parsing YAML");
+
+	value = wb_str_value(state);
+	if (strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0 ||
+			strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0)
+		result = true;
+	else if (strcasecmp(value, "false") == 0 || strcasecmp(value, "no") == 0 ||
+			strcasecmp(value, "off") == 0 || strcmp(value, "0") == 0)
+		result = false;
+	else
+		error("Invalid format for boolean: '%s'", value);
+	free(value);
+
+	yaml_event_delete(&(state->event));
+	return result;
+}
+
 static char*
 wb_read_string(wb_config_parser_state *state)
 {
@@ -242,6 +282,25 @@ wb_new_config()
 	config->listen_port = 5433;
 	config->master.host = "localhost";
 	config->master.port = 5432;
+	config->master.user = NULL;
+	config->worker_threads = 0;
+	config->prefork_workers = 0;
+	config->prefork_replication_connections = 0;
+	config->oid_refresh_interval = 60;
+	config->metadata_cache_ttl = 1000;
+	config->verify_crc = false;
+	config->zerocopy_threshold = 0;
+	config->pipeline = false;
+	config->hub.enabled = false;
+	config->hub.buffer_size = 64;
+	config->hub.max_replicas = 64;
+	config->hub.max_filter_profiles = 4;
+	config->hub.spool_directory = NULL;
+	config->hub.spool_size = 1024;
+	config->hub.prefill = false;
+	config->read_ahead.buffer_size = 16;
+	config->read_ahead.spill_directory = NULL;
+	config->read_ahead.spill_size = 1024;
 	config->configurations = NULL;
 
 	return config;
@@ -256,6 +315,8 @@ wb_delete_config_entry(wb_config_entry *entry)
 	FreeIfNotNull(entry->filter.include_tablespaces);
 	FreeIfNotNull(entry->filter.exclude_databases);
 	FreeIfNotNull(entry->filter.exclude_tablespaces);
+	FreeIfNotNull(entry->filter.include_relations);
+	FreeIfNotNull(entry->filter.exclude_relations);
 
 	FreeIfNotNull(entry->match.application_name);
 
@@ -277,6 +338,114 @@ wb_delete_config(wb_configuration* config)
 	}
 }
 
+/*
+ * Filtering rules name tablespaces and databases either literally or with
+ * shell style patterns. Returns true if name matches one of them.
+ */
+bool
+wb_filter_name_matches(char **patterns, int n, const char *name)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (fnmatch(patterns[i], name, 0) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Returns true if one of the database.schema.relation patterns can match
+ * relations of database name.
+ */
+bool
+wb_relation_rules_apply(char **patterns, int n, const char *name)
+{
+	char database[RULE_NAME_LEN + 1];
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		int len = strchr(patterns[i], '.') - patterns[i];
+
+		if (len > RULE_NAME_LEN)
+			continue;
+		memcpy(database, patterns[i], len);
+		database[len] = '\0';
+		if (fnmatch(database, name, 0) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Returns the number of patterns among the names of a filtering rule.
+ */
+int
+wb_filter_count_patterns(char **patterns, int n)
+{
+	int count = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (strpbrk(patterns[i], "*?["))
+			count++;
+	return count;
+}
+
+static void
+wb_check_relation_names(char **names, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		char *dot = strchr(names[i], '.');
+
+		if (!dot || !strchr(dot + 1, '.'))
+			error("Relation %s must be given as database.schema.relation", names[i]);
+	}
+}
+
+const char *
+wb_fork_name(int fork)
+{
+	static const char *names[] = {"main", "fsm", "vm", "init"};
+
+	return names[fork];
+}
+
+/*
+ * Read a list of relation fork names into a bitmask of fork numbers. The
+ * main fork holds the actual data and can't be excluded.
+ */
+static int
+wb_read_forks(wb_config_parser_state *state)
+{
+	char **names = NULL;
+	int n = 0;
+	int forks = 0;
+	int i;
+
+	wb_read_list_of_string(state, &names, &n);
+
+	for (i = 0; i < n; i++)
+	{
+		int fork;
+
+		for (fork = MAIN_FORKNUM + 1; fork <= MAX_FORKNUM; fork++)
+			if (strcmp(names[i], wb_fork_name(fork)) == 0)
+				break;
+		if (fork > MAX_FORKNUM)
+			error("Fork %s can not be excluded, expecting fsm, vm or init", names[i]);
+		forks |= 1 << fork;
+		free(names[i]);
+	}
+	if (names)
+		wbfree(names);
+
+	return forks;
+}
+
 #define CHECK_FOR_FAILURE(state) if (state->done) { \
 	return -1;\
 }
@@ -315,8 +484,52 @@ wb_read_main_config(wb_config_parser_state *state, wb_configuration *config)
 	{
 		if (strcmp(key, "listen_port") == 0)
 			config->listen_port = wb_read_int(state);
+		else if (strcmp(key, "worker_threads") == 0)
+		{
+			config->worker_threads = wb_read_int(state);
+			if (config->worker_threads < 0)
+				error("worker_threads can not be negative");
+		}
+		else if (strcmp(key, "prefork_workers") == 0)
+		{
+			config->prefork_workers = wb_read_int(state);
+			if (config->prefork_workers < 0)
+				error("prefork_workers can not be negative");
+		}
+		else if (strcmp(key, "prefork_replication_connections") == 0)
+		{
+			config->prefork_replication_connections = wb_read_int(state);
+			if (config->prefork_replication_connections < 0)
+				error("prefork_replication_connections can not be negative");
+		}
+		else if (strcmp(key, "oid_refresh_interval") == 0)
+		{
+			config->oid_refresh_interval = wb_read_int(state);
+			if (config->oid_refresh_interval < 0)
+				error("oid_refresh_interval can not be negative");
+		}
+		else if (strcmp(key, "metadata_cache_ttl") == 0)
+		{
+			config->metadata_cache_ttl = wb_read_int(state);
+			if (config->metadata_cache_ttl < 0)
+				error("metadata_cache_ttl can not be negative");
+		}
+		else if (strcmp(key, "verify_crc") == 0)
+			config->verify_crc = wb_read_bool(state);
+		else if (strcmp(key, "zerocopy_threshold") == 0)
+		{
+			config->zerocopy_threshold = wb_read_int(state);
+			if (config->zerocopy_threshold < 0)
+				error("zerocopy_threshold can not be negative");
+		}
+		else if (strcmp(key, "pipeline") == 0)
+			config->pipeline = wb_read_bool(state);
 		else if (strcmp(key, "master") == 0)
 			wb_read_master_config(state, config);
+		else if (strcmp(key, "hub") == 0)
+			wb_read_hub_config(state, config);
+		else if (strcmp(key, "read_ahead") == 0)
+			wb_read_read_ahead_config(state, config);
 		else if (strcmp(key, "configurations") == 0)
 			wb_read_configurations(state, config);
 		else
@@ -342,12 +555,86 @@ wb_read_master_config(wb_config_parser_state *state, wb_configuration *config)
 			config->master.host = wb_read_string(state);
 		else if (strcmp(key, "port") == 0)
 			config->master.port = wb_read_int(state);
+		else if (strcmp(key, "user") == 0)
+			config->master.user = wb_read_string(state);
+		else
+			log_warning("Unknown configuration entry with key %s", key);
+		free(key);
+		CHECK_FOR_FAILURE(state);
+	}
+
+	return 0;
+}
+
+static int
+wb_read_hub_config(wb_config_parser_state *state, wb_configuration *config)
+{
+	char *key;
+	if (!wb_expect_mapping(state))
+		error("Hub config must be a YAML mapping");
+
+	CHECK_FOR_FAILURE(state);
+	while ((key = wb_read_key(state)))
+	{
+		if (strcmp(key, "enabled") == 0)
+			config->hub.enabled = wb_read_bool(state);
+		else if (strcmp(key, "buffer_size") == 0)
+			config->hub.buffer_size = wb_read_int(state);
+		else if (strcmp(key, "max_replicas") == 0)
+			config->hub.max_replicas = wb_read_int(state);
+		else if (strcmp(key, "max_filter_profiles") == 0)
+			config->hub.max_filter_profiles = wb_read_int(state);
+		else if (strcmp(key, "spool_directory") == 0)
+			config->hub.spool_directory = wb_read_string(state);
+		else if (strcmp(key, "spool_size") == 0)
+			config->hub.spool_size = wb_read_int(state);
+		else if (strcmp(key, "prefill") == 0)
+			config->hub.prefill = wb_read_bool(state);
+		else
+			log_warning("Unknown configuration entry with key %s", key);
+		free(key);
+		CHECK_FOR_FAILURE(state);
+	}
+
+	if (config->hub.buffer_size < 1)
+		error("Hub buffer_size must be at least 1 MB");
+	if (config->hub.max_replicas < 1)
+		error("Hub max_replicas must be at least 1");
+	if (config->hub.max_filter_profiles < 0)
+		error("Hub max_filter_profiles can not be negative");
+	if (config->hub.spool_size < 1)
+		error("Hub spool_size must be at least 1 MB");
+
+	return 0;
+}
+
+static int
+wb_read_read_ahead_config(wb_config_parser_state *state, wb_configuration *config)
+{
+	char *key;
+	if (!wb_expect_mapping(state))
+		error("Read-ahead config must be a YAML mapping");
+
+	CHECK_FOR_FAILURE(state);
+	while ((key = wb_read_key(state)))
+	{
+		if (strcmp(key, "buffer_size") == 0)
+			config->read_ahead.buffer_size = wb_read_int(state);
+		else if (strcmp(key, "spill_directory") == 0)
+			config->read_ahead.spill_directory = wb_read_string(state);
+		else if (strcmp(key, "spill_size") == 0)
+			config->read_ahead.spill_size = wb_read_int(state);
 		else
 			log_warning("Unknown configuration entry with key %s", key);
 		free(key);
 		CHECK_FOR_FAILURE(state);
 	}
 
+	if (config->read_ahead.buffer_size < 0)
+		error("Read-ahead buffer_size can not be negative");
+	if (config->read_ahead.spill_size < 1)
+		error("Read-ahead spill_size must be at least 1 MB");
+
 	return 0;
 }
 
@@ -437,11 +724,48 @@ wb_read_configuration_entry(wb_config_parser_state *state, wb_config_entry *entr
 					wb_read_list_of_string(state,
 							&(entry->filter.exclude_databases),
 							&(entry->filter.n_exclude_databases));
+				else if (strcmp(key, "include_relations") == 0)
+				{
+					wb_read_list_of_string(state,
+							&(entry->filter.include_relations),
+							&(entry->filter.n_include_relations));
+					wb_check_relation_names(entry->filter.include_relations,
+							entry->filter.n_include_relations);
+				}
+				else if (strcmp(key, "exclude_relations") == 0)
+				{
+					wb_read_list_of_string(state,
+							&(entry->filter.exclude_relations),
+							&(entry->filter.n_exclude_relations));
+					wb_check_relation_names(entry->filter.exclude_relations,
+							entry->filter.n_exclude_relations);
+				}
+				else if (strcmp(key, "exclude_forks") == 0)
+					entry->filter.exclude_forks = wb_read_forks(state);
 				else
 					error("Unexpected key %s for match", key);
 				free(key);
 			}
 		}
+		else if (strcmp(key, "latency_mode") == 0)
+		{
+			if (!wb_expect_mapping(state))
+				error("Latency mode must be a mapping");
+			while ((key = wb_read_key(state)))
+			{
+				if (strcmp(key, "enabled") == 0)
+					entry->latency_mode.enabled = wb_read_bool(state);
+				else if (strcmp(key, "busy_poll") == 0)
+					entry->latency_mode.busy_poll = wb_read_int(state);
+				else if (strcmp(key, "spin_cpu") == 0)
+					entry->latency_mode.spin_cpu = wb_read_int(state);
+				else
+					error("Unexpected key %s for latency_mode", key);
+				free(key);
+			}
+			if (entry->latency_mode.busy_poll < 0)
+				error("latency_mode busy_poll can not be negative");
+		}
 		else
 		{
 			error("Unknown config entry %s", key);
@@ -22,6 +22,7 @@
 #include "wbcrc32c.h"
 
 static const uint32 pg_crc32c_table[8][256];
+static const uint32 pg_crc32c_x2n_table[32];
 
 #define CRC8(x) pg_crc32c_table[0][(crc ^ (x)) & 0xFF] ^ (crc >> 8)
 
@@ -141,6 +142,66 @@ pg_comp_crc32c_sb8_zero(pg_crc32c crc, const void *data, size_t len)
     return crc;
 }
 
+/*
+ * Multiply a and b modulo the polynomial, both in reflected bit order where
+ * the highest bit stands for x^0.
+ */
+static uint32
+crc32c_multmodp(uint32 a, uint32 b)
+{
+    uint32      m = (uint32) 1 << 31;
+    uint32      p = 0;
+
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0x82F63B78 : b >> 1;
+    }
+    return p;
+}
+
+/*
+ * Same as pg_comp_crc32c_sb8_zero() without looking at every byte. Feeding
+ * len zero bytes multiplies the CRC by x^(8 * len), which is put together
+ * from the precomputed powers x^(2^k) in O(log len) steps.
+ */
+pg_crc32c
+pg_comp_crc32c_zero(pg_crc32c crc, size_t len)
+{
+    uint32      xn = (uint32) 1 << 31;     /* x^0 */
+    int         k = 3;                      /* 8 bits per byte */
+
+    while (len)
+    {
+        if (len & 1)
+            xn = crc32c_multmodp(pg_crc32c_x2n_table[k & 31], xn);
+        len >>= 1;
+        k++;
+    }
+
+    return crc32c_multmodp(xn, crc);
+}
+
+/*
+ * x^(2^k) modulo the Castagnoli polynomial for k = 0..31, in reflected bit
+ * order. The powers repeat with a period of 31.
+ */
+static const uint32 pg_crc32c_x2n_table[32] = {
+    0x40000000, 0x20000000, 0x08000000, 0x00800000,
+    0x00008000, 0x82F63B78, 0x6EA2D55C, 0x18B8EA18,
+    0x510AC59A, 0xB82BE955, 0xB8FDB1E7, 0x88E56F72,
+    0x74C360A4, 0xE4172B16, 0x0D65762A, 0x35D73A62,
+    0x28461564, 0xBF455269, 0xE2EA32DC, 0xFE7740E6,
+    0xF946610B, 0x3C204F8F, 0x538586E3, 0x59726915,
+    0x734D5309, 0xBC1AC763, 0x7D0722CC, 0xD289CABE,
+    0xE94CA9BC, 0x05B74F3F, 0xA51E1F42, 0x40000000
+};
 
 /*
  * Lookup tables for the slicing-by-8 algorithm, for the so-called Castagnoli
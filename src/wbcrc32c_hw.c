@@ -0,0 +1,258 @@
+/*-------------------------------------------------------------------------
+ *
+ * wbcrc32c_hw.c
+ *	  Compute CRC-32C checksum using CPU instructions where available, and
+ *	  choose the implementation at runtime.
+ *
+ * On x86-64 the SSE 4.2 crc32 instruction handles eight bytes at a time.
+ * Its latency is three times its throughput, so long buffers are split into
+ * three lanes that are computed in parallel and combined afterwards with a
+ * carry-less multiplication (PCLMULQDQ). On ARMv8 the CRC extension is used.
+ * Everything else falls back to slicing-by-8.
+ *
+ * Portions Copyright (c) 1996-2015, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ *
+ * IDENTIFICATION
+ *	  src/port/pg_crc32c_sse42.c, src/port/pg_crc32c_armv8.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "wbcrc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+static pg_crc32c pg_comp_crc32c_choose(pg_crc32c crc, const void *data, size_t len);
+
+pg_crc32c (*pg_comp_crc32c) (pg_crc32c crc, const void *data, size_t len) = pg_comp_crc32c_choose;
+
+#if defined(__x86_64__)
+
+/*
+ * Bytes per lane for the three way interleaved loop. The lanes are combined
+ * by multiplying with x^(8 * len - 33), the 33 making up for the bit lost in
+ * the carry-less product and the 32 bits the crc32 instruction appends.
+ */
+#define CRC32C_LANE 256
+#define CRC32C_LANE_K1 0xB9E02B86		/* x^(8 * 256 - 33) */
+#define CRC32C_LANE_K2 0xDD7E3B0C		/* x^(8 * 512 - 33) */
+
+bool
+pg_crc32c_sse42_available(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_SSE4_2) != 0;
+}
+
+bool
+pg_crc32c_pclmul_available(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_SSE4_2) != 0 && (ecx & bit_PCLMUL) != 0;
+}
+
+__attribute__((target("sse4.2")))
+pg_crc32c
+pg_comp_crc32c_sse42(pg_crc32c crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    const unsigned char *pend = p + len;
+    uint64      crc64 = crc;
+
+    /*
+     * Process eight bytes of data at a time. Unaligned access is cheap on
+     * all CPUs that have the instruction.
+     */
+    while (p + 8 <= pend)
+    {
+        uint64      v;
+
+        memcpy(&v, p, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+    }
+    crc = (pg_crc32c) crc64;
+
+    /* Process remaining full four bytes if any */
+    if (p + 4 <= pend)
+    {
+        uint32      v;
+
+        memcpy(&v, p, sizeof(v));
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+    }
+
+    /* Process any remaining bytes one at a time */
+    while (p < pend)
+    {
+        crc = _mm_crc32_u8(crc, *p);
+        p++;
+    }
+
+    return crc;
+}
+
+/*
+ * Shift crc over len zero bytes, k being x^(8 * len - 33).
+ */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint64
+crc32c_shift_pclmul(pg_crc32c crc, uint32 k)
+{
+    __m128i     prod;
+
+    prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int) crc),
+                                _mm_cvtsi32_si128((int) k), 0x00);
+    return _mm_crc32_u64(0, (uint64) _mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+pg_crc32c
+pg_comp_crc32c_sse42_pclmul(pg_crc32c crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len >= 3 * CRC32C_LANE)
+    {
+        uint64      crc0 = crc;
+        uint64      crc1 = 0;
+        uint64      crc2 = 0;
+        int         i;
+
+        for (i = 0; i < CRC32C_LANE; i += 8)
+        {
+            uint64      v0, v1, v2;
+
+            memcpy(&v0, p + i, sizeof(v0));
+            memcpy(&v1, p + CRC32C_LANE + i, sizeof(v1));
+            memcpy(&v2, p + 2 * CRC32C_LANE + i, sizeof(v2));
+            crc0 = _mm_crc32_u64(crc0, v0);
+            crc1 = _mm_crc32_u64(crc1, v1);
+            crc2 = _mm_crc32_u64(crc2, v2);
+        }
+
+        crc = (pg_crc32c) (crc32c_shift_pclmul((pg_crc32c) crc0, CRC32C_LANE_K2) ^
+                           crc32c_shift_pclmul((pg_crc32c) crc1, CRC32C_LANE_K1) ^
+                           crc2);
+
+        p += 3 * CRC32C_LANE;
+        len -= 3 * CRC32C_LANE;
+    }
+
+    return pg_comp_crc32c_sse42(crc, p, len);
+}
+
+#elif defined(__aarch64__)
+
+bool
+pg_crc32c_armv8_available(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+__attribute__((target("+crc")))
+pg_crc32c
+pg_comp_crc32c_armv8(pg_crc32c crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    const unsigned char *pend = p + len;
+
+    while (p + 8 <= pend)
+    {
+        uint64      v;
+
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+        p += 8;
+    }
+
+    if (p + 4 <= pend)
+    {
+        uint32      v;
+
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cw(crc, v);
+        p += 4;
+    }
+
+    while (p < pend)
+    {
+        crc = __crc32cb(crc, *p);
+        p++;
+    }
+
+    return crc;
+}
+
+#endif
+
+/*
+ * Name of the implementation COMP_CRC32C uses.
+ */
+const char *
+pg_crc32c_implementation(void)
+{
+    pg_crc32c (*impl) (pg_crc32c crc, const void *data, size_t len) = pg_comp_crc32c;
+
+    if (impl == pg_comp_crc32c_choose)
+    {
+        (void) pg_comp_crc32c_choose(0, NULL, 0);
+        impl = pg_comp_crc32c;
+    }
+
+#if defined(__x86_64__)
+    if (impl == pg_comp_crc32c_sse42_pclmul)
+        return "sse4.2+pclmul";
+    if (impl == pg_comp_crc32c_sse42)
+        return "sse4.2";
+#elif defined(__aarch64__)
+    if (impl == pg_comp_crc32c_armv8)
+        return "armv8";
+#endif
+    return "slicing-by-8";
+}
+
+/*
+ * This gets called on the first call. It replaces the function pointer so
+ * that subsequent calls are routed directly to the chosen implementation.
+ * Threads racing here all store the same value.
+ */
+static pg_crc32c
+pg_comp_crc32c_choose(pg_crc32c crc, const void *data, size_t len)
+{
+#if defined(__x86_64__)
+    if (pg_crc32c_pclmul_available())
+        pg_comp_crc32c = pg_comp_crc32c_sse42_pclmul;
+    else if (pg_crc32c_sse42_available())
+        pg_comp_crc32c = pg_comp_crc32c_sse42;
+    else
+        pg_comp_crc32c = pg_comp_crc32c_sb8;
+#elif defined(__aarch64__)
+    if (pg_crc32c_armv8_available())
+        pg_comp_crc32c = pg_comp_crc32c_armv8;
+    else
+        pg_comp_crc32c = pg_comp_crc32c_sb8;
+#else
+    pg_comp_crc32c = pg_comp_crc32c_sb8;
+#endif
+
+    return pg_comp_crc32c(crc, data, len);
+}
@@ -0,0 +1,432 @@
+#include "wbengine.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "wbclientconn.h"
+#include "wbmasterconn.h"
+#include "wbutils.h"
+
+#define ENGINE_MAX_EVENTS 64
+/* Number of steps a stream may take before other streams get their turn */
+#define ENGINE_MAX_STEPS 64
+#define SESSION_STACK_SIZE (512*1024)
+
+typedef struct WbWorker WbWorker;
+typedef struct WbSession WbSession;
+
+struct WbSession {
+	WbConn conn;
+	MasterConn *master;
+	WbCCStream *stream;
+
+	/* Events currently registered with the worker */
+	uint32 clientEvents;
+	int sourceFd;
+	uint32 sourceEvents;
+
+	bool queued;
+	/* Link in the incoming list or run queue of the worker */
+	WbSession *next;
+};
+
+struct WbWorker {
+	int id;
+	pthread_t thread;
+	int epfd;
+	/* Signalled when sessions are added to incoming */
+	int wakeFd;
+	int numSessions;
+
+	pthread_mutex_t lock;
+	WbSession *incoming;
+
+	/* Sessions that can make progress without waiting */
+	WbSession *runQueue;
+	WbSession *runQueueTail;
+};
+
+static WbWorker *workers = NULL;
+static int engineWorkers = 0;
+
+static void* WorkerMain(void *arg);
+static void* SessionMain(void *arg);
+static void EngineStartSessionThread(WbSession *session);
+static void EngineCloseSession(WbSession *session);
+static void EngineAssignWorker(WbSession *session);
+static void EngineTakeIncoming(WbWorker *worker);
+static void EngineQueue(WbWorker *worker, WbSession *session);
+static void EngineRunQueue(WbWorker *worker);
+static void EngineRunSession(WbWorker *worker, WbSession *session);
+static void EngineControl(WbWorker *worker, int op, int fd, uint32 events, WbSession *session);
+static bool EngineUpdateEvents(WbWorker *worker, WbSession *session);
+static void EngineRemoveSession(WbWorker *worker, WbSession *session);
+
+void
+WbEngineStart(int numWorkers)
+{
+	int i;
+
+	/* A client going away must not take down everybody else */
+	signal(SIGPIPE, SIG_IGN);
+
+	workers = wballoc0(sizeof(WbWorker) * numWorkers);
+	engineWorkers = numWorkers;
+
+	for (i = 0; i < numWorkers; i++)
+	{
+		WbWorker *worker = &(workers[i]);
+
+		worker->id = i;
+		worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (worker->epfd < 0)
+			error("Could not create epoll instance for worker %d", i);
+		worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (worker->wakeFd < 0)
+			error("Could not create wakeup handle for worker %d", i);
+		EngineControl(worker, EPOLL_CTL_ADD, worker->wakeFd, EPOLLIN, NULL);
+		pthread_mutex_init(&(worker->lock), NULL);
+
+		if (pthread_create(&(worker->thread), NULL, WorkerMain, worker))
+			error("Could not start worker thread %d", i);
+	}
+
+	log_info("Started %d worker threads", numWorkers);
+}
+
+/*
+ * Take over a newly accepted client connection.
+ */
+void
+WbEngineStartSession(WbConn conn)
+{
+	WbSession *session = wballoc0(sizeof(WbSession));
+
+	session->conn = conn;
+	session->sourceFd = -1;
+
+	EngineStartSessionThread(session);
+}
+
+static void
+EngineStartSessionThread(WbSession *session)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int rc;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, SESSION_STACK_SIZE);
+
+	rc = pthread_create(&thread, &attr, SessionMain, session);
+	pthread_attr_destroy(&attr);
+
+	if (rc)
+	{
+		log_error("Could not start session thread: %s", strerror(rc));
+		EngineCloseSession(session);
+	}
+}
+
+/*
+ * Startup and command phase of a client. Blocks on the client and master
+ * connections, so each session gets a thread of its own until it starts
+ * streaming.
+ */
+static void*
+SessionMain(void *arg)
+{
+	WbSession *session = arg;
+	jmp_buf handler;
+
+	if (setjmp(handler))
+	{
+		errorHandler = NULL;
+		EngineCloseSession(session);
+		return NULL;
+	}
+	errorHandler = &handler;
+
+	if (session->stream)
+	{
+		/* Back from a worker after streaming ended */
+		WbCCStream *stream = session->stream;
+
+		session->stream = NULL;
+		WbCCEndStreaming(stream);
+	}
+	else
+	{
+		WbCCInitConnection(session->conn);
+		WbCCPerformAuthentication(session->conn);
+		session->master = WbCCStartSession(session->conn);
+	}
+
+	session->stream = WbCCRunCommands(session->conn, session->master, true);
+	errorHandler = NULL;
+
+	if (session->stream)
+		EngineAssignWorker(session);
+	else
+		EngineCloseSession(session);
+
+	return NULL;
+}
+
+static void
+EngineCloseSession(WbSession *session)
+{
+	if (session->stream)
+		WbCCAbortStream(session->stream);
+	if (session->master)
+		WbMcCloseConnection(session->master);
+	CloseConn(session->conn);
+	wbfree(session);
+}
+
+/*
+ * Hand a streaming session to the worker with the least sessions.
+ */
+static void
+EngineAssignWorker(WbSession *session)
+{
+	WbWorker *worker = &(workers[0]);
+	uint64 one = 1;
+	int i;
+
+	for (i = 1; i < engineWorkers; i++)
+	{
+		if (__atomic_load_n(&(workers[i].numSessions), __ATOMIC_RELAXED) <
+				__atomic_load_n(&(worker->numSessions), __ATOMIC_RELAXED))
+			worker = &(workers[i]);
+	}
+	__atomic_add_fetch(&(worker->numSessions), 1, __ATOMIC_RELAXED);
+
+	session->clientEvents = 0;
+	session->sourceFd = -1;
+	session->sourceEvents = 0;
+	session->queued = false;
+
+	pthread_mutex_lock(&(worker->lock));
+	session->next = worker->incoming;
+	worker->incoming = session;
+	pthread_mutex_unlock(&(worker->lock));
+
+	if (write(worker->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		error("Could not wake up worker %d", worker->id);
+}
+
+static void*
+WorkerMain(void *arg)
+{
+	WbWorker *worker = arg;
+	struct epoll_event events[ENGINE_MAX_EVENTS];
+
+	for (;;)
+	{
+		int n;
+		int i;
+
+		/* Don't sleep while some streams have work left */
+		n = epoll_wait(worker->epfd, events, ENGINE_MAX_EVENTS,
+				worker->runQueue ? 0 : -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error("epoll_wait failed in worker %d", worker->id);
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			WbSession *session = events[i].data.ptr;
+			if (session)
+				EngineQueue(worker, session);
+			else
+				EngineTakeIncoming(worker);
+		}
+
+		EngineRunQueue(worker);
+	}
+
+	return NULL;
+}
+
+static void
+EngineTakeIncoming(WbWorker *worker)
+{
+	WbSession *session;
+	uint64 count;
+
+	if (read(worker->wakeFd, &count, sizeof(count)) < 0 &&
+			errno != EAGAIN && errno != EWOULDBLOCK)
+		error("Could not read wakeup handle of worker %d", worker->id);
+
+	pthread_mutex_lock(&(worker->lock));
+	session = worker->incoming;
+	worker->incoming = NULL;
+	pthread_mutex_unlock(&(worker->lock));
+
+	while (session)
+	{
+		WbSession *next = session->next;
+
+		session->next = NULL;
+		EngineControl(worker, EPOLL_CTL_ADD, ConnGetSocket(session->conn), EPOLLIN, session);
+		session->clientEvents = EPOLLIN;
+		EngineQueue(worker, session);
+
+		session = next;
+	}
+}
+
+static void
+EngineQueue(WbWorker *worker, WbSession *session)
+{
+	if (session->queued)
+		return;
+
+	session->queued = true;
+	session->next = NULL;
+	if (worker->runQueueTail)
+		worker->runQueueTail->next = session;
+	else
+		worker->runQueue = session;
+	worker->runQueueTail = session;
+}
+
+/*
+ * Run every session that is queued now. Sessions queued while running get
+ * their turn after we have checked for new events.
+ */
+static void
+EngineRunQueue(WbWorker *worker)
+{
+	WbSession *session = worker->runQueue;
+
+	worker->runQueue = NULL;
+	worker->runQueueTail = NULL;
+
+	while (session)
+	{
+		WbSession *next = session->next;
+
+		session->next = NULL;
+		session->queued = false;
+		EngineRunSession(worker, session);
+
+		session = next;
+	}
+}
+
+static void
+EngineRunSession(WbWorker *worker, WbSession *session)
+{
+	jmp_buf handler;
+	WbCCStreamState state = STREAM_BUSY;
+	bool ready;
+	int steps;
+
+	/* An error only ends this session */
+	if (setjmp(handler))
+	{
+		errorHandler = NULL;
+		EngineRemoveSession(worker, session);
+		EngineCloseSession(session);
+		return;
+	}
+	errorHandler = &handler;
+
+	for (steps = 0; steps < ENGINE_MAX_STEPS && state == STREAM_BUSY; steps++)
+		state = WbCCStreamStep(session->stream);
+
+	if (state == STREAM_DONE)
+	{
+		errorHandler = NULL;
+		EngineRemoveSession(worker, session);
+		EngineStartSessionThread(session);
+		return;
+	}
+
+	ready = EngineUpdateEvents(worker, session);
+	errorHandler = NULL;
+
+	if (state == STREAM_BUSY || ready)
+		EngineQueue(worker, session);
+}
+
+static void
+EngineControl(WbWorker *worker, int op, int fd, uint32 events, WbSession *session)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.ptr = session;
+
+	if (epoll_ctl(worker->epfd, op, fd, &event))
+		error("Could not register descriptor %d with worker %d", fd, worker->id);
+}
+
+/*
+ * Register what the stream waits for. Returns true if the stream can make
+ * progress without waiting.
+ */
+static bool
+EngineUpdateEvents(WbWorker *worker, WbSession *session)
+{
+	bool wantSource;
+	bool wantWrite;
+	bool ready;
+	int fd;
+	uint32 clientEvents;
+	uint32 sourceEvents;
+
+	fd = WbCCStreamGetEvents(session->stream, &wantSource, &wantWrite, &ready);
+	clientEvents = EPOLLIN | (wantWrite ? EPOLLOUT : 0);
+	sourceEvents = wantSource ? EPOLLIN : 0;
+
+	if (clientEvents != session->clientEvents)
+	{
+		EngineControl(worker, EPOLL_CTL_MOD, ConnGetSocket(session->conn),
+				clientEvents, session);
+		session->clientEvents = clientEvents;
+	}
+
+	if (fd != session->sourceFd)
+	{
+		/* Stream switched between hub, spool and master */
+		if (session->sourceFd >= 0)
+			epoll_ctl(worker->epfd, EPOLL_CTL_DEL, session->sourceFd, NULL);
+		session->sourceFd = -1;
+		/* The spool has nothing to wait on */
+		if (fd >= 0)
+			EngineControl(worker, EPOLL_CTL_ADD, fd, sourceEvents, session);
+		session->sourceFd = fd;
+		session->sourceEvents = sourceEvents;
+	}
+	else if (fd >= 0 && sourceEvents != session->sourceEvents)
+	{
+		EngineControl(worker, EPOLL_CTL_MOD, fd, sourceEvents, session);
+		session->sourceEvents = sourceEvents;
+	}
+
+	return ready;
+}
+
+static void
+EngineRemoveSession(WbWorker *worker, WbSession *session)
+{
+	epoll_ctl(worker->epfd, EPOLL_CTL_DEL, ConnGetSocket(session->conn), NULL);
+	if (session->sourceFd >= 0)
+		epoll_ctl(worker->epfd, EPOLL_CTL_DEL, session->sourceFd, NULL);
+	session->sourceFd = -1;
+
+	__atomic_sub_fetch(&(worker->numSessions), 1, __ATOMIC_RELAXED);
+}
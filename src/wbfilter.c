@@ -5,20 +5,40 @@
 #include "wbpgtypes.h"
 #include "wbutils.h"
 #include "wbcrc32c.h"
+#include "wbwalindex.h"
 
 
 
+/* Instantiated once per major version, see FILTER_PARSER */
+#define FILTER_TEMPLATE static inline __attribute__((always_inline))
+
+FILTER_TEMPLATE bool FilterProcessBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, const int xlog_page_magic);
 static bool IsAtWalPageBoundary(ReplMessage *msg);
+FILTER_TEMPLATE void FilterCheckPageHeaders(FilterData *fl, ReplMessage *msg, const int xlog_page_magic);
+static void FilterCheckContinuation(FilterData *fl, XLogPageHeader header);
 static char *ReplMessageConsume(ReplMessage *msg, size_t amount);
 static void ReplMessageBuffer(FilterData *fl, ReplMessage *msg, int amount);
 static void ReplMessageCopy(FilterData *fl, ReplMessage *msg, int amount);
 static void ReplMessageZero(FilterData *fl, ReplMessage *msg, int amount);
 static void ReplMessageAlign(ReplMessage *msg);
-static int ReplDataRemainingInSegment(ReplMessage *msg);
+static int ReplDataRemainingInSegment(FilterData *fl, ReplMessage *msg);
 static void WriteNoopRecord(FilterData *fl, ReplMessage *msg);
 static void FilterClearBuffer(FilterData *fl);
 static bool NeedToFilter(FilterData *fl, RelFileNode *node);
+static void FilterTrackCatalog(FilterData *fl, XLogRecord *rec, Oid oid, int xlog_page_magic);
+static void FilterCompileRules(FilterData *fl);
+static void FilterFreeRules(FilterRules *rules);
+static void OidSetBuild(FilterOidSet *set, Oid *list, Oid *extra);
+static bool OidSetContains(FilterOidSet *set, Oid oid);
+static bool FilterDecide(FilterRules *rules, RelFileNode *node);
+static void RelSetBuild(FilterRelSet *set, FilterRelNode *list, FilterRelNode *extra);
+static bool RelSetContains(FilterRelSet *set, Oid dbNode, Oid relNode);
+static bool FilterDecideRelation(FilterRules *rules, RelFileNode *node);
+static void FilterTrackRelation(FilterData *fl, RelFileNode *node);
+static bool FilterForkExcluded(FilterData *fl, XLogRecord *rec);
 static void FilterBufferRecordHeader(FilterData* fl, ReplMessage* msg);
+static void FilterStartCrc(FilterData *fl, XLogRecord *rec);
+static bool FilterRecordDone(FilterData *fl, ReplMessage *msg, XLogRecPtr *retryPos);
 static pg_crc32c CalculateCRC32(char *buffer, int len, int total_len);
 static void InjectDummyDataHeaderLongAfterRecordHeader(XLogRecord *rec);
 
@@ -27,25 +47,76 @@ WbFCreateProcessingState(XLogRecPtr startPoint)
 {
 	FilterData *fl;
 	fl = wballoc0(sizeof(FilterData));
+	fl->segSize = XLogSegSize;
+
+	WbFResetProcessingState(fl, startPoint);
+
+	return fl;
+}
 
+/*
+ * Start processing the stream anew from startPoint. Filtering rules are
+ * kept.
+ */
+void
+WbFResetProcessingState(FilterData* fl, XLogRecPtr startPoint)
+{
 	fl->state = FS_SYNCHRONIZING;
 	fl->dataNeeded = 0;
 	fl->recordRemaining = 0;
 	fl->synchronized = false;
 	fl->requestedStartPos = startPoint;
+	fl->pageTli = 0;
+	fl->recordPtr = 0;
+	fl->contPagePtr = 0;
+	fl->contPageTli = 0;
 	fl->recordStart = 0;
 	fl->headerPos = -1;
 	fl->headerLen = 0;
 	fl->bufferLen = 0;
 	fl->unsentBufferLen = 0;
-
-	return fl;
+	fl->crcActive = false;
 }
+
 void WbFFreeProcessingState(FilterData* fl)
 {
+	if (fl->pending_tablespaces)
+		wbfree(fl->pending_tablespaces);
+	if (fl->pending_databases)
+		wbfree(fl->pending_databases);
+	if (fl->pending_relations)
+		wbfree(fl->pending_relations);
+	FilterFreeRules(&(fl->rules));
 	wbfree(fl);
 }
 
+bool
+WbFHasFilter(FilterData* fl)
+{
+	return fl->include_tablespaces || fl->include_databases ||
+			fl->exclude_tablespaces || fl->exclude_databases ||
+			fl->include_relation_databases || fl->exclude_relation_databases ||
+			fl->exclude_forks;
+}
+
+bool
+WbFIsSynchronized(FilterData* fl)
+{
+	return fl->synchronized;
+}
+
+/*
+ * Returns true if objects were created in the stream that the caller should
+ * look up by name.
+ */
+bool
+WbFHasPendingOids(FilterData* fl)
+{
+	return (fl->pending_tablespaces && *fl->pending_tablespaces) ||
+			(fl->pending_databases && *fl->pending_databases) ||
+			(fl->pending_relations && fl->pending_relations->dbNode);
+}
+
 /*#define parse_debug(...) do{\
 	fprintf (stderr, __VA_ARGS__);\
 	fprintf (stderr, "\n");\
@@ -53,9 +124,79 @@ void WbFFreeProcessingState(FilterData* fl)
 
 #define parse_debug(...)
 
+/*
+ * The parser is instantiated for each supported major version with the page
+ * magic as a constant, so that version dependent layouts and branches are
+ * resolved at compile time. FilterParsers lists them from newest to oldest.
+ */
+#define FILTER_PARSER(version) \
+static bool \
+FilterProcessBlock##version(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos) \
+{ \
+	return FilterProcessBlock(msg, fl, retryPos, XLOG_PAGE_MAGIC_##version); \
+}
+
+FILTER_PARSER(18)
+FILTER_PARSER(17)
+FILTER_PARSER(16)
+FILTER_PARSER(15)
+FILTER_PARSER(14)
+FILTER_PARSER(13)
+
+static const struct {
+	int serverVersion;
+	int pageMagic;
+	FilterParser parser;
+} FilterParsers[] = {
+	{180000, XLOG_PAGE_MAGIC_18, FilterProcessBlock18},
+	{170000, XLOG_PAGE_MAGIC_17, FilterProcessBlock17},
+	{160000, XLOG_PAGE_MAGIC_16, FilterProcessBlock16},
+	{150000, XLOG_PAGE_MAGIC_15, FilterProcessBlock15},
+	{140000, XLOG_PAGE_MAGIC_14, FilterProcessBlock14},
+	{130000, XLOG_PAGE_MAGIC_13, FilterProcessBlock13}
+};
+
+#define NUM_FILTER_PARSERS (sizeof(FilterParsers) / sizeof(FilterParsers[0]))
+
+/*
+ * Page magic of the WAL written by server_version, 0 if unsupported.
+ */
+int
+WbFPageMagicForVersion(int server_version)
+{
+	int i;
+
+	for (i = 0; i < NUM_FILTER_PARSERS; i++)
+		if (server_version >= FilterParsers[i].serverVersion)
+			return FilterParsers[i].pageMagic;
+	return 0;
+}
+
 bool
 WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, int xlog_page_magic)
 {
+	/* Pick the parser when the stream starts */
+	if (fl->pageMagic != xlog_page_magic)
+	{
+		int i;
+
+		for (i = 0; i < NUM_FILTER_PARSERS; i++)
+			if (FilterParsers[i].pageMagic == xlog_page_magic)
+				break;
+		if (i == NUM_FILTER_PARSERS)
+			error("Unsupported WAL page magic 0x%x", xlog_page_magic);
+		fl->pageMagic = xlog_page_magic;
+		fl->parser = FilterParsers[i].parser;
+	}
+
+	return fl->parser(msg, fl, retryPos);
+}
+
+FILTER_TEMPLATE bool
+FilterProcessBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, const int xlog_page_magic)
+{
+	FilterCheckPageHeaders(fl, msg, xlog_page_magic);
+
 	// consume the whole message
 	while (msg->dataPtr < msg->dataLen)
 	{
@@ -87,6 +228,7 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 				continue;
 			}
 
+			// Only zeroed pages get here unchecked, see FilterCheckPageHeaders
 			if (header->xlp_magic != xlog_page_magic)
 				error("Received page with invalid page magic 0x%x", header->xlp_magic);
 
@@ -99,6 +241,16 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 			 */
 			if (fl->recordStart == headerPos)
 				fl->recordStart = msg->dataPtr;
+			// Same for its LSN, if none of the record header was seen yet
+			if (fl->state == FS_BUFFER_RECORD && fl->bufferLen == 0)
+				fl->recordPtr = msg->dataStart + msg->dataPtr;
+
+			FilterCheckContinuation(fl, header);
+
+			// Record where the continued record starts for later streams
+			if (fl->synchronized && fl->state != FS_SYNCHRONIZING &&
+					(header->xlp_info & XLP_FIRST_IS_CONTRECORD))
+				WbWalIndexAdd(header->xlp_tli, header->xlp_pageaddr, fl->recordPtr);
 
 			switch (fl->state)
 			{
@@ -114,6 +266,8 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 					// Skip rest of the continuation record for now.
 					fl->state = FS_COPY_NORMAL;
 					fl->dataNeeded = header->xlp_rem_len;
+					fl->contPagePtr = header->xlp_pageaddr;
+					fl->contPageTli = header->xlp_tli;
 					parse_debug("Unsynchronized at start pos, skipping %d to next record header", fl->dataNeeded);
 
 					break;
@@ -128,6 +282,7 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 			case FS_BUFFER_IMAGE_HEADER:
 			case FS_BUFFER_COMPRESSION_HEADER:
 			case FS_BUFFER_FILENODE:
+			case FS_BUFFER_CATALOG_OID:
 			case FS_COPY_NORMAL:
 			case FS_COPY_ZERO:
 				// We just take note of the header pos to skip over it when
@@ -171,7 +326,19 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 					if (!rec->xl_tot_len)
 						error("Received invalid WAL record");
 
-					if (!fl->synchronized)
+					// The previous record is the one we skipped the rest of
+					if (!fl->synchronized && fl->contPagePtr)
+						WbWalIndexAdd(fl->contPageTli, fl->contPagePtr, rec->xl_prev);
+
+					if (!fl->synchronized && fl->syncForward)
+					{
+						fl->synchronized = true;
+						if (fl->requestedStartPos < fl->recordPtr)
+							fl->requestedStartPos = fl->recordPtr;
+						parse_debug("Found next record, synchronizing at xlog pos %X/%X",
+								FormatRecPtr(fl->recordPtr));
+					}
+					else if (!fl->synchronized)
 					{
 						// We are not synchronized, restart at previous record
 						*retryPos = rec->xl_prev;
@@ -182,12 +349,20 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 					}
 
 					fl->recordRemaining = rec->xl_tot_len - REC_HEADER_LEN;
+					fl->blockFork = MAIN_FORKNUM;
+
+					if (fl->verifyCrc)
+						FilterStartCrc(fl, rec);
 
 					if (rec->xl_rmid == RM_XLOG_ID && (rec->xl_info & 0xF0) == XLOG_SWITCH)
 					{
+						// Switch records have no data, only padding follows
+						if (!FilterRecordDone(fl, msg, retryPos))
+							return false;
+
 						// Stream out data until end of buffer
 						fl->state = FS_COPY_SWITCH;
-						fl->dataNeeded = ReplDataRemainingInSegment(msg);
+						fl->dataNeeded = ReplDataRemainingInSegment(fl, msg);
 						FilterClearBuffer(fl);
 						parse_debug(" - Xlog switch, copying %d bytes ", fl->dataNeeded);
 						break;
@@ -286,6 +461,22 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 										fl->dataNeeded);
 							break;
 						}
+						else if ((rec->xl_rmid == RM_DBASE_ID || rec->xl_rmid == RM_TBLSPC_ID) &&
+								 (block_id == XLR_BLOCK_ID_DATA_SHORT ||
+								  block_id == XLR_BLOCK_ID_DATA_LONG) &&
+								 WbFHasFilter(fl))
+						{
+							/* Main data of these starts with the OID of the object */
+							int lenSize = block_id == XLR_BLOCK_ID_DATA_SHORT ?
+									sizeof(uint8) : sizeof(uint32);
+
+							fl->state = FS_BUFFER_CATALOG_OID;
+							fl->dataNeeded = lenSize + sizeof(Oid);
+							fl->recordRemaining -= lenSize;
+							parse_debug(" - Catalog record, buffering %d bytes for OID",
+										fl->dataNeeded);
+							break;
+						}
 						else
 						{
 							fl->state = FS_COPY_NORMAL;
@@ -312,6 +503,7 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 					XLogRecordBlockHeader *block = (XLogRecordBlockHeader*) (fl->buffer + REC_HEADER_LEN);
 
 					fl->recordRemaining -= SizeOfXLogRecordBlockHeader - 1;
+					fl->blockFork = block->fork_flags & BKPBLOCK_FORK_MASK;
 
 					if (block->fork_flags & BKPBLOCK_SAME_REL)
 					{
@@ -343,7 +535,7 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 				{
 					XLogRecordBlockImageHeader *imghdr = (XLogRecordBlockImageHeader*) (fl->buffer + fl->bufferLen - SizeOfXLogRecordBlockImageHeader);
 					bool has_compr_header = (imghdr->bimg_info & BKPIMAGE_HAS_HOLE) &&
-						BKPIMAGE_COMPRESSED(imghdr->bimg_info);
+						BKPIMAGE_COMPRESSED(imghdr->bimg_info, xlog_page_magic);
 
 					fl->recordRemaining -= SizeOfXLogRecordBlockImageHeader;
 
@@ -381,11 +573,28 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 					ReplMessageBuffer(fl, msg, amountAvailable);
 				if (!fl->dataNeeded)
 				{
+					XLogRecord *rec = (XLogRecord*) fl->buffer;
+					RelFileNode *node = (RelFileNode*) (fl->buffer + fl->bufferLen - sizeof(RelFileNode));
+					uint32 recordLen = rec->xl_tot_len;
+					bool filter;
+
 					parse_debug(" - Filenode buffered at %d", msg->dataPtr);
 					fl->recordRemaining -= sizeof(RelFileNode);
-					if (NeedToFilter(fl,
-							(RelFileNode*) (fl->buffer + fl->bufferLen - sizeof(RelFileNode))))
+					if (rec->xl_rmid == RM_SMGR_ID &&
+							(rec->xl_info & 0xF0) == XLOG_SMGR_CREATE)
+						FilterTrackRelation(fl, node);
+
+					filter = NeedToFilter(fl, node);
+					if (!filter && FilterForkExcluded(fl, rec))
+					{
+						filter = true;
+						fl->forkFilteredBytes += recordLen;
+					}
+
+					if (filter)
 					{
+						fl->filteredRecords++;
+						fl->filteredBytes += recordLen;
 						WriteNoopRecord(fl, msg);
 						fl->state = FS_COPY_ZERO;
 						FilterClearBuffer(fl);
@@ -401,6 +610,25 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 					parse_debug(" - Copying %d bytes until next record", fl->dataNeeded);
 				}
 				break;
+			case FS_BUFFER_CATALOG_OID:
+				if (fl->dataNeeded <= amountAvailable)
+					ReplMessageBuffer(fl, msg, fl->dataNeeded);
+				else
+					ReplMessageBuffer(fl, msg, amountAvailable);
+				if (!fl->dataNeeded)
+				{
+					Oid oid;
+
+					memcpy(&oid, fl->buffer + fl->bufferLen - sizeof(Oid), sizeof(Oid));
+					fl->recordRemaining -= sizeof(Oid);
+					FilterTrackCatalog(fl, (XLogRecord*) fl->buffer, oid, xlog_page_magic);
+
+					fl->state = FS_COPY_NORMAL;
+					FilterClearBuffer(fl);
+					fl->dataNeeded = fl->recordRemaining;
+					parse_debug(" - Copying %d bytes until next record", fl->dataNeeded);
+				}
+				break;
 			case FS_COPY_NORMAL:
 				if (fl->dataNeeded <= amountAvailable)
 					ReplMessageCopy(fl, msg, fl->dataNeeded);
@@ -408,6 +636,8 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 					ReplMessageCopy(fl, msg, amountAvailable);
 				if (!fl->dataNeeded)
 				{
+					if (!FilterRecordDone(fl, msg, retryPos))
+						return false;
 					ReplMessageAlign(msg);
 					FilterBufferRecordHeader(fl, msg);
 					parse_debug(" - Copy done, buffer %d bytes", fl->dataNeeded);
@@ -420,6 +650,8 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 					ReplMessageZero(fl, msg, amountAvailable);
 				if (!fl->dataNeeded)
 				{
+					if (!FilterRecordDone(fl, msg, retryPos))
+						return false;
 					ReplMessageAlign(msg);
 					FilterBufferRecordHeader(fl, msg);
 					parse_debug(" - Copy done, buffer %d bytes", fl->dataNeeded);
@@ -441,12 +673,192 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos, i
 	return true;
 }
 
+/*
+ * Work out the part of a processed message that can be sent out. Data that is
+ * buffered for a record header might still need to be rewritten, it is held
+ * back and included in the output of the next message instead. Returns false
+ * if there is nothing to send.
+ */
+bool
+WbFGetOutput(FilterData* fl, ReplMessage* msg, FilterOutput *out)
+{
+	XLogRecPtr dataStart;
+	int msgOffset = 0;
+	int buffered = 0;
+	int unsentLen = 0;
+
+	// Take a copy of the unsent buffer as it is reused for this message
+	if (fl->unsentBufferLen) {
+		unsentLen = fl->unsentBufferLen;
+		memcpy(fl->outputBuffer, fl->unsentBuffer, unsentLen);
+		log_debug2("Sending %d bytes of unbuffered data", unsentLen);
+	}
+
+	if (fl->state & FS_BUFFERING_STATE)
+	{
+		// Chomp the buffered data off of what we send
+		buffered = fl->bufferLen;
+		// Stash it away into fl state, we will send it with the next block
+		fl->unsentBufferLen = fl->bufferLen;
+		memcpy(fl->unsentBuffer, fl->buffer, fl->bufferLen);
+		// Make note that record starts in the unsent buffer for rewriting
+		fl->recordStart = -1;
+		log_debug2("Buffering %d bytes of data", buffered);
+
+	} else {
+		// Clear out unsent buffer
+		fl->unsentBufferLen = 0;
+	}
+
+	// Don't send anything if we are not synchronized, we will see this data again after replication restart
+	if (!fl->synchronized)
+	{
+		log_debug2("Skipping sending data.");
+		return false;
+	}
+
+	// Include the previously unsent data
+	dataStart = msg->dataStart - unsentLen;
+
+	if (fl->requestedStartPos > dataStart) {
+		if (fl->requestedStartPos >= (msg->dataStart + msg->dataLen - buffered))
+		{
+			log_info("Skipping whole WAL message as not requested");
+			return false;
+		}
+		msgOffset = fl->requestedStartPos - dataStart;
+		dataStart = fl->requestedStartPos;
+		log_debug2("Chomping WAL message down to size at %d", msgOffset);
+	}
+
+	out->dataStart = dataStart;
+	out->walEnd = msg->walEnd - buffered;
+	out->sendTime = msg->sendTime;
+
+	if (msgOffset < unsentLen)
+	{
+		out->prefix = fl->outputBuffer + msgOffset;
+		out->prefixLen = unsentLen - msgOffset;
+		msgOffset = 0;
+	}
+	else
+	{
+		out->prefix = NULL;
+		out->prefixLen = 0;
+		msgOffset -= unsentLen;
+	}
+
+	out->data = msg->data + msgOffset;
+	out->dataLen = msg->dataLen - msgOffset - buffered;
+
+	return true;
+}
+
 static bool
 IsAtWalPageBoundary(ReplMessage *msg)
 {
 	return msg->dataPtr == msg->nextPageBoundary;
 }
 
+/*
+ * Validate all page headers of a message before any of it is processed, so
+ * that bad input is rejected before we rewrite any of it. Headers must be
+ * complete, carry the page magic and their own address, match the segment
+ * and page size, and not go back in timelines. Zeroed headers are left for
+ * the main loop, the rest of a segment after an XLOG switch may look like
+ * that.
+ */
+FILTER_TEMPLATE void
+FilterCheckPageHeaders(FilterData *fl, ReplMessage *msg, const int xlog_page_magic)
+{
+	int pos;
+
+	for (pos = msg->nextPageBoundary; pos < msg->dataLen; pos += XLOG_BLCKSZ)
+	{
+		XLogPageHeader header = (XLogPageHeader) (msg->data + pos);
+		XLogRecPtr pageAddr = msg->dataStart + pos;
+		bool segStart = pageAddr % fl->segSize == 0;
+
+		if (pos + SizeOfXLogShortPHD > msg->dataLen ||
+				(segStart && pos + SizeOfXLogLongPHD > msg->dataLen))
+			error("WAL message ends inside page header at %X/%X",
+					FormatRecPtr(pageAddr));
+
+		if (header->xlp_magic == 0 && header->xlp_pageaddr == 0)
+			continue;
+
+		if (header->xlp_magic != xlog_page_magic)
+			error("Received page with invalid page magic 0x%x at %X/%X",
+					header->xlp_magic, FormatRecPtr(pageAddr));
+		if (header->xlp_info & ~XLP_ALL_FLAGS)
+			error("Received page with invalid info bits 0x%x at %X/%X",
+					header->xlp_info, FormatRecPtr(pageAddr));
+		if (header->xlp_pageaddr != pageAddr)
+			error("Received page with unexpected address %X/%X at %X/%X",
+					FormatRecPtr(header->xlp_pageaddr), FormatRecPtr(pageAddr));
+		if (segStart != ((header->xlp_info & XLP_LONG_HEADER) != 0))
+			error("Received page with %s header at %X/%X",
+					segStart ? "short" : "long", FormatRecPtr(pageAddr));
+		if (((header->xlp_info & XLP_FIRST_IS_CONTRECORD) != 0) !=
+				(header->xlp_rem_len != 0))
+			error("Received page with inconsistent continuation length %u at %X/%X",
+					header->xlp_rem_len, FormatRecPtr(pageAddr));
+		if (segStart)
+		{
+			XLogLongPageHeader longHeader = (XLogLongPageHeader) header;
+
+			if (longHeader->xlp_seg_size != fl->segSize ||
+					longHeader->xlp_xlog_blcksz != XLOG_BLCKSZ)
+				error("Received segment of %u bytes with %u byte pages at %X/%X, expected %u and %d",
+						longHeader->xlp_seg_size, longHeader->xlp_xlog_blcksz,
+						FormatRecPtr(pageAddr), fl->segSize, XLOG_BLCKSZ);
+		}
+		if (header->xlp_tli < fl->pageTli)
+			error("Received page of timeline %u after timeline %u at %X/%X",
+					header->xlp_tli, fl->pageTli, FormatRecPtr(pageAddr));
+		fl->pageTli = header->xlp_tli;
+	}
+}
+
+/*
+ * Check that a page continues the record we are in the middle of, or
+ * starts with a new one if we are between records.
+ */
+static void
+FilterCheckContinuation(FilterData *fl, XLogPageHeader header)
+{
+	uint32 remLen = (header->xlp_info & XLP_FIRST_IS_CONTRECORD) ?
+			header->xlp_rem_len : 0;
+
+	switch (fl->state)
+	{
+		case FS_COPY_NORMAL:
+		case FS_COPY_ZERO:
+			if (remLen == fl->dataNeeded)
+				return;
+			break;
+		case FS_BUFFER_RECORD:
+			if (fl->bufferLen == 0 ? remLen == 0 : remLen != 0)
+				return;
+			break;
+		case FS_BUFFER_BLOCK_ID:
+		case FS_BUFFER_BLOCK_HEADER:
+		case FS_BUFFER_IMAGE_HEADER:
+		case FS_BUFFER_COMPRESSION_HEADER:
+		case FS_BUFFER_FILENODE:
+		case FS_BUFFER_CATALOG_OID:
+			if (remLen != 0)
+				return;
+			break;
+		case FS_SYNCHRONIZING:
+		case FS_COPY_SWITCH:
+			return;
+	}
+
+	error("Page at %X/%X does not continue the current record, xlp_rem_len %u",
+			FormatRecPtr(header->xlp_pageaddr), remLen);
+}
+
 static char *
 ReplMessageConsume(ReplMessage *msg, size_t amount)
 {
@@ -462,6 +874,8 @@ ReplMessageBuffer(FilterData *fl, ReplMessage *msg, int amount)
 {
 	Assert(fl->bufferLen + amount <= FL_BUFFER_LEN);
 	Assert(msg->dataPtr + amount <= msg->dataLen);
+	if (fl->crcActive)
+		COMP_CRC32C(fl->recordCrc, msg->data + msg->dataPtr, amount);
 	memcpy(fl->buffer + fl->bufferLen, msg->data + msg->dataPtr, amount);
 	fl->bufferLen += amount;
 	msg->dataPtr += amount;
@@ -472,6 +886,8 @@ static void
 ReplMessageCopy(FilterData *fl, ReplMessage *msg, int amount)
 {
 	Assert(msg->dataPtr + amount <= msg->dataLen);
+	if (fl->crcActive)
+		COMP_CRC32C(fl->recordCrc, msg->data + msg->dataPtr, amount);
 	msg->dataPtr += amount;
 	fl->dataNeeded -= amount;
 }
@@ -480,6 +896,9 @@ static void
 ReplMessageZero(FilterData *fl, ReplMessage *msg, int amount)
 {
 	Assert(msg->dataPtr + amount <= msg->dataLen);
+	// Check what the master sent, not the NOOP we turn it into
+	if (fl->crcActive)
+		COMP_CRC32C(fl->recordCrc, msg->data + msg->dataPtr, amount);
 	memset(msg->data + msg->dataPtr, 0, amount);
 	msg->dataPtr += amount;
 	fl->dataNeeded -= amount;
@@ -495,10 +914,10 @@ ReplMessageAlign(ReplMessage *msg)
 }
 
 static int
-ReplDataRemainingInSegment(ReplMessage *msg)
+ReplDataRemainingInSegment(FilterData *fl, ReplMessage *msg)
 {
 	XLogRecPtr curPos = msg->dataStart + msg->dataPtr;
-	XLogRecPtr segEnd = (curPos + XLogSegSize) & (~(XLogSegSize - 1));
+	XLogRecPtr segEnd = curPos - curPos % fl->segSize + fl->segSize;
 	return segEnd - curPos;
 }
 
@@ -508,7 +927,7 @@ CalculateCRC32(char *buffer, int len, int total_len)
     	pg_crc32c crc;
     	INIT_CRC32C(crc);
     	COMP_CRC32C(crc, buffer + SizeOfXLogRecord, len - SizeOfXLogRecord);
-    	COMP_CRC32C_ZERO(crc, buffer + len, total_len - len);
+    	COMP_CRC32C_ZERO(crc, total_len - len);
     	COMP_CRC32C(crc, buffer, offsetof(XLogRecord, xl_crc));
     	FIN_CRC32C(crc);
     	return crc;
@@ -616,35 +1035,458 @@ OidInZeroTermOidList(Oid search, Oid *list)
 	return false;
 }
 
+/*
+ * Add oid to a zero terminated list unless it is already there.
+ */
+void
+WbFAddOid(Oid **list, Oid oid)
+{
+	int n = 0;
+
+	if (*list)
+	{
+		if (OidInZeroTermOidList(oid, *list))
+			return;
+		while ((*list)[n])
+			n++;
+	}
+
+	*list = rewballoc(*list, sizeof(Oid) * (n + 2));
+	(*list)[n] = oid;
+	(*list)[n + 1] = 0;
+}
+
+/*
+ * Remove oid from a zero terminated list, returns false if it was not there.
+ */
+bool
+WbFRemoveOid(Oid *list, Oid oid)
+{
+	Oid *cur = list;
+
+	for (; *cur; cur++)
+		if (*cur == oid)
+			break;
+	if (!*cur)
+		return false;
+
+	for (; *cur; cur++)
+		*cur = *(cur + 1);
+	return true;
+}
+
+/*
+ * Follow databases and tablespaces being created and dropped, so that the
+ * rules don't go stale until the next restart. A dropped OID can be reused,
+ * so it is removed from the rules. A created object is pending until the
+ * caller finds out its name, see WbFHasPendingOids().
+ */
+static void
+FilterTrackCatalog(FilterData *fl, XLogRecord *rec, Oid oid, int xlog_page_magic)
+{
+	uint8 info = rec->xl_info & 0xF0;
+	bool tablespace = rec->xl_rmid == RM_TBLSPC_ID;
+	Oid *include = tablespace ? fl->include_tablespaces : fl->include_databases;
+	Oid *exclude = tablespace ? fl->exclude_tablespaces : fl->exclude_databases;
+	Oid **pending = tablespace ? &(fl->pending_tablespaces) : &(fl->pending_databases);
+	bool drop;
+
+	/* Relation files of a database are gone with it */
+	if (!tablespace)
+	{
+		if (fl->include_relation_databases &&
+				WbFRemoveOid(fl->include_relation_databases, oid))
+			WbFSetRelations(&(fl->include_relations), oid, NULL, 0);
+		if (fl->exclude_relation_databases &&
+				WbFRemoveOid(fl->exclude_relation_databases, oid))
+			WbFSetRelations(&(fl->exclude_relations), oid, NULL, 0);
+		WbFRulesChanged(fl);
+	}
+
+	if (!include && !exclude)
+		return;
+
+	if (tablespace)
+		drop = info == XLOG_TBLSPC_DROP;
+	else if (xlog_page_magic >= XLOG_PAGE_MAGIC_15)
+		drop = info == XLOG_DBASE_DROP;
+	else
+		drop = info == XLOG_DBASE_DROP_OLD;
+
+	if (include)
+		WbFRemoveOid(include, oid);
+	if (exclude)
+		WbFRemoveOid(exclude, oid);
+	if (*pending)
+		WbFRemoveOid(*pending, oid);
+
+	if (drop)
+	{
+		log_info("%s %u dropped", tablespace ? "Tablespace" : "Database", oid);
+		WbFRulesChanged(fl);
+		return;
+	}
+
+	log_info("%s %u created", tablespace ? "Tablespace" : "Database", oid);
+	WbFAddOid(pending, oid);
+	WbFRulesChanged(fl);
+}
+
+/*
+ * Must be called after changing the filtering lists of fl.
+ */
+void
+WbFRulesChanged(FilterData* fl)
+{
+	fl->rules.valid = false;
+}
+
+static void
+FilterCompileRules(FilterData *fl)
+{
+	FilterRules *rules = &(fl->rules);
+
+	FilterFreeRules(rules);
+	OidSetBuild(&(rules->includeTablespaces), fl->include_tablespaces, fl->pending_tablespaces);
+	OidSetBuild(&(rules->includeDatabases), fl->include_databases, fl->pending_databases);
+	OidSetBuild(&(rules->excludeTablespaces), fl->exclude_tablespaces, NULL);
+	OidSetBuild(&(rules->excludeDatabases), fl->exclude_databases, NULL);
+	OidSetBuild(&(rules->includeRelationDatabases), fl->include_relation_databases, NULL);
+	OidSetBuild(&(rules->excludeRelationDatabases), fl->exclude_relation_databases, NULL);
+	RelSetBuild(&(rules->includeRelations), fl->include_relations, fl->pending_relations);
+	RelSetBuild(&(rules->excludeRelations), fl->exclude_relations, NULL);
+	rules->lastValid = false;
+	rules->valid = true;
+}
+
+static void
+FilterFreeRules(FilterRules *rules)
+{
+	FilterOidSet *sets[6] = {
+		&(rules->includeTablespaces),
+		&(rules->includeDatabases),
+		&(rules->excludeTablespaces),
+		&(rules->excludeDatabases),
+		&(rules->includeRelationDatabases),
+		&(rules->excludeRelationDatabases)
+	};
+	FilterRelSet *relSets[2] = {
+		&(rules->includeRelations),
+		&(rules->excludeRelations)
+	};
+	int i;
+
+	for (i = 0; i < 6; i++)
+	{
+		if (sets[i]->slots)
+			wbfree(sets[i]->slots);
+		sets[i]->slots = NULL;
+		sets[i]->mask = 0;
+	}
+	for (i = 0; i < 2; i++)
+	{
+		if (relSets[i]->slots)
+			wbfree(relSets[i]->slots);
+		relSets[i]->slots = NULL;
+		relSets[i]->mask = 0;
+	}
+	rules->valid = false;
+}
+
+#define OidSetHash(oid) ((uint32) (oid) * 2654435761U)
+
+static void
+OidSetInsert(FilterOidSet *set, Oid oid)
+{
+	uint32 pos = OidSetHash(oid) & set->mask;
+
+	while (set->slots[pos] && set->slots[pos] != oid)
+		pos = (pos + 1) & set->mask;
+	set->slots[pos] = oid;
+}
+
+/*
+ * Build a set of the OIDs in the zero terminated lists. Sets are kept at most
+ * half full so that lookups stay short.
+ */
+static void
+OidSetBuild(FilterOidSet *set, Oid *list, Oid *extra)
+{
+	uint32 size = 8;
+	int n = 0;
+	Oid *cur;
+
+	if (!list)
+		return;
+
+	for (cur = list; *cur; cur++)
+		n++;
+	for (cur = extra; cur && *cur; cur++)
+		n++;
+	while (size < 2 * n)
+		size <<= 1;
+
+	set->mask = size - 1;
+	set->slots = wballoc0(sizeof(Oid) * size);
+	for (cur = list; *cur; cur++)
+		OidSetInsert(set, *cur);
+	for (cur = extra; cur && *cur; cur++)
+		OidSetInsert(set, *cur);
+}
+
+static bool
+OidSetContains(FilterOidSet *set, Oid oid)
+{
+	uint32 pos = OidSetHash(oid) & set->mask;
+
+	while (set->slots[pos])
+	{
+		if (set->slots[pos] == oid)
+			return true;
+		pos = (pos + 1) & set->mask;
+	}
+	return false;
+}
+
+#define RelSetKey(dbNode, relNode) (((uint64) (dbNode) << 32) | (relNode))
+#define RelSetHash(key) ((uint32) (((key) * UINT64CONST(0x9E3779B97F4A7C15)) >> 32))
+
+static void
+RelSetInsert(FilterRelSet *set, uint64 key)
+{
+	uint32 pos = RelSetHash(key) & set->mask;
+
+	while (set->slots[pos] && set->slots[pos] != key)
+		pos = (pos + 1) & set->mask;
+	set->slots[pos] = key;
+}
+
+/*
+ * Build a set of the relation files in the lists. Keys are never zero since
+ * shared relations are not filtered by relation.
+ */
+static void
+RelSetBuild(FilterRelSet *set, FilterRelNode *list, FilterRelNode *extra)
+{
+	uint32 size = 8;
+	int n = 0;
+	FilterRelNode *cur;
+
+	if (!list && !extra)
+		return;
+
+	for (cur = list; cur && cur->dbNode; cur++)
+		n++;
+	for (cur = extra; cur && cur->dbNode; cur++)
+		n++;
+	while (size < 2 * n)
+		size <<= 1;
+
+	set->mask = size - 1;
+	set->slots = wballoc0(sizeof(uint64) * size);
+	for (cur = list; cur && cur->dbNode; cur++)
+		RelSetInsert(set, RelSetKey(cur->dbNode, cur->relNode));
+	for (cur = extra; cur && cur->dbNode; cur++)
+		RelSetInsert(set, RelSetKey(cur->dbNode, cur->relNode));
+}
+
+static bool
+RelSetContains(FilterRelSet *set, Oid dbNode, Oid relNode)
+{
+	uint64 key = RelSetKey(dbNode, relNode);
+	uint32 pos = RelSetHash(key) & set->mask;
+
+	while (set->slots[pos])
+	{
+		if (set->slots[pos] == key)
+			return true;
+		pos = (pos + 1) & set->mask;
+	}
+	return false;
+}
+
+/*
+ * Replace the relation files of database dbNode in a list with the n files
+ * in rels.
+ */
+void
+WbFSetRelations(FilterRelNode **list, Oid dbNode, FilterRelNode *rels, int n)
+{
+	int kept = 0;
+	int i;
+
+	if (*list)
+	{
+		for (i = 0; (*list)[i].dbNode; i++)
+			if ((*list)[i].dbNode != dbNode)
+				(*list)[kept++] = (*list)[i];
+	}
+
+	*list = rewballoc(*list, sizeof(FilterRelNode) * (kept + n + 1));
+	if (n)
+		memcpy(*list + kept, rels, sizeof(FilterRelNode) * n);
+	(*list)[kept + n].dbNode = 0;
+	(*list)[kept + n].relNode = 0;
+}
+
+/*
+ * Remove a relation file from a list, returns false if it was not there.
+ */
+bool
+WbFRemoveRelation(FilterRelNode *list, Oid dbNode, Oid relNode)
+{
+	FilterRelNode *cur = list;
+
+	for (; cur->dbNode; cur++)
+		if (cur->dbNode == dbNode && cur->relNode == relNode)
+			break;
+	if (!cur->dbNode)
+		return false;
+
+	for (; cur->dbNode; cur++)
+		*cur = *(cur + 1);
+	return true;
+}
+
+/*
+ * A relation file created in a database with relation rules may belong to a
+ * relation being rewritten, e.g. by VACUUM FULL. It is let through until the
+ * caller finds out which relation it belongs to. Files of transactions that
+ * were rolled back never show up, the oldest are forgotten when there are
+ * too many.
+ */
+static void
+FilterTrackRelation(FilterData *fl, RelFileNode *node)
+{
+	FilterRelNode *list = fl->pending_relations;
+	int n = 0;
+
+	if (!(fl->include_relation_databases &&
+				OidInZeroTermOidList(node->dbNode, fl->include_relation_databases)) &&
+			!(fl->exclude_relation_databases &&
+				OidInZeroTermOidList(node->dbNode, fl->exclude_relation_databases)))
+		return;
+
+	/* Created once for every fork */
+	for (; list && list[n].dbNode; n++)
+		if (list[n].dbNode == node->dbNode && list[n].relNode == node->relNode)
+			return;
+
+	if (n == FL_MAX_PENDING_RELATIONS)
+	{
+		memmove(list, list + 1, sizeof(FilterRelNode) * n);
+		n--;
+	}
+	else
+		list = rewballoc(list, sizeof(FilterRelNode) * (n + 2));
+
+	list[n].dbNode = node->dbNode;
+	list[n].relNode = node->relNode;
+	list[n + 1].dbNode = 0;
+	list[n + 1].relNode = 0;
+	fl->pending_relations = list;
+
+	log_debug1("Relation file %u created in database %u", node->relNode, node->dbNode);
+	WbFRulesChanged(fl);
+}
+
+/*
+ * Full page images of excluded forks can be left out, the replica can do
+ * without free space map or visibility map pages. Other records may change
+ * the main fork in later block references, e.g. setting a page all visible,
+ * so they are always kept.
+ */
+static bool
+FilterForkExcluded(FilterData *fl, XLogRecord *rec)
+{
+	uint8 info = rec->xl_info & 0xF0;
+
+	return (fl->exclude_forks & (1 << fl->blockFork)) &&
+			rec->xl_rmid == RM_XLOG_ID &&
+			(info == XLOG_FPI || info == XLOG_FPI_FOR_HINT);
+}
+
 static bool
 NeedToFilter(FilterData *fl, RelFileNode *node)
 {
+	FilterRules *rules = &(fl->rules);
+
     log_debug2("Checking relfilnode [relNode, dbNode, spcNode] = [%u, %u, %u]",
 			   node->relNode, node->dbNode, node->spcNode);
-	if (fl->include_tablespaces)
-		if (!OidInZeroTermOidList(node->spcNode, fl->include_tablespaces))
+
+	if (!rules->valid)
+		FilterCompileRules(fl);
+
+	/* Consecutive records mostly touch the same database */
+	if (!rules->lastValid || node->spcNode != rules->lastSpcNode ||
+			node->dbNode != rules->lastDbNode)
+	{
+		rules->lastDecision = FilterDecide(rules, node);
+		rules->lastSpcNode = node->spcNode;
+		rules->lastDbNode = node->dbNode;
+		rules->lastValid = true;
+	}
+
+	if (rules->lastDecision)
+		return true;
+	return FilterDecideRelation(rules, node);
+}
+
+static bool
+FilterDecideRelation(FilterRules *rules, RelFileNode *node)
+{
+	/* Shared catalogs */
+	if (node->dbNode == 0)
+		return false;
+
+	if (rules->includeRelationDatabases.slots &&
+			OidSetContains(&(rules->includeRelationDatabases), node->dbNode) &&
+			!(rules->includeRelations.slots &&
+			  RelSetContains(&(rules->includeRelations), node->dbNode, node->relNode)))
+	{
+		log_debug2("Relation %u in database %u is not included", node->relNode, node->dbNode);
+		return true;
+	}
+
+	if (rules->excludeRelationDatabases.slots &&
+			OidSetContains(&(rules->excludeRelationDatabases), node->dbNode) &&
+			rules->excludeRelations.slots &&
+			RelSetContains(&(rules->excludeRelations), node->dbNode, node->relNode))
+	{
+		log_debug2("Relation %u in database %u is excluded", node->relNode, node->dbNode);
+		return true;
+	}
+
+	return false;
+}
+
+static bool
+FilterDecide(FilterRules *rules, RelFileNode *node)
+{
+	if (rules->includeTablespaces.slots)
+		if (!OidSetContains(&(rules->includeTablespaces), node->spcNode))
 		{
 			log_debug2("Data in tablespace %d is not included", node->spcNode);
 			return true;
 		}
 
-	if (fl->exclude_tablespaces)
-		if (OidInZeroTermOidList(node->spcNode, fl->exclude_tablespaces))
+	if (rules->excludeTablespaces.slots)
+		if (OidSetContains(&(rules->excludeTablespaces), node->spcNode))
 		{
 			log_debug2("Data in tablespace %d is excluded", node->spcNode);
 			return true;
 		}
 
-	if (fl->include_databases)
+	if (rules->includeDatabases.slots)
 		if (node->dbNode != 0 &&
-			!OidInZeroTermOidList(node->dbNode, fl->include_databases))
+			!OidSetContains(&(rules->includeDatabases), node->dbNode))
 		{
 			log_debug2("Data in database %d is not included", node->dbNode);
 			return true;
 		}
 
-	if (fl->exclude_databases)
-		if (OidInZeroTermOidList(node->dbNode, fl->exclude_databases))
+	if (rules->excludeDatabases.slots)
+		if (OidSetContains(&(rules->excludeDatabases), node->dbNode))
 		{
 			log_debug2("Data in database %d is excluded", node->dbNode);
 			return true;
@@ -659,6 +1501,8 @@ FilterBufferRecordHeader(FilterData* fl, ReplMessage* msg)
 {
 	fl->state = FS_BUFFER_RECORD;
 	fl->recordStart = msg->dataPtr;
+	/* A page header may split the record header, so take the LSN now */
+	fl->recordPtr = msg->dataStart + msg->dataPtr;
 	fl->dataNeeded = REC_HEADER_LEN;
 	fl->headerPos = -1;
 	fl->headerLen = 0;
@@ -672,3 +1516,72 @@ InjectDummyDataHeaderLongAfterRecordHeader(XLogRecord* rec)
     *((uint8*)(buffer + REC_HEADER_LEN)) = (uint8)XLR_BLOCK_ID_DATA_LONG;
     *((uint32*)(buffer + REC_HEADER_LEN + 1)) = (uint32)(rec->xl_tot_len - REC_HEADER_LEN - SizeOfXLogRecordDataHeaderLong);
 }
+
+/*
+ * Begin checking the CRC of the record whose header was just buffered. The
+ * header is kept aside as filtering may rewrite the buffer.
+ */
+static void
+FilterStartCrc(FilterData *fl, XLogRecord *rec)
+{
+	Assert(offsetof(XLogRecord, xl_crc) == FL_CRC_HEADER_LEN);
+
+	fl->crcActive = true;
+	INIT_CRC32C(fl->recordCrc);
+	fl->expectedCrc = rec->xl_crc;
+	memcpy(fl->crcHeader, rec, FL_CRC_HEADER_LEN);
+}
+
+/*
+ * Called when all data of a record has been seen. Returns false if its CRC
+ * did not match. Nothing of the message is sent then, and retryPos is set so
+ * that the caller fetches both the record and whatever the client does not
+ * have yet again. Gives up if the same record keeps failing.
+ */
+static bool
+FilterRecordDone(FilterData *fl, ReplMessage *msg, XLogRecPtr *retryPos)
+{
+	XLogRecPtr unsentPtr;
+	pg_crc32c crc;
+
+	if (!fl->crcActive)
+		return true;
+	fl->crcActive = false;
+
+	crc = fl->recordCrc;
+	COMP_CRC32C(crc, fl->crcHeader, FL_CRC_HEADER_LEN);
+	FIN_CRC32C(crc);
+	if (EQ_CRC32C(crc, fl->expectedCrc))
+		return true;
+
+	if (fl->crcFailurePtr == fl->recordPtr)
+		fl->crcFailures++;
+	else
+	{
+		fl->crcFailurePtr = fl->recordPtr;
+		fl->crcFailures = 1;
+	}
+	if (fl->crcFailures >= FL_MAX_CRC_FAILURES)
+		error("WAL record at %X/%X failed CRC check %d times",
+				FormatRecPtr(fl->recordPtr), fl->crcFailures);
+
+	log_error("Incorrect CRC in WAL record at %X/%X: expected 0x%08X, calculated 0x%08X, fetching it again",
+			FormatRecPtr(fl->recordPtr), fl->expectedCrc, crc);
+
+	/* Output so far ends before the data held back from the previous message */
+	unsentPtr = msg->dataStart - fl->unsentBufferLen;
+	if (unsentPtr < fl->requestedStartPos)
+		unsentPtr = fl->requestedStartPos;
+
+	/*
+	 * Earlier records of the message were good but not sent either. Restart
+	 * at the record if the client has everything before it, otherwise at
+	 * the page, the filter finds the record boundary from there.
+	 */
+	if (fl->recordPtr <= unsentPtr)
+		*retryPos = fl->recordPtr;
+	else
+		*retryPos = unsentPtr - unsentPtr % XLOG_BLCKSZ;
+	WbFResetProcessingState(fl, unsentPtr);
+	return false;
+}
@@ -0,0 +1,1293 @@
+#include "wbhub.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "wbconfig.h"
+#include "wbfilter.h"
+#include "wbpgtypes.h"
+#include "wbspool.h"
+#include "wbutils.h"
+
+#define MAX_CONNINFO_LEN 4000
+#define HUB_READ_CHUNK (128*1024)
+#define HUB_POLL_TIMEOUT 1000
+#define HUB_STATUS_INTERVAL 10
+/* Amount of WAL filtered for one profile before looking at other work */
+#define HUB_FILTER_BATCH (1024*1024)
+/* Attempts at reading a slot that is being updated before using old values */
+#define HUB_STATUS_RETRIES 1000
+
+#define HUB_FILTER_LISTS 4
+#define HUB_PROFILE_MAX_OIDS 256
+
+#define HubLoad(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define HubStore(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define HubFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* Range of WAL available in a ring, written only by the hub process */
+typedef struct {
+	/* Incremented whenever the ring contents are discarded */
+	uint32 generation;
+	XLogRecPtr startPtr;
+	XLogRecPtr endPtr;
+} HubRing;
+
+/*
+ * Resolved filtering rules. Replicas with equal keys get identical filtered
+ * streams. OID lists are sorted and stored one after another, -1 count
+ * means that the list is not used.
+ */
+typedef struct {
+	int xlogPageMagic;
+	int numOids[HUB_FILTER_LISTS];
+	Oid oids[HUB_PROFILE_MAX_OIDS];
+} HubProfileKey;
+
+/*
+ * Filtered output shared by all replicas with the same filtering rules. The
+ * hub filters the raw ring once for each profile in use and keeps the
+ * result in a ring of its own.
+ */
+typedef struct {
+	/* Zero when the profile is free, protected by profileLock */
+	int refCount;
+	/* Changes every time the profile is taken into use */
+	uint32 id;
+	HubProfileKey key;
+	HubRing ring;
+
+	/*
+	 * Set by the hub when a database or tablespace was created in the WAL
+	 * the profile filtered up to here. The hub can't look up whether the
+	 * rules name it, so the profile is not used until the raw ring no longer
+	 * has that WAL. Protected by profileLock.
+	 */
+	XLogRecPtr retiredPtr;
+} HubProfile;
+
+typedef struct {
+	pid_t pid;
+	/* Profile used by the owner, -1 for raw WAL */
+	int profile;
+
+	/*
+	 * Latest status reported by the replica. Odd changeCount means that the
+	 * owner is in the middle of updating the values.
+	 */
+	uint32 changeCount;
+	bool hasReply;
+	bool hasFeedback;
+	StandbyReplyMessage reply;
+	HSFeedbackMessage feedback;
+} HubSlot;
+
+/* Consistent copy of the status in a slot */
+typedef struct {
+	uint32 changeCount;
+	bool hasReply;
+	bool hasFeedback;
+	StandbyReplyMessage reply;
+	HSFeedbackMessage feedback;
+} HubSlotStatus;
+
+typedef struct {
+	bool running;
+	TimeLineID tli;
+
+	/* WAL as received from the master */
+	HubRing raw;
+
+	XLogRecPtr walEnd;
+	TimestampTz sendTime;
+	uint32 keepaliveCount;
+
+	bool profileLock;
+	uint32 lastProfileId;
+
+	/* Set while prefilling, cleared once WAL has been received */
+	bool prefilling;
+	/* Master no longer had the WAL we wanted to prefill with */
+	bool prefillFailed;
+
+	uint64 size;
+	int numProfiles;
+	int numSlots;
+	HubSlot slots[1];
+} HubShmem;
+
+/* Filtering state of a profile, only used in the hub process */
+typedef struct {
+	uint32 id;
+	uint32 rawGeneration;
+	FilterData *fl;
+	XLogRecPtr filterPtr;
+} HubProfileState;
+
+struct WbHubSubscriber {
+	int slot;
+	/* Profile we read filtered WAL from, -1 for raw WAL */
+	int profile;
+	uint32 generation;
+	XLogRecPtr readPtr;
+	uint32 keepaliveCount;
+	char *buffer;
+};
+
+static HubShmem *hub = NULL;
+static HubProfile *hubProfiles = NULL;
+/* Raw ring followed by one ring per profile */
+static char *hubRings = NULL;
+static int *hubEventFds = NULL;
+/* Wakes up the hub when a profile is taken into use */
+static int hubWakeFd = -1;
+
+/* Only used in the hub process */
+static HubSlotStatus *seenStatus = NULL;
+static HubProfileState *profileStates = NULL;
+static char *filterBuffer = NULL;
+
+static MasterConn* HubOpenConnectionToMaster();
+static char* HubRingData(int profile);
+static HubRing* HubGetRing(int profile);
+static void HubResetRing(TimeLineID tli, XLogRecPtr pos);
+static void HubRingWrite(HubRing *ring, char *data, const char *buf, int len);
+static void HubWrite(XLogRecPtr dataStart, const char *data, int len);
+static void HubCopyOut(char *data, char *target, XLogRecPtr pos, int len);
+static int HubChunkLength(XLogRecPtr pos, XLogRecPtr endPtr);
+static void HubStartProfile(int i);
+static void HubProfileWrite(int i, FilterOutput *out);
+static bool HubFilterProfiles();
+static void HubLockProfiles();
+static void HubUnlockProfiles();
+static bool HubBuildProfileKey(FilterData *fl, int xlogPageMagic, HubProfileKey *key);
+static int HubAcquireProfile(FilterData *fl, int xlogPageMagic);
+static void HubReleaseProfile(int i);
+static bool HubProfileRetired(HubProfile *profile);
+static void HubRetireProfile(int i, XLogRecPtr endPtr);
+static void HubNotifySubscribers();
+static void HubDrainEvents(WbHubSubscriber *sub);
+static bool HubCollectStatus(StandbyReplyMessage *reply, HSFeedbackMessage *feedback, bool *haveFeedback);
+static void HubSendStatus(MasterConn *master, bool force, time_t *lastSent);
+static bool HubSubscriberLost(WbHubSubscriber *sub);
+
+void
+WbHubInit()
+{
+	size_t headerSize;
+	size_t profilesSize;
+	size_t ringSize;
+	int numProfiles = CurrentConfig->hub.max_filter_profiles;
+	char *shmem;
+	int i;
+
+	if (!CurrentConfig->hub.enabled)
+		return;
+
+	ringSize = (size_t) CurrentConfig->hub.buffer_size * 1024 * 1024;
+	headerSize = MAXALIGN(offsetof(HubShmem, slots) +
+			sizeof(HubSlot) * CurrentConfig->hub.max_replicas);
+	profilesSize = TYPEALIGN(XLOG_BLCKSZ, headerSize + sizeof(HubProfile) * numProfiles) - headerSize;
+
+	/*
+	 * Anonymous shared memory set up before forking is visible at the same
+	 * address in the hub and every bouncer process. Profile rings are only
+	 * backed by memory once they are used.
+	 */
+	shmem = mmap(NULL, headerSize + profilesSize + ringSize * (numProfiles + 1),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (shmem == MAP_FAILED)
+		error("Could not allocate %d MB of shared memory for the hub",
+				CurrentConfig->hub.buffer_size * (numProfiles + 1));
+
+	hub = (HubShmem*) shmem;
+	hubProfiles = (HubProfile*) (shmem + headerSize);
+	hubRings = shmem + headerSize + profilesSize;
+	hub->size = ringSize;
+	hub->numProfiles = numProfiles;
+	hub->numSlots = CurrentConfig->hub.max_replicas;
+
+	hubEventFds = wballoc(sizeof(int) * hub->numSlots);
+	for (i = 0; i < hub->numSlots; i++)
+	{
+		hub->slots[i].profile = -1;
+		hubEventFds[i] = eventfd(0, EFD_NONBLOCK);
+		if (hubEventFds[i] < 0)
+			error("Could not create hub wakeup handle");
+	}
+	hubWakeFd = eventfd(0, EFD_NONBLOCK);
+	if (hubWakeFd < 0)
+		error("Could not create hub wakeup handle");
+
+	log_info("Hub enabled with %d MB buffer for up to %d replicas and %d filter profiles",
+			CurrentConfig->hub.buffer_size, hub->numSlots, hub->numProfiles);
+}
+
+bool
+WbHubEnabled()
+{
+	return hub != NULL;
+}
+
+static MasterConn*
+HubOpenConnectionToMaster()
+{
+	char conninfo[MAX_CONNINFO_LEN+1];
+	char *buf = conninfo;
+	char *buf_end = &(conninfo[MAX_CONNINFO_LEN]);
+
+	memset(conninfo, 0, sizeof(conninfo));
+
+	if (CurrentConfig->master.host)
+		buf += snprintf(buf, buf_end - buf, "host=%s ", CurrentConfig->master.host);
+
+	if (CurrentConfig->master.port)
+		buf += snprintf(buf, buf_end - buf, "port=%d ", CurrentConfig->master.port);
+
+	if (CurrentConfig->master.user)
+		buf += snprintf(buf, buf_end - buf, "user=%s ", CurrentConfig->master.user);
+
+	buf += snprintf(buf, buf_end - buf, "dbname=replication replication=true application_name=walbouncer");
+
+	log_info("Hub connecting to %s", conninfo);
+	return WbMcOpenConnection(conninfo);
+}
+
+/*
+ * Main loop of the hub process. Receives WAL from the master and copies it
+ * into the ring. Exits when the master ends the timeline, the main process
+ * starts a new hub that follows the next timeline.
+ */
+void
+WbHubMain()
+{
+	MasterConn *master;
+	ReplMessage msg;
+	char *sysid;
+	char *tliStr;
+	char *xpos;
+	TimeLineID tli;
+	uint32 hi, lo;
+	XLogRecPtr startPos;
+	time_t lastStatus = 0;
+	bool filtering = false;
+
+	seenStatus = wballoc0(sizeof(HubSlotStatus) * hub->numSlots);
+	profileStates = wballoc0(sizeof(HubProfileState) * (hub->numProfiles + 1));
+	filterBuffer = wballoc(HUB_READ_CHUNK);
+
+	master = HubOpenConnectionToMaster();
+
+	{
+		char *segSize = WbMcShowVariable(master, "wal_segment_size");
+		char *blockSize = WbMcShowVariable(master, "wal_block_size");
+
+		WbMcSetWalGeometry(segSize, blockSize);
+		wbfree(segSize);
+		wbfree(blockSize);
+	}
+
+	WbMcIdentifySystem(master, &sysid, &tliStr, &xpos);
+	tli = ensure_atoi(tliStr);
+	if (sscanf(xpos, "%X/%X", &hi, &lo) != 2)
+		error("Invalid xlogpos %s received from master", xpos);
+	startPos = ((uint64) hi << 32) | lo;
+	wbfree(sysid);
+	wbfree(tliStr);
+	wbfree(xpos);
+
+	/*
+	 * Start at the beginning of the current segment so that replicas that
+	 * are only slightly behind can be served from the ring right away.
+	 */
+	startPos -= startPos % XLogSegSize;
+
+	/*
+	 * When prefilling, fill the ring with older WAL as well. Replicas that
+	 * reconnect after a restart are usually somewhat behind. If the master
+	 * has already removed that WAL we fail before receiving anything, don't
+	 * try again then.
+	 */
+	if (CurrentConfig->hub.prefill && !hub->prefillFailed)
+	{
+		/* Leave room for the current segment */
+		uint64 back = hub->size - hub->size % XLogSegSize - XLogSegSize;
+
+		if (hub->size >= 2 * (uint64) XLogSegSize && startPos > back)
+		{
+			startPos -= back;
+			HubStore(hub->prefilling, true);
+			log_info("Hub prefilling buffer from %X/%X", FormatRecPtr(startPos));
+		}
+	}
+
+	HubResetRing(tli, startPos);
+	if (!WbMcStartStreaming(master, startPos, tli))
+		error("Master refused to stream timeline %u", tli);
+	HubStore(hub->running, true);
+
+	log_info("Hub streaming timeline %u from %X/%X", tli, FormatRecPtr(startPos));
+
+	for (;;)
+	{
+		struct pollfd fds[2];
+		bool received = false;
+		bool replyRequested = false;
+		uint64 count;
+
+		if (!DaemonIsAlive())
+			error("Main process died, hub exiting!");
+
+		fds[0].fd = WbMcGetSocket(master);
+		if (fds[0].fd == -1)
+			error("Master socket has been closed");
+		fds[0].events = POLLIN | POLLERR;
+		fds[0].revents = 0;
+		fds[1].fd = hubWakeFd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		/* Don't wait while profiles are still catching up */
+		if (poll(fds, 2, filtering ? 0 : HUB_POLL_TIMEOUT) < 0 && errno != EINTR)
+			error("poll on master connection failed");
+
+		if (read(hubWakeFd, &count, sizeof(count)) < 0 &&
+				errno != EAGAIN && errno != EWOULDBLOCK)
+			error("Could not read hub wakeup handle");
+
+		while (WbMcReceiveWalMessage(master, &msg))
+		{
+			switch (msg.type)
+			{
+				case MSG_WAL_DATA:
+					HubStore(hub->prefilling, false);
+					HubWrite(msg.dataStart, msg.data, msg.dataLen);
+					HubStore(hub->walEnd, msg.walEnd);
+					HubStore(hub->sendTime, msg.sendTime);
+					received = true;
+					break;
+				case MSG_KEEPALIVE:
+					HubStore(hub->walEnd, msg.walEnd);
+					HubStore(hub->sendTime, msg.sendTime);
+					__atomic_add_fetch(&hub->keepaliveCount, 1, __ATOMIC_SEQ_CST);
+					replyRequested |= msg.replyRequested;
+					received = true;
+					break;
+				case MSG_END_OF_WAL:
+					log_info("Master ended streaming of timeline %u, hub exiting", tli);
+					HubStore(hub->running, false);
+					HubNotifySubscribers();
+					WbMcEndStreaming(master, NULL, NULL);
+					WbMcCloseConnection(master);
+					exit(0);
+				case MSG_NOTHING:
+					break;
+			}
+		}
+
+		filtering = HubFilterProfiles();
+
+		if (received || filtering)
+			HubNotifySubscribers();
+
+		HubSendStatus(master, replyRequested, &lastStatus);
+	}
+}
+
+/*
+ * Called in the main process after the hub process has exited. Subscribers
+ * will notice the generation change and continue from the master.
+ */
+void
+WbHubStopped()
+{
+	if (!hub)
+		return;
+
+	HubStore(hub->running, false);
+	__atomic_add_fetch(&hub->raw.generation, 1, __ATOMIC_SEQ_CST);
+	HubNotifySubscribers();
+
+	if (HubLoad(hub->prefilling))
+	{
+		log_warning("Hub could not prefill its buffer, starting at current segment from now on");
+		hub->prefilling = false;
+		hub->prefillFailed = true;
+	}
+}
+
+/*
+ * Called in the main process for bouncer processes that exited without
+ * unsubscribing.
+ */
+void
+WbHubReleaseSlots(pid_t pid)
+{
+	int i;
+
+	if (!hub)
+		return;
+
+	for (i = 0; i < hub->numSlots; i++)
+	{
+		HubSlot *slot = &(hub->slots[i]);
+		uint32 count;
+
+		if (HubLoad(slot->pid) != pid)
+			continue;
+
+		/* The owner may have died in the middle of an update */
+		count = (HubLoad(slot->changeCount) | 1) + 1;
+		__atomic_store_n(&slot->changeCount, count - 1, __ATOMIC_SEQ_CST);
+		slot->hasReply = false;
+		slot->hasFeedback = false;
+		__atomic_store_n(&slot->changeCount, count, __ATOMIC_SEQ_CST);
+		if (slot->profile >= 0)
+			HubReleaseProfile(slot->profile);
+		HubStore(slot->pid, 0);
+	}
+}
+
+static char*
+HubRingData(int profile)
+{
+	return hubRings + hub->size * (profile + 1);
+}
+
+static HubRing*
+HubGetRing(int profile)
+{
+	return profile < 0 ? &(hub->raw) : &(hubProfiles[profile].ring);
+}
+
+static void
+HubResetRing(TimeLineID tli, XLogRecPtr pos)
+{
+	__atomic_add_fetch(&hub->raw.generation, 1, __ATOMIC_SEQ_CST);
+	hub->tli = tli;
+	HubStore(hub->raw.startPtr, pos);
+	HubStore(hub->raw.endPtr, pos);
+	HubStore(hub->walEnd, pos);
+	HubFence();
+}
+
+/*
+ * Append len bytes to the end of ring.
+ */
+static void
+HubRingWrite(HubRing *ring, char *data, const char *buf, int len)
+{
+	XLogRecPtr endPtr = ring->endPtr;
+	XLogRecPtr newEnd = endPtr + len;
+	uint64 offset;
+	int first;
+
+	/*
+	 * Readers check startPtr after copying data out, so it has to move
+	 * forward before we overwrite the oldest data.
+	 */
+	if (newEnd - ring->startPtr > hub->size)
+		HubStore(ring->startPtr, newEnd - hub->size);
+	HubFence();
+
+	offset = endPtr % hub->size;
+	first = (hub->size - offset) < len ? (hub->size - offset) : len;
+	memcpy(data + offset, buf, first);
+	if (first < len)
+		memcpy(data, buf + first, len - first);
+
+	HubFence();
+	HubStore(ring->endPtr, newEnd);
+}
+
+static void
+HubWrite(XLogRecPtr dataStart, const char *data, int len)
+{
+	if (len > hub->size)
+		error("WAL message of %d bytes does not fit into hub buffer", len);
+
+	if (dataStart != hub->raw.endPtr)
+	{
+		log_warning("Hub received WAL at %X/%X, expected %X/%X. Discarding buffer.",
+				FormatRecPtr(dataStart), FormatRecPtr(hub->raw.endPtr));
+		HubResetRing(hub->tli, dataStart);
+	}
+
+	HubRingWrite(&(hub->raw), HubRingData(-1), data, len);
+	WbSpoolWrite(hub->tli, dataStart, data, len);
+}
+
+static void
+HubCopyOut(char *data, char *target, XLogRecPtr pos, int len)
+{
+	uint64 offset = pos % hub->size;
+	int first = (hub->size - offset) < len ? (hub->size - offset) : len;
+
+	memcpy(target, data + offset, first);
+	if (first < len)
+		memcpy(target + first, data, len - first);
+}
+
+/*
+ * Length of the next chunk to read from a ring. Large chunks are cut at a
+ * page boundary so that page headers are not split.
+ */
+static int
+HubChunkLength(XLogRecPtr pos, XLogRecPtr endPtr)
+{
+	XLogRecPtr chunkEnd;
+
+	if (endPtr - pos <= HUB_READ_CHUNK)
+		return endPtr - pos;
+
+	chunkEnd = pos + HUB_READ_CHUNK;
+	chunkEnd -= chunkEnd % XLOG_BLCKSZ;
+	return chunkEnd - pos;
+}
+
+/*
+ * (Re)start filtering for profile i from the oldest WAL in the raw ring.
+ * Subscribers of the profile that already read from its ring have to
+ * continue on their own.
+ */
+static void
+HubStartProfile(int i)
+{
+	HubProfile *profile = &(hubProfiles[i]);
+	HubProfileState *ps = &(profileStates[i]);
+	HubProfileKey *key = &(profile->key);
+	Oid **lists[HUB_FILTER_LISTS];
+	Oid *oids = key->oids;
+	int list;
+
+	if (ps->fl)
+		WbFFreeProcessingState(ps->fl);
+
+	ps->id = HubLoad(profile->id);
+	ps->rawGeneration = HubLoad(hub->raw.generation);
+	ps->filterPtr = HubLoad(hub->raw.startPtr);
+	ps->fl = WbFCreateProcessingState(ps->filterPtr);
+	/* We can't go back in the stream, start output at the first full record */
+	ps->fl->syncForward = true;
+
+	lists[0] = &(ps->fl->include_tablespaces);
+	lists[1] = &(ps->fl->include_databases);
+	lists[2] = &(ps->fl->exclude_tablespaces);
+	lists[3] = &(ps->fl->exclude_databases);
+	for (list = 0; list < HUB_FILTER_LISTS; list++)
+	{
+		if (key->numOids[list] < 0)
+			continue;
+		*lists[list] = wballoc0(sizeof(Oid) * (key->numOids[list] + 1));
+		memcpy(*lists[list], oids, sizeof(Oid) * key->numOids[list]);
+		oids += key->numOids[list];
+	}
+
+	/* An empty ring can be reused without disturbing anybody */
+	if (HubLoad(profile->ring.endPtr))
+	{
+		__atomic_add_fetch(&profile->ring.generation, 1, __ATOMIC_SEQ_CST);
+		HubStore(profile->ring.startPtr, 0);
+		HubStore(profile->ring.endPtr, 0);
+		HubFence();
+	}
+
+	log_info("Hub filtering profile %d from %X/%X", i, FormatRecPtr(ps->filterPtr));
+}
+
+static void
+HubProfileWrite(int i, FilterOutput *out)
+{
+	HubRing *ring = &(hubProfiles[i].ring);
+	char *data = HubRingData(i);
+
+	/* The first output of the profile defines where the ring starts */
+	if (!ring->endPtr)
+	{
+		HubStore(ring->startPtr, out->dataStart);
+		HubStore(ring->endPtr, out->dataStart);
+	}
+	else if (ring->endPtr != out->dataStart)
+		error("Filtered WAL for profile %d at %X/%X, expected %X/%X", i,
+				FormatRecPtr(out->dataStart), FormatRecPtr(ring->endPtr));
+
+	if (out->prefixLen)
+		HubRingWrite(ring, data, out->prefix, out->prefixLen);
+	HubRingWrite(ring, data, out->data, out->dataLen);
+}
+
+/*
+ * Run new WAL in the raw ring through the filter of every profile in use.
+ * Work is done in batches so that receiving from the master is not held up
+ * by a profile catching up. Returns true if there is more work to do.
+ */
+static bool
+HubFilterProfiles()
+{
+	XLogRecPtr rawEnd = HubLoad(hub->raw.endPtr);
+	bool behind = false;
+	int i;
+
+	for (i = 0; i < hub->numProfiles; i++)
+	{
+		HubProfile *profile = &(hubProfiles[i]);
+		HubProfileState *ps = &(profileStates[i]);
+		int processed = 0;
+
+		if (!HubLoad(profile->refCount) || HubProfileRetired(profile))
+		{
+			if (ps->fl)
+			{
+				log_info("Hub stopped filtering profile %d", i);
+				WbFFreeProcessingState(ps->fl);
+				ps->fl = NULL;
+			}
+			continue;
+		}
+
+		if (!ps->fl || ps->id != HubLoad(profile->id) ||
+				ps->rawGeneration != HubLoad(hub->raw.generation))
+			HubStartProfile(i);
+		else if (ps->filterPtr < HubLoad(hub->raw.startPtr))
+		{
+			log_warning("Hub filtering of profile %d fell behind WAL buffer, restarting", i);
+			HubStartProfile(i);
+		}
+
+		while (ps->filterPtr < rawEnd && processed < HUB_FILTER_BATCH)
+		{
+			ReplMessage msg;
+			FilterOutput out;
+			XLogRecPtr retryPos;
+			int len = HubChunkLength(ps->filterPtr, rawEnd);
+
+			/* We are the only writer of the raw ring, no need to recheck */
+			HubCopyOut(HubRingData(-1), filterBuffer, ps->filterPtr, len);
+
+			msg.type = MSG_WAL_DATA;
+			msg.dataStart = ps->filterPtr;
+			msg.walEnd = HubLoad(hub->walEnd);
+			msg.sendTime = HubLoad(hub->sendTime);
+			msg.replyRequested = false;
+			msg.dataPtr = 0;
+			msg.dataLen = len;
+			msg.data = filterBuffer;
+			msg.nextPageBoundary = (XLOG_BLCKSZ - msg.dataStart) & (XLOG_BLCKSZ-1);
+
+			if (!WbFProcessWalDataBlock(&msg, ps->fl, &retryPos, profile->key.xlogPageMagic))
+			{
+				log_warning("Hub filter for profile %d lost synchronization at %X/%X, restarting",
+						i, FormatRecPtr(ps->filterPtr));
+				HubStartProfile(i);
+				break;
+			}
+
+			if (WbFHasPendingOids(ps->fl))
+			{
+				HubRetireProfile(i, ps->filterPtr + len);
+				break;
+			}
+
+			if (WbFGetOutput(ps->fl, &msg, &out))
+				HubProfileWrite(i, &out);
+
+			ps->filterPtr += len;
+			processed += len;
+		}
+
+		if (ps->filterPtr < rawEnd)
+			behind = true;
+	}
+
+	return behind;
+}
+
+/*
+ * Stop using profile i, objects were created in the WAL up to endPtr. Its
+ * subscribers lose the filtered stream and continue with filters of their
+ * own, which look up the new objects.
+ */
+static void
+HubRetireProfile(int i, XLogRecPtr endPtr)
+{
+	HubProfile *profile = &(hubProfiles[i]);
+
+	log_info("Objects were created in the WAL filtered by hub profile %d, replicas using it filter on their own",
+			i);
+
+	HubLockProfiles();
+	profile->retiredPtr = endPtr;
+	HubUnlockProfiles();
+	__atomic_add_fetch(&profile->ring.generation, 1, __ATOMIC_SEQ_CST);
+	HubNotifySubscribers();
+}
+
+/*
+ * True while the WAL that retired the profile is in the raw ring, a profile
+ * started now would run into it again.
+ */
+static bool
+HubProfileRetired(HubProfile *profile)
+{
+	XLogRecPtr retiredPtr = HubLoad(profile->retiredPtr);
+
+	return retiredPtr && HubLoad(hub->raw.startPtr) < retiredPtr;
+}
+
+/*
+ * Profile lock protects taking profiles into use and releasing them. Held
+ * only for a short time, so we just spin.
+ */
+static void
+HubLockProfiles()
+{
+	while (__atomic_test_and_set(&hub->profileLock, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void
+HubUnlockProfiles()
+{
+	__atomic_clear(&hub->profileLock, __ATOMIC_RELEASE);
+}
+
+static int
+HubCompareOids(const void *a, const void *b)
+{
+	Oid oa = *(const Oid*) a;
+	Oid ob = *(const Oid*) b;
+
+	return oa < ob ? -1 : (oa > ob ? 1 : 0);
+}
+
+/*
+ * Build the profile key of the resolved filtering rules in fl. Returns false
+ * if the rules are too large to be shared, filter by relation or fork, have
+ * objects pending, or the replica checks CRCs.
+ */
+static bool
+HubBuildProfileKey(FilterData *fl, int xlogPageMagic, HubProfileKey *key)
+{
+	Oid *lists[HUB_FILTER_LISTS] = {
+		fl->include_tablespaces,
+		fl->include_databases,
+		fl->exclude_tablespaces,
+		fl->exclude_databases
+	};
+	int total = 0;
+	int list;
+
+	/*
+	 * Profiles only filter by tablespace and database, and can't look up
+	 * objects created in the stream. Replicas that check CRCs need to see
+	 * the unfiltered WAL themselves.
+	 */
+	if (fl->include_relation_databases || fl->exclude_relation_databases ||
+			fl->exclude_forks || fl->verifyCrc || WbFHasPendingOids(fl))
+		return false;
+
+	memset(key, 0, sizeof(HubProfileKey));
+	key->xlogPageMagic = xlogPageMagic;
+
+	for (list = 0; list < HUB_FILTER_LISTS; list++)
+	{
+		Oid *oid;
+		int n = 0;
+
+		if (!lists[list])
+		{
+			key->numOids[list] = -1;
+			continue;
+		}
+
+		for (oid = lists[list]; *oid; oid++)
+		{
+			if (total + n >= HUB_PROFILE_MAX_OIDS)
+				return false;
+			key->oids[total + n++] = *oid;
+		}
+
+		qsort(key->oids + total, n, sizeof(Oid), HubCompareOids);
+		key->numOids[list] = n;
+		total += n;
+	}
+
+	return true;
+}
+
+/*
+ * Find the profile matching the filtering rules of fl, taking a free one
+ * into use if needed. Returns -1 if no profile can be used.
+ */
+static int
+HubAcquireProfile(FilterData *fl, int xlogPageMagic)
+{
+	HubProfileKey key;
+	uint64 one = 1;
+	int found = -1;
+	int unused = -1;
+	bool retired = false;
+	int i;
+
+	if (!HubBuildProfileKey(fl, xlogPageMagic, &key))
+	{
+		log_info("Filtering rules can't be shared");
+		return -1;
+	}
+
+	HubLockProfiles();
+	for (i = 0; i < hub->numProfiles; i++)
+	{
+		HubProfile *profile = &(hubProfiles[i]);
+
+		retired = HubProfileRetired(profile);
+		if ((profile->refCount || retired) &&
+				memcmp(&(profile->key), &key, sizeof(HubProfileKey)) == 0)
+		{
+			found = i;
+			break;
+		}
+		if (!profile->refCount && unused < 0)
+			unused = i;
+	}
+
+	if (found >= 0 && retired)
+	{
+		HubUnlockProfiles();
+		log_info("Hub profile %d has objects created in the WAL stream, filtering on our own",
+				found);
+		return -1;
+	}
+
+	if (found >= 0)
+		hubProfiles[found].refCount++;
+	else if (unused >= 0)
+	{
+		HubProfile *profile = &(hubProfiles[unused]);
+
+		profile->key = key;
+		profile->refCount = 1;
+		profile->retiredPtr = 0;
+		HubStore(profile->id, ++hub->lastProfileId);
+		found = unused;
+	}
+	HubUnlockProfiles();
+
+	if (found < 0)
+	{
+		log_info("All %d hub filter profiles are in use", hub->numProfiles);
+	}
+	else if (write(hubWakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		log_warning("Could not wake up hub");
+
+	return found;
+}
+
+static void
+HubReleaseProfile(int i)
+{
+	HubLockProfiles();
+	hubProfiles[i].refCount--;
+	HubUnlockProfiles();
+}
+
+static void
+HubNotifySubscribers()
+{
+	uint64 one = 1;
+	int i;
+
+	for (i = 0; i < hub->numSlots; i++)
+	{
+		if (!HubLoad(hub->slots[i].pid))
+			continue;
+		if (write(hubEventFds[i], &one, sizeof(one)) < 0 && errno != EAGAIN)
+			log_warning("Could not wake up hub subscriber %d", i);
+	}
+}
+
+static void
+HubDrainEvents(WbHubSubscriber *sub)
+{
+	uint64 count;
+
+	if (read(hubEventFds[sub->slot], &count, sizeof(count)) < 0 &&
+			errno != EAGAIN && errno != EWOULDBLOCK)
+		error("Could not read hub wakeup handle");
+}
+
+/*
+ * Combine the status of all subscribed replicas into what we report to the
+ * master. Replies report the least advanced replica, feedback the oldest
+ * xmin. Returns true if any replica reported something new.
+ */
+static bool
+HubCollectStatus(StandbyReplyMessage *reply, HSFeedbackMessage *feedback, bool *haveFeedback)
+{
+	bool changed = false;
+	bool haveReply = false;
+	uint64 xmin = 0;
+	uint64 catalogXmin = 0;
+	int i;
+
+	memset(reply, 0, sizeof(StandbyReplyMessage));
+	memset(feedback, 0, sizeof(HSFeedbackMessage));
+	*haveFeedback = false;
+
+	for (i = 0; i < hub->numSlots; i++)
+	{
+		HubSlot *slot = &(hub->slots[i]);
+		HubSlotStatus *status = &(seenStatus[i]);
+		HubSlotStatus current;
+		int tries;
+
+		for (tries = 0; tries < HUB_STATUS_RETRIES; tries++)
+		{
+			current.changeCount = HubLoad(slot->changeCount);
+			if (current.changeCount & 1)
+				continue;
+			current.hasReply = slot->hasReply;
+			current.hasFeedback = slot->hasFeedback;
+			current.reply = slot->reply;
+			current.feedback = slot->feedback;
+			HubFence();
+			if (current.changeCount == HubLoad(slot->changeCount))
+				break;
+		}
+
+		/* The owner may have died in the middle of an update, keep the old values */
+		if (tries < HUB_STATUS_RETRIES && current.changeCount != status->changeCount)
+		{
+			*status = current;
+			changed = true;
+		}
+
+		if (!HubLoad(slot->pid))
+			continue;
+
+		if (status->hasReply)
+		{
+			StandbyReplyMessage *slotReply = &(status->reply);
+
+			if (!haveReply || slotReply->writePtr < reply->writePtr)
+				reply->writePtr = slotReply->writePtr;
+			if (!haveReply || slotReply->flushPtr < reply->flushPtr)
+				reply->flushPtr = slotReply->flushPtr;
+			if (!haveReply || slotReply->applyPtr < reply->applyPtr)
+				reply->applyPtr = slotReply->applyPtr;
+			haveReply = true;
+		}
+
+		if (status->hasFeedback)
+		{
+			HSFeedbackMessage *slotFeedback = &(status->feedback);
+			uint64 slotXmin = ((uint64) slotFeedback->xmin_epoch << 32) | slotFeedback->xmin;
+			uint64 slotCatalogXmin = ((uint64) slotFeedback->catalog_xmin_epoch << 32) | slotFeedback->catalog_xmin;
+
+			if (slotFeedback->xmin && (!xmin || slotXmin < xmin))
+				xmin = slotXmin;
+			if (slotFeedback->catalog_xmin && (!catalogXmin || slotCatalogXmin < catalogXmin))
+				catalogXmin = slotCatalogXmin;
+			*haveFeedback = true;
+		}
+	}
+
+	/* Without any replicas we only acknowledge receiving the data */
+	if (!haveReply)
+		reply->writePtr = HubLoad(hub->raw.endPtr);
+
+	reply->sendTime = GetCurrentTimestamp();
+	feedback->sendTime = reply->sendTime;
+	feedback->xmin = (uint32) xmin;
+	feedback->xmin_epoch = (uint32) (xmin >> 32);
+	feedback->catalog_xmin = (uint32) catalogXmin;
+	feedback->catalog_xmin_epoch = (uint32) (catalogXmin >> 32);
+
+	return changed;
+}
+
+static void
+HubSendStatus(MasterConn *master, bool force, time_t *lastSent)
+{
+	static bool feedbackSent = false;
+	StandbyReplyMessage reply;
+	HSFeedbackMessage feedback;
+	bool haveFeedback;
+	time_t now = time(NULL);
+
+	if (!HubCollectStatus(&reply, &feedback, &haveFeedback) && !force &&
+			now - *lastSent < HUB_STATUS_INTERVAL)
+		return;
+
+	WbMcSendReply(master, &reply, false, false);
+
+	/* Also clears a previously reported xmin after the last replica left */
+	if (haveFeedback || feedbackSent)
+		WbMcSendFeedback(master, &feedback);
+	feedbackSent = haveFeedback;
+
+	*lastSent = now;
+}
+
+/*
+ * Subscribe to WAL starting at startPos. If fl is given and has filtering
+ * rules, filtered WAL is shared with other replicas using the same rules
+ * when possible, see WbHubIsFiltered(). Returns NULL if the position can't
+ * be served from the hub.
+ */
+WbHubSubscriber*
+WbHubSubscribe(TimeLineID tli, XLogRecPtr startPos, FilterData *fl, int xlogPageMagic)
+{
+	WbHubSubscriber *sub;
+	HubRing *ring;
+	uint32 generation;
+	XLogRecPtr startPtr;
+	XLogRecPtr walEnd;
+	int profile = -1;
+	int i;
+
+	if (!hub)
+		return NULL;
+
+	if (!HubLoad(hub->running))
+	{
+		log_info("Hub is not running, streaming directly from master");
+		return NULL;
+	}
+	if (hub->tli != tli)
+	{
+		log_info("Hub is streaming timeline %u, streaming timeline %u directly from master",
+				hub->tli, tli);
+		return NULL;
+	}
+
+	startPtr = HubLoad(hub->raw.startPtr);
+	walEnd = HubLoad(hub->walEnd);
+	if (walEnd < HubLoad(hub->raw.endPtr))
+		walEnd = HubLoad(hub->raw.endPtr);
+	if (startPos < startPtr || startPos > walEnd)
+	{
+		log_info("Requested position %X/%X is outside of hub buffer %X/%X - %X/%X, streaming directly from master",
+				FormatRecPtr(startPos), FormatRecPtr(startPtr), FormatRecPtr(walEnd));
+		return NULL;
+	}
+
+	if (fl && WbFHasFilter(fl) && hub->numProfiles)
+		profile = HubAcquireProfile(fl, xlogPageMagic);
+
+	ring = HubGetRing(profile);
+	generation = HubLoad(ring->generation);
+
+	/* A profile that has output so far is only useful if it covers startPos */
+	if (profile >= 0 && HubLoad(ring->endPtr) && startPos < HubLoad(ring->startPtr))
+	{
+		log_info("Requested position %X/%X is not in filtered WAL of profile %d",
+				FormatRecPtr(startPos), profile);
+		HubReleaseProfile(profile);
+		profile = -1;
+		ring = HubGetRing(profile);
+		generation = HubLoad(ring->generation);
+	}
+
+	for (i = 0; i < hub->numSlots; i++)
+	{
+		pid_t expected = 0;
+		if (__atomic_compare_exchange_n(&(hub->slots[i].pid), &expected, getpid(),
+				false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			break;
+	}
+	if (i == hub->numSlots)
+	{
+		log_warning("All %d hub slots are in use, streaming directly from master",
+				hub->numSlots);
+		if (profile >= 0)
+			HubReleaseProfile(profile);
+		return NULL;
+	}
+	hub->slots[i].profile = profile;
+
+	sub = wballoc0(sizeof(WbHubSubscriber));
+	sub->slot = i;
+	sub->profile = profile;
+	sub->generation = generation;
+	sub->readPtr = startPos;
+	sub->keepaliveCount = HubLoad(hub->keepaliveCount);
+	sub->buffer = wballoc(HUB_READ_CHUNK);
+
+	/* Clear out wakeups meant for the previous owner of the slot */
+	HubDrainEvents(sub);
+
+	if (profile >= 0)
+	{
+		log_info("Subscribed to filtered WAL of hub profile %d at %X/%X",
+				profile, FormatRecPtr(startPos));
+	}
+	else
+		log_info("Subscribed to hub at %X/%X", FormatRecPtr(startPos));
+	return sub;
+}
+
+void
+WbHubUnsubscribe(WbHubSubscriber *sub)
+{
+	HubSlot *slot = &(hub->slots[sub->slot]);
+
+	__atomic_add_fetch(&slot->changeCount, 1, __ATOMIC_SEQ_CST);
+	slot->hasReply = false;
+	slot->hasFeedback = false;
+	__atomic_add_fetch(&slot->changeCount, 1, __ATOMIC_SEQ_CST);
+	if (sub->profile >= 0)
+		HubReleaseProfile(sub->profile);
+	slot->profile = -1;
+	HubStore(slot->pid, 0);
+
+	wbfree(sub->buffer);
+	wbfree(sub);
+}
+
+/*
+ * True if the subscriber receives WAL that is already filtered.
+ */
+bool
+WbHubIsFiltered(WbHubSubscriber *sub)
+{
+	return sub->profile >= 0;
+}
+
+int
+WbHubGetSocket(WbHubSubscriber *sub)
+{
+	return hubEventFds[sub->slot];
+}
+
+static bool
+HubSubscriberLost(WbHubSubscriber *sub)
+{
+	HubRing *ring = HubGetRing(sub->profile);
+
+	return !HubLoad(hub->running) ||
+			HubLoad(ring->generation) != sub->generation ||
+			HubLoad(ring->startPtr) > sub->readPtr;
+}
+
+bool
+WbHubHasData(WbHubSubscriber *sub)
+{
+	return HubLoad(HubGetRing(sub->profile)->endPtr) > sub->readPtr ||
+			HubSubscriberLost(sub);
+}
+
+/*
+ * Fill msg with the next chunk of WAL from the ring. Reports MSG_END_OF_WAL
+ * when the subscriber fell behind the ring or the hub went away, the caller
+ * should continue from WbHubGetReadPtr() on its own master connection.
+ */
+bool
+WbHubReceiveWalMessage(WbHubSubscriber *sub, ReplMessage *msg)
+{
+	HubRing *ring = HubGetRing(sub->profile);
+	XLogRecPtr endPtr;
+	XLogRecPtr walEnd;
+	int len;
+
+	HubDrainEvents(sub);
+
+	if (HubSubscriberLost(sub))
+	{
+		msg->type = MSG_END_OF_WAL;
+		return true;
+	}
+
+	endPtr = HubLoad(ring->endPtr);
+	if (endPtr <= sub->readPtr)
+	{
+		uint32 keepaliveCount = HubLoad(hub->keepaliveCount);
+		if (keepaliveCount != sub->keepaliveCount)
+		{
+			sub->keepaliveCount = keepaliveCount;
+			msg->type = MSG_KEEPALIVE;
+			msg->walEnd = HubLoad(hub->walEnd);
+			msg->sendTime = HubLoad(hub->sendTime);
+			msg->replyRequested = false;
+			return true;
+		}
+		msg->type = MSG_NOTHING;
+		return false;
+	}
+
+	len = HubChunkLength(sub->readPtr, endPtr);
+	HubCopyOut(HubRingData(sub->profile), sub->buffer, sub->readPtr, len);
+	HubFence();
+
+	/* The writer may have lapped us while copying */
+	if (HubSubscriberLost(sub))
+	{
+		msg->type = MSG_END_OF_WAL;
+		return true;
+	}
+
+	/* Filtered WAL only reaches as far as the profile ring does */
+	walEnd = sub->profile >= 0 ? endPtr : HubLoad(hub->walEnd);
+
+	msg->type = MSG_WAL_DATA;
+	msg->dataStart = sub->readPtr;
+	msg->walEnd = walEnd > endPtr ? walEnd : endPtr;
+	msg->sendTime = HubLoad(hub->sendTime);
+	msg->replyRequested = false;
+	msg->dataPtr = 0;
+	msg->dataLen = len;
+	msg->data = sub->buffer;
+	msg->nextPageBoundary = (XLOG_BLCKSZ - msg->dataStart) & (XLOG_BLCKSZ-1);
+
+	log_debug1("Received %d byte WAL block from hub. dataStart: %X/%X walEnd: %X/%X",
+			len, FormatRecPtr(msg->dataStart), FormatRecPtr(msg->walEnd));
+
+	sub->readPtr += len;
+	return true;
+}
+
+/*
+ * Move the read position, returns false if the position is no longer
+ * available in the ring.
+ */
+bool
+WbHubSeek(WbHubSubscriber *sub, XLogRecPtr pos)
+{
+	sub->readPtr = pos;
+	return !HubSubscriberLost(sub);
+}
+
+XLogRecPtr
+WbHubGetReadPtr(WbHubSubscriber *sub)
+{
+	return sub->readPtr;
+}
+
+void
+WbHubSendReply(WbHubSubscriber *sub, StandbyReplyMessage *reply)
+{
+	HubSlot *slot = &(hub->slots[sub->slot]);
+
+	__atomic_add_fetch(&slot->changeCount, 1, __ATOMIC_SEQ_CST);
+	slot->reply = *reply;
+	slot->hasReply = true;
+	__atomic_add_fetch(&slot->changeCount, 1, __ATOMIC_SEQ_CST);
+}
+
+void
+WbHubSendFeedback(WbHubSubscriber *sub, HSFeedbackMessage *feedback)
+{
+	HubSlot *slot = &(hub->slots[sub->slot]);
+
+	__atomic_add_fetch(&slot->changeCount, 1, __ATOMIC_SEQ_CST);
+	slot->feedback = *feedback;
+	slot->hasFeedback = true;
+	__atomic_add_fetch(&slot->changeCount, 1, __ATOMIC_SEQ_CST);
+}
@@ -4,8 +4,11 @@
 
 #include<errno.h>
 #include<poll.h>
+#include<pthread.h>
 #include<string.h>
+#include<sys/socket.h>
 
+#include "wbconfig.h"
 #include "wbutils.h"
 #include "wb_pg_config.h"
 
@@ -14,12 +17,38 @@
 static void WbMcProcessWalsenderMessage(MasterConn *master, ReplMessage *msg);
 static void WbMcSend(MasterConn *master, const char *buffer, int nbytes);
 static int WbMcReceiveWal(MasterConn *master, char **buffer);
+static bool WbMcTakeOverStream(MasterConn *master);
+static void WbMcRecvExact(int sock, char *buffer, size_t len);
+static int WbMcReceiveWalNative(MasterConn *master, char **buffer);
+static void WbMcSendNative(MasterConn *master, char type, const char *buffer, int nbytes);
+static void WbMcWaitSocket(int sock, short events);
+static void WbMcDrainResults(PGconn *mc);
+
+/* Initial size of the receive buffer of natively read streams */
+#define MC_STREAM_BUFFER_SIZE (1024*1024)
+/* Largest message we send to the master while streaming */
+#define MC_MAX_SEND_LEN 64
 
 struct MasterConn {
+	/* NULL while disconnected, see WbMcDisconnect() */
 	PGconn* conn;
+	char *conninfo;
 	char* recvBuf;
 	XLogRecPtr latestWalEnd;
 	TimestampTz latestSendTime;
+
+	/*
+	 * While streaming over a plain socket the protocol is read directly
+	 * from the socket. Messages are parsed in place from streamBuf and stay
+	 * valid until the next receive.
+	 */
+	bool native;
+	bool nativeDone;
+	bool nativeEnding;
+	char *streamBuf;
+	size_t streamBufSize;
+	size_t streamStart;
+	size_t streamEnd;
 };
 
 MasterConn*
@@ -29,16 +58,89 @@ WbMcOpenConnection(const char *conninfo)
 	master->conn = PQconnectdb(conninfo);
 	if (PQstatus(master->conn) != CONNECTION_OK)
 		error(PQerrorMessage(master->conn));
+	master->conninfo = wbstrdup((char *) conninfo);
 
 	return master;
 }
 
+/*
+ * Like WbMcOpenConnection(), but returns NULL if connecting fails.
+ */
+MasterConn*
+WbMcTryOpenConnection(const char *conninfo)
+{
+	MasterConn* master;
+	PGconn *conn = PQconnectdb(conninfo);
+
+	if (PQstatus(conn) != CONNECTION_OK)
+	{
+		log_warning("Could not connect to master: %s", PQerrorMessage(conn));
+		PQfinish(conn);
+		return NULL;
+	}
+
+	master = wballoc0(sizeof(MasterConn));
+	master->conn = conn;
+	master->conninfo = wbstrdup((char *) conninfo);
+	return master;
+}
+
+/*
+ * Close the connection while it is not needed, so that it does not hold a
+ * WAL sender on the master. WbMcReconnect() opens it again.
+ */
+void
+WbMcDisconnect(MasterConn *master)
+{
+	if (master->recvBuf)
+		PQfreemem(master->recvBuf);
+	master->recvBuf = NULL;
+	master->native = false;
+	PQfinish(master->conn);
+	master->conn = NULL;
+}
+
+bool
+WbMcIsConnected(MasterConn *master)
+{
+	return master->conn != NULL;
+}
+
+void
+WbMcReconnect(MasterConn *master)
+{
+	Assert(master->conn == NULL);
+
+	master->conn = PQconnectdb(master->conninfo);
+	if (PQstatus(master->conn) != CONNECTION_OK)
+		error(PQerrorMessage(master->conn));
+}
+
+/*
+ * Check that an idle connection is still usable, consuming anything the
+ * server has sent in the meantime.
+ */
+bool
+WbMcCheckConnection(MasterConn *master)
+{
+	return PQconsumeInput(master->conn) && PQstatus(master->conn) == CONNECTION_OK;
+}
+
+const char *
+WbMcGetUser(MasterConn *master)
+{
+	return PQuser(master->conn);
+}
+
 void
 WbMcCloseConnection(MasterConn *master)
 {
 	if (master->recvBuf)
 		PQfreemem(master->recvBuf);
+	if (master->streamBuf)
+		wbfree(master->streamBuf);
 	PQfinish(master->conn);
+	wbfree(master->conninfo);
 	wbfree(master);
 }
 
@@ -48,6 +150,16 @@ WbMcGetSocket(MasterConn *master)
 	return PQsocket(master->conn);
 }
 
+/*
+ * True if replies may be sent from one thread while another one receives
+ * WAL. libpq connections are not safe for that, natively read streams are.
+ */
+bool
+WbMcCanSendWhileReceiving(MasterConn *master)
+{
+	return master->native;
+}
+
 bool
 WbMcStartStreaming(MasterConn *master, XLogRecPtr pos, TimeLineID tli)
 {
@@ -60,29 +172,166 @@ WbMcStartStreaming(MasterConn *master, XLogRecPtr pos, TimeLineID tli)
 	snprintf(cmd, sizeof(cmd),
 			"START_REPLICATION %X/%X TIMELINE %u",
 			(uint32) (pos>>32), (uint32) pos, tli);
-	res = PQexec(mc, cmd);
+	if (!PQsendQuery(mc, cmd))
+		error(PQerrorMessage(mc));
+
+	if (WbMcTakeOverStream(master))
+		return true;
+
+	res = PQgetResult(mc);
 
 	if (PQresultStatus(res) == PGRES_COMMAND_OK)
 	{
 		PQclear(res);
+		WbMcDrainResults(mc);
 		return false;
 	}
 	else if (PQresultStatus(res) != PGRES_COPY_BOTH)
 	{
 		PQclear(res);
+		WbMcDrainResults(mc);
 		error(PQerrorMessage(mc));
 	}
 	PQclear(res);
 	return true;
 }
 
+/*
+ * Take the streaming phase away from libpq, whose PQgetCopyData() hands out
+ * every CopyData message in a buffer of its own. Only done when the master
+ * answered START_REPLICATION with CopyBothResponse over an unencrypted
+ * connection, anything else is left to libpq.
+ *
+ * libpq has not read anything since sending the query, so the socket is
+ * ours from the CopyBothResponse on. The master does not send anything
+ * after its CopyDone until it gets ours, so at the end the socket is handed
+ * back exactly where libpq expects the result of START_REPLICATION.
+ */
+static bool
+WbMcTakeOverStream(MasterConn *master)
+{
+	PGconn *mc = master->conn;
+	int sock = PQsocket(mc);
+	char header[5];
+	/* Format byte, column count and 16 bit format of up to 1024 columns */
+	char response[3 + 2*1024];
+	uint32 len;
+	ssize_t n;
+
+	if (PQsslInUse(mc))
+		return false;
+#if PG_VERSION_NUM >= 120000
+	if (PQgssEncInUse(mc))
+		return false;
+#endif
+
+	/* Look at the message type without taking it away from libpq */
+	for (;;)
+	{
+		n = recv(sock, header, 1, MSG_PEEK);
+		if (n == 1)
+			break;
+		if (n == 0)
+			error("master closed the connection unexpectedly");
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			WbMcWaitSocket(sock, POLLIN);
+		else if (errno != EINTR)
+			error("could not receive data from master: %s", strerror(errno));
+	}
+	if (header[0] != 'W')
+		return false;
+
+	WbMcRecvExact(sock, header, sizeof(header));
+	len = fromnetwork32(header + 1);
+	if (len < 4 || len > 4 + sizeof(response))
+		error("invalid CopyBothResponse length %u from master", len);
+	WbMcRecvExact(sock, response, len - 4);
+
+	if (master->streamBuf == NULL)
+	{
+		master->streamBufSize = MC_STREAM_BUFFER_SIZE;
+		master->streamBuf = wballoc(master->streamBufSize);
+	}
+	master->streamStart = master->streamEnd = 0;
+	master->native = true;
+	master->nativeDone = false;
+	master->nativeEnding = false;
+
+	log_debug1("Reading replication stream from master socket directly");
+	return true;
+}
+
+/*
+ * Read exactly len bytes from the nonblocking socket.
+ */
+static void
+WbMcRecvExact(int sock, char *buffer, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = recv(sock, buffer, len, 0);
+
+		if (n > 0)
+		{
+			buffer += n;
+			len -= n;
+		}
+		else if (n == 0)
+			error("master closed the connection unexpectedly");
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			WbMcWaitSocket(sock, POLLIN);
+		else if (errno != EINTR)
+			error("could not receive data from master: %s", strerror(errno));
+	}
+}
+
+static void
+WbMcWaitSocket(int sock, short events)
+{
+	struct pollfd fd;
+
+	fd.fd = sock;
+	fd.events = events;
+	fd.revents = 0;
+	if (poll(&fd, 1, -1) < 0 && errno != EINTR)
+		error("poll on master connection failed");
+}
+
+static void
+WbMcDrainResults(PGconn *mc)
+{
+	PGresult *res;
+
+	while ((res = PQgetResult(mc)) != NULL)
+		PQclear(res);
+}
+
 void
 WbMcEndStreaming(MasterConn *master, TimeLineID *nextTli, char** nextTliStart)
 {
 	PGconn *mc = master->conn;
 	PGresult   *res;
 
-	if (PQputCopyEnd(mc, NULL) <= 0 || PQflush(mc))
+	if (master->native)
+	{
+		char *buf;
+
+		WbMcSendNative(master, 'c', NULL, 0);
+		master->nativeEnding = true;
+
+		/* Skip what the master sent before it saw our CopyDone */
+		while (!master->nativeDone)
+		{
+			if (WbMcReceiveWalNative(master, &buf) == 0)
+				WbMcWaitSocket(PQsocket(mc), POLLIN);
+		}
+		if (master->streamStart != master->streamEnd)
+			error("unexpected data from master after end of streaming");
+
+		/* libpq takes over again for the result of START_REPLICATION */
+		master->native = false;
+	}
+	else if (PQputCopyEnd(mc, NULL) <= 0 || PQflush(mc))
 		error(PQerrorMessage(mc));
 
 	/*
@@ -213,6 +462,9 @@ WbMcReceiveWal(MasterConn *master, char **buffer)
 	PGconn *mc = master->conn;
 	int			rawlen;
 
+	if (master->native)
+		return WbMcReceiveWalNative(master, buffer);
+
 	if (master->recvBuf != NULL)
 		PQfreemem(master->recvBuf);
 	master->recvBuf = NULL;
@@ -254,6 +506,135 @@ WbMcReceiveWal(MasterConn *master, char **buffer)
 	return rawlen;
 }
 
+/*
+ * Receive the next CopyData message of a natively read stream. Returns its
+ * length, 0 if no complete message is available without waiting or -1 at
+ * the end of the stream.
+ */
+static int
+WbMcReceiveWalNative(MasterConn *master, char **buffer)
+{
+	int sock = PQsocket(master->conn);
+
+	if (master->nativeDone)
+		return -1;
+
+	for (;;)
+	{
+		size_t avail = master->streamEnd - master->streamStart;
+		size_t needed = 5;
+		ssize_t n;
+
+		if (avail >= 5)
+		{
+			char *p = master->streamBuf + master->streamStart;
+			uint32 len = fromnetwork32(p + 1);
+
+			if (len < 4 || len > 0x40000000)
+				error("invalid message length %u from master", len);
+			needed = 1 + (size_t) len;
+
+			if (avail >= needed)
+			{
+				master->streamStart += needed;
+				switch (p[0])
+				{
+					case 'd':
+						*buffer = p + 5;
+						return len - 4;
+					case 'c':
+						master->nativeDone = true;
+						return -1;
+					case 'E':
+						{
+							/* Fields are a type byte and a string each */
+							char *field = p + 5;
+							char *end = p + needed;
+							char *message = "unknown error";
+
+							while (end[-1] == '\0' && field < end && *field)
+							{
+								if (*field == 'M')
+									message = field + 1;
+								field += 2 + strlen(field + 1);
+							}
+							error("could not receive data from WAL stream: %s", message);
+						}
+					default:
+						/* NoticeResponse or ParameterStatus */
+						log_debug1("Ignoring message type %c from master", p[0]);
+						continue;
+				}
+			}
+		}
+
+		/* Make room for the rest of the message */
+		if (master->streamStart == master->streamEnd)
+			master->streamStart = master->streamEnd = 0;
+		else if (master->streamStart + needed > master->streamBufSize)
+		{
+			memmove(master->streamBuf, master->streamBuf + master->streamStart, avail);
+			master->streamStart = 0;
+			master->streamEnd = avail;
+		}
+		if (needed > master->streamBufSize)
+		{
+			master->streamBufSize = needed;
+			master->streamBuf = rewballoc(master->streamBuf, needed);
+		}
+
+		/*
+		 * Once our CopyDone is out, the result of START_REPLICATION may
+		 * follow the master's CopyDone. Don't read past it, that is for
+		 * libpq.
+		 */
+		n = recv(sock, master->streamBuf + master->streamEnd,
+				master->nativeEnding ? needed - avail :
+				master->streamBufSize - master->streamEnd, 0);
+		if (n > 0)
+			master->streamEnd += n;
+		else if (n == 0)
+			error("could not receive data from WAL stream: master closed the connection");
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		else if (errno != EINTR)
+			error("could not receive data from WAL stream: %s", strerror(errno));
+	}
+}
+
+/*
+ * Send a protocol message directly over the socket while streaming
+ * natively.
+ */
+static void
+WbMcSendNative(MasterConn *master, char type, const char *buffer, int nbytes)
+{
+	int sock = PQsocket(master->conn);
+	char message[5 + MC_MAX_SEND_LEN];
+	size_t len = 5 + nbytes;
+	size_t sent = 0;
+
+	if (nbytes > MC_MAX_SEND_LEN)
+		error("message of %d bytes too large for WAL stream", nbytes);
+
+	message[0] = type;
+	write32(message + 1, nbytes + 4);
+	if (nbytes)
+		memcpy(message + 5, buffer, nbytes);
+
+	while (sent < len)
+	{
+		ssize_t n = send(sock, message + sent, len - sent, MSG_NOSIGNAL);
+
+		if (n >= 0)
+			sent += n;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			WbMcWaitSocket(sock, POLLOUT);
+		else if (errno != EINTR)
+			error("could not send data to WAL stream: %s", strerror(errno));
+	}
+}
+
 static void
 WbMcProcessWalsenderMessage(MasterConn *master, ReplMessage *msg)
 {
@@ -271,6 +652,13 @@ static void
 WbMcSend(MasterConn *master, const char *buffer, int nbytes)
 {
 	PGconn *mc = master->conn;
+
+	if (master->native)
+	{
+		WbMcSendNative(master, 'd', buffer, nbytes);
+		return;
+	}
+
 	if (PQputCopyData(mc, buffer, nbytes) <= 0 ||
 		PQflush(mc))
 		showPQerror(mc, "could not send data to WAL stream");
@@ -389,6 +777,54 @@ WbMcGetTimelineHistory(MasterConn* master, TimeLineID timeline,
 	return true;
 }
 
+/* Segment size of the master's WAL, see wbpgtypes.h */
+uint32 WalSegSize = XLOG_SEG_SIZE;
+/* WalSegSize is only set once per process, streams may be reading it */
+static bool walGeometryKnown = false;
+static pthread_mutex_t walGeometryLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Take over the WAL segment size from the values of wal_segment_size and
+ * wal_block_size on the master the first time we are called in a process.
+ * Later calls only check that the master still matches. The page size is
+ * compiled in, masters that use a different one are refused.
+ */
+void
+WbMcSetWalGeometry(const char *segSize, const char *blockSize)
+{
+	uint64 segBytes;
+	uint64 blockBytes;
+
+	if (!parse_byte_size(blockSize, &blockBytes))
+		error("Invalid wal_block_size \"%s\" received from master", blockSize);
+	if (blockBytes != XLOG_BLCKSZ)
+		error("Master uses wal_block_size %llu, walbouncer is built for %d",
+				(unsigned long long) blockBytes, XLOG_BLCKSZ);
+
+	if (!parse_byte_size(segSize, &segBytes))
+		error("Invalid wal_segment_size \"%s\" received from master", segSize);
+	/* Same limits as initdb --wal-segsize */
+	if (segBytes < 1024 * 1024 || segBytes > 1024 * 1024 * 1024 ||
+			(segBytes & (segBytes - 1)))
+		error("Unsupported wal_segment_size %llu on master",
+				(unsigned long long) segBytes);
+
+	pthread_mutex_lock(&walGeometryLock);
+	if (!walGeometryKnown)
+	{
+		log_debug1("Master uses WAL segments of %llu MB",
+				(unsigned long long) (segBytes / (1024 * 1024)));
+		WalSegSize = (uint32) segBytes;
+		walGeometryKnown = true;
+	}
+	pthread_mutex_unlock(&walGeometryLock);
+
+	if (segBytes != WalSegSize)
+		error("Master now uses WAL segments of %llu MB instead of %u MB, restart walbouncer",
+				(unsigned long long) (segBytes / (1024 * 1024)),
+				WalSegSize / (1024 * 1024));
+}
+
 char *
 WbMcShowVariable(MasterConn* master, char *varname)
 {
@@ -417,64 +853,158 @@ WbMcShowVariable(MasterConn* master, char *varname)
 	return value;
 }
 
+/*
+ * Look up the OIDs of objects matching the names or patterns of a filtering
+ * rule. Lists of included objects always contain the system tablespaces or
+ * template databases.
+ */
 Oid *
 WbMcResolveOids(MasterConn *master, OidResolveKind kind, bool include, char** names, int n_items)
 {
 	Oid *oids;
 	PGresult *res;
-	int oidcount;
+	int oidcount = 0;
 	int i;
-	char sql[1000];
-	int sqlpos = 0;
-	const char * const* paramValues = (const char * const*) names;
-	char *itemkind = "";
+	const char *sql = "";
+	const char *itemkind = "";
+	char *defaults[2];
 
 	switch (kind)
 	{
 		case OID_RESOLVE_TABLESPACES:
-			sqlpos = snprintf(sql, sizeof(sql),
-					"SELECT oid, spcname FROM pg_tablespace WHERE spcname IN (");
+			sql = "SELECT oid, spcname FROM pg_tablespace";
 			itemkind = "tablespaces";
-			if (include)
-				sqlpos += snprintf(sql+sqlpos, (sizeof(sql) - sqlpos),
-									"'pg_default', 'pg_global', ");
+			defaults[0] = "pg_default";
+			defaults[1] = "pg_global";
 			break;
 		case OID_RESOLVE_DATABASES:
-			sqlpos = snprintf(sql, sizeof(sql),
-					"SELECT oid, datname FROM pg_database WHERE datname IN (");
+			sql = "SELECT oid, datname FROM pg_database";
 			itemkind = "databases";
-			if (include)
-				sqlpos += snprintf(sql+sqlpos, (sizeof(sql) - sqlpos),
-									"'template0', 'template1', ");
+			defaults[0] = "template0";
+			defaults[1] = "template1";
 			break;
 	}
 
-	for (i = 0; i < n_items; i++)
+	// Patterns are matched here, the catalogs are small enough to fetch whole
+	res = PQexec(master->conn, sql);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		error("Could not retrieve %s: %s", itemkind, PQerrorMessage(master->conn));
+
+	oids = wballoc0(sizeof(Oid)*(PQntuples(res)+1));
+
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		char *name = PQgetvalue(res, i, 1);
+
+		if (!wb_filter_name_matches(names, n_items, name) &&
+				!(include && wb_filter_name_matches(defaults, 2, name)))
+			continue;
+
+		oids[oidcount] = atoi(PQgetvalue(res, i, 0));
+		log_debug1("Found %s oid for %s: %d", itemkind, name, oids[oidcount]);
+		oidcount++;
+	}
+	PQclear(res);
+
+	return oids;
+}
+
+/*
+ * Fetch all tablespaces and databases with one query. Returns NULL if the
+ * query fails, the names are allocated together with the array.
+ */
+NamedOid *
+WbMcListNamedOids(MasterConn *master, int *count)
+{
+	NamedOid *result;
+	PGresult *res;
+	size_t namesLen = 0;
+	char *names;
+	int n;
+	int i;
+
+	res = PQexec(master->conn,
+			"SELECT 't', oid, spcname FROM pg_tablespace "
+			"UNION ALL SELECT 'd', oid, datname FROM pg_database");
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_warning("Could not retrieve tablespaces and databases: %s",
+				PQerrorMessage(master->conn));
+		PQclear(res);
+		return NULL;
+	}
+
+	n = PQntuples(res);
+	for (i = 0; i < n; i++)
+		namesLen += PQgetlength(res, i, 2) + 1;
+
+	result = wballoc(sizeof(NamedOid) * n + namesLen);
+	names = (char*) (result + n);
+
+	for (i = 0; i < n; i++)
 	{
-		sqlpos += snprintf(sql + sqlpos, (sizeof(sql) - sqlpos), i ? ", $%d" : "$%d", i+1);
+		result[i].kind = PQgetvalue(res, i, 0)[0] == 't' ?
+				OID_RESOLVE_TABLESPACES : OID_RESOLVE_DATABASES;
+		result[i].oid = atoi(PQgetvalue(res, i, 1));
+		result[i].name = names;
+		strcpy(names, PQgetvalue(res, i, 2));
+		names += strlen(names) + 1;
 	}
-	sqlpos += snprintf(sql + sqlpos, (sizeof(sql) - sqlpos), ");");
-	if (sqlpos >= sizeof(sql))
-		error("Too many %s specified", itemkind);
+	PQclear(res);
+
+	*count = n;
+	return result;
+}
 
-	res = PQexecParams(master->conn, sql,
-		n_items, NULL, paramValues,
-		NULL, NULL, 0);
+/*
+ * Fetch the files of all relations in the database we are connected to.
+ * Indexes and TOAST tables are named after the table they belong to. Returns
+ * NULL if the query fails, the names are allocated together with the array.
+ */
+NamedRelation *
+WbMcListRelations(MasterConn *master, int *count)
+{
+	NamedRelation *result;
+	PGresult *res;
+	size_t namesLen = 0;
+	char *names;
+	int n;
+	int i;
+
+	res = PQexec(master->conn,
+			"SELECT pg_relation_filenode(c.oid), o.oid, n.nspname || '.' || o.relname "
+			"FROM pg_class c "
+			"LEFT JOIN pg_index i ON i.indexrelid = c.oid "
+			"LEFT JOIN pg_class t ON t.reltoastrelid = COALESCE(i.indrelid, c.oid) "
+			"JOIN pg_class o ON o.oid = COALESCE(t.oid, i.indrelid, c.oid) "
+			"JOIN pg_namespace n ON n.oid = o.relnamespace "
+			"WHERE pg_relation_filenode(c.oid) IS NOT NULL");
 	if (PQresultStatus(res) != PGRES_TUPLES_OK)
-		error("Could not retrieve %s: %s", itemkind, PQerrorMessage(master->conn));
+	{
+		log_warning("Could not retrieve relations: %s", PQerrorMessage(master->conn));
+		PQclear(res);
+		return NULL;
+	}
+
+	n = PQntuples(res);
+	for (i = 0; i < n; i++)
+		namesLen += PQgetlength(res, i, 2) + 1;
 
-	oidcount = PQntuples(res);
-	oids = wballoc0(sizeof(Oid)*(oidcount+1));
+	result = wballoc(sizeof(NamedRelation) * n + namesLen);
+	names = (char*) (result + n);
 
-	for (i = 0; i < oidcount; i++)
+	for (i = 0; i < n; i++)
 	{
-		char *oid = PQgetvalue(res, i, 0);
-		oids[i] = atoi(oid);
-		log_debug1("Found %s oid for %s: %d", itemkind, PQgetvalue(res, i, 1), oids[i]);
+		result[i].relNode = strtoul(PQgetvalue(res, i, 0), NULL, 10);
+		result[i].owner = strtoul(PQgetvalue(res, i, 1), NULL, 10);
+		result[i].name = names;
+		strcpy(names, PQgetvalue(res, i, 2));
+		names += strlen(names) + 1;
 	}
 	PQclear(res);
 
-	return oids;
+	*count = n;
+	return result;
 }
 
 const char *
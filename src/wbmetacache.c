@@ -0,0 +1,320 @@
+#include "wbmetacache.h"
+
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+
+#include "wbconfig.h"
+#include "wbutils.h"
+
+/* How long values that only change on master restart are kept */
+#define META_STATIC_TTL ((TimestampTz) 3600 * 1000000)
+
+#define META_HISTORY_SLOTS 8
+#define META_HISTORY_SIZE 16384
+#define META_VALUE_SIZE 64
+#define META_NAME_SIZE 64
+
+#define MetaLoad(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define MetaFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * Every entry starts with a change counter that is odd while the entry is
+ * being written, and the time the value was fetched from the master, zero
+ * if the entry is empty.
+ */
+typedef struct {
+	uint32 changeCount;
+	TimestampTz fetched;
+} MetaEntry;
+
+typedef struct {
+	MetaEntry e;
+	char sysid[META_VALUE_SIZE];
+	char tli[META_VALUE_SIZE];
+	char xpos[META_VALUE_SIZE];
+} MetaIdentify;
+
+typedef struct {
+	MetaEntry e;
+	char value[META_VALUE_SIZE];
+} MetaVariable;
+
+typedef struct {
+	MetaEntry e;
+	TimeLineID tli;
+	char filename[META_NAME_SIZE];
+	int contentLen;
+	char content[META_HISTORY_SIZE];
+} MetaHistory;
+
+/* Settings that can't change while the master is running */
+static const char *staticVariables[] = {
+	"server_version",
+	"server_version_num",
+	"wal_segment_size",
+	"wal_block_size",
+	"block_size",
+	"data_directory_mode",
+	"integer_datetimes"
+};
+#define META_VARIABLES (sizeof(staticVariables) / sizeof(staticVariables[0]))
+
+typedef struct {
+	/* System identifier the static values belong to */
+	MetaEntry systemEntry;
+	char sysid[META_VALUE_SIZE];
+
+	MetaIdentify identify;
+	MetaVariable variables[META_VARIABLES];
+	MetaHistory histories[META_HISTORY_SLOTS];
+} MetaCacheShmem;
+
+static MetaCacheShmem *metaCache = NULL;
+static TimestampTz identifyTtl = 0;
+
+static bool MetaBeginWrite(MetaEntry *entry);
+static void MetaEndWrite(MetaEntry *entry, TimestampTz fetched);
+static bool MetaIsFresh(TimestampTz fetched, TimestampTz ttl);
+static bool MetaCopyString(char *target, const char *value);
+static void MetaClear(MetaEntry *entry);
+
+/*
+ * Set up the cache in shared memory, must be called before forking.
+ */
+void
+WbMetaCacheInit()
+{
+	void *shmem;
+
+	if (!CurrentConfig->metadata_cache_ttl)
+		return;
+
+	shmem = mmap(NULL, sizeof(MetaCacheShmem), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shmem == MAP_FAILED)
+		error("Could not allocate shared memory for metadata cache");
+
+	metaCache = shmem;
+	identifyTtl = (TimestampTz) CurrentConfig->metadata_cache_ttl * 1000;
+}
+
+/*
+ * Take an entry for writing. Returns false if somebody else is writing it,
+ * their value is as good as ours then.
+ */
+static bool
+MetaBeginWrite(MetaEntry *entry)
+{
+	uint32 count = MetaLoad(entry->changeCount);
+
+	if (count & 1)
+		return false;
+	return __atomic_compare_exchange_n(&(entry->changeCount), &count, count + 1,
+			false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static void
+MetaEndWrite(MetaEntry *entry, TimestampTz fetched)
+{
+	entry->fetched = fetched;
+	MetaFence();
+	__atomic_add_fetch(&(entry->changeCount), 1, __ATOMIC_SEQ_CST);
+}
+
+static bool
+MetaIsFresh(TimestampTz fetched, TimestampTz ttl)
+{
+	return fetched && GetCurrentTimestamp() - fetched < ttl;
+}
+
+static bool
+MetaCopyString(char *target, const char *value)
+{
+	if (strlen(value) >= META_VALUE_SIZE)
+		return false;
+	strcpy(target, value);
+	return true;
+}
+
+static void
+MetaClear(MetaEntry *entry)
+{
+	if (MetaBeginWrite(entry))
+		MetaEndWrite(entry, 0);
+}
+
+bool
+WbMetaGetIdentify(char **sysid, char **tli, char **xpos)
+{
+	MetaIdentify copy;
+	uint32 count;
+
+	if (!metaCache)
+		return false;
+
+	count = MetaLoad(metaCache->identify.e.changeCount);
+	if (count & 1)
+		return false;
+	memcpy(&copy, &(metaCache->identify), sizeof(MetaIdentify));
+	MetaFence();
+	if (count != MetaLoad(metaCache->identify.e.changeCount) ||
+			!MetaIsFresh(copy.e.fetched, identifyTtl))
+		return false;
+
+	*sysid = wbstrdup(copy.sysid);
+	*tli = wbstrdup(copy.tli);
+	*xpos = wbstrdup(copy.xpos);
+	return true;
+}
+
+void
+WbMetaPutIdentify(const char *sysid, const char *tli, const char *xpos)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	int i;
+
+	if (!metaCache)
+		return;
+
+	/* Values of another system are of no use */
+	if (MetaBeginWrite(&(metaCache->systemEntry)))
+	{
+		if (metaCache->systemEntry.fetched && strcmp(metaCache->sysid, sysid) != 0)
+		{
+			log_info("Master system identifier changed, clearing metadata cache");
+			for (i = 0; i < META_VARIABLES; i++)
+				MetaClear(&(metaCache->variables[i].e));
+			for (i = 0; i < META_HISTORY_SLOTS; i++)
+				MetaClear(&(metaCache->histories[i].e));
+		}
+		if (MetaCopyString(metaCache->sysid, sysid))
+			MetaEndWrite(&(metaCache->systemEntry), now);
+		else
+			MetaEndWrite(&(metaCache->systemEntry), 0);
+	}
+
+	if (!MetaBeginWrite(&(metaCache->identify.e)))
+		return;
+
+	if (MetaCopyString(metaCache->identify.sysid, sysid) &&
+			MetaCopyString(metaCache->identify.tli, tli) &&
+			MetaCopyString(metaCache->identify.xpos, xpos))
+		MetaEndWrite(&(metaCache->identify.e), now);
+	else
+		MetaEndWrite(&(metaCache->identify.e), 0);
+}
+
+bool
+WbMetaGetTimelineHistory(TimeLineID tli, TimelineHistory *history)
+{
+	MetaHistory *entry;
+	char filename[META_NAME_SIZE];
+	uint32 count;
+	int len;
+
+	if (!metaCache)
+		return false;
+
+	entry = &(metaCache->histories[tli % META_HISTORY_SLOTS]);
+	count = MetaLoad(entry->e.changeCount);
+	if ((count & 1) || entry->tli != tli ||
+			!MetaIsFresh(entry->e.fetched, META_STATIC_TTL))
+		return false;
+
+	/* Don't trust anything read before the counter is checked again */
+	memcpy(filename, entry->filename, META_NAME_SIZE);
+	filename[META_NAME_SIZE - 1] = '\0';
+	len = entry->contentLen;
+	if (len < 0 || len > META_HISTORY_SIZE)
+		len = 0;
+	history->content = wballoc(len);
+	memcpy(history->content, entry->content, len);
+	MetaFence();
+
+	if (count != MetaLoad(entry->e.changeCount) || entry->tli != tli)
+	{
+		wbfree(history->content);
+		return false;
+	}
+
+	history->filename = wbstrdup(filename);
+	history->contentLen = len;
+	return true;
+}
+
+void
+WbMetaPutTimelineHistory(TimeLineID tli, TimelineHistory *history)
+{
+	MetaHistory *entry;
+
+	if (!metaCache || history->contentLen > META_HISTORY_SIZE ||
+			strlen(history->filename) >= META_NAME_SIZE)
+		return;
+
+	entry = &(metaCache->histories[tli % META_HISTORY_SLOTS]);
+	if (!MetaBeginWrite(&(entry->e)))
+		return;
+
+	entry->tli = tli;
+	strcpy(entry->filename, history->filename);
+	entry->contentLen = history->contentLen;
+	memcpy(entry->content, history->content, history->contentLen);
+	MetaEndWrite(&(entry->e), GetCurrentTimestamp());
+}
+
+static int
+MetaVariableIndex(const char *name)
+{
+	int i;
+
+	for (i = 0; i < META_VARIABLES; i++)
+		if (strcasecmp(staticVariables[i], name) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * Returns the cached value of a setting or NULL if it is not cached. Only
+ * settings that can't change while the master is running are cached.
+ */
+char*
+WbMetaGetVariable(const char *name)
+{
+	MetaVariable copy;
+	uint32 count;
+	int i;
+
+	if (!metaCache || (i = MetaVariableIndex(name)) < 0)
+		return NULL;
+
+	count = MetaLoad(metaCache->variables[i].e.changeCount);
+	if (count & 1)
+		return NULL;
+	memcpy(&copy, &(metaCache->variables[i]), sizeof(MetaVariable));
+	MetaFence();
+	if (count != MetaLoad(metaCache->variables[i].e.changeCount) ||
+			!MetaIsFresh(copy.e.fetched, META_STATIC_TTL))
+		return NULL;
+
+	return wbstrdup(copy.value);
+}
+
+void
+WbMetaPutVariable(const char *name, const char *value)
+{
+	MetaVariable *entry;
+	int i;
+
+	if (!metaCache || (i = MetaVariableIndex(name)) < 0)
+		return;
+
+	entry = &(metaCache->variables[i]);
+	if (!MetaBeginWrite(&(entry->e)))
+		return;
+
+	if (MetaCopyString(entry->value, value))
+		MetaEndWrite(&(entry->e), GetCurrentTimestamp());
+	else
+		MetaEndWrite(&(entry->e), 0);
+}
@@ -0,0 +1,418 @@
+#include "wboidcache.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "wbmasterconn.h"
+#include "wbutils.h"
+
+#define MAX_CONNINFO_LEN 4000
+/* How soon to try again after resolving failed */
+#define OIDCACHE_RETRY_INTERVAL 10
+/* Attempts at reading the cache while it is being updated before giving up */
+#define OIDCACHE_LOOKUP_RETRIES 1000
+
+#define OIDCACHE_LISTS 4
+/* Room reserved for the objects matching each name pattern */
+#define OIDCACHE_PATTERN_MATCHES 4096
+
+#define CacheLoad(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define CacheFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * Resolved lists are stored zero terminated one after another. Odd
+ * changeCount means that the OID cache process is updating them.
+ */
+typedef struct {
+	uint32 changeCount;
+	bool valid;
+	Oid oids[1];
+} OidCacheShmem;
+
+static OidCacheShmem *oidCache = NULL;
+/* Total number of Oids stored, including terminators */
+static int cacheSize = 0;
+static int numEntries = 0;
+/* Offset of each list of each entry in oids, -1 if the list is empty */
+static int *listOffsets = NULL;
+
+/* Only used in the OID cache process */
+static Oid *resolveBuffer = NULL;
+
+static int OidCacheRefresh();
+static bool OidCacheListInfo(wb_config_entry *entry, int list, OidResolveKind *kind,
+		bool *include, char ***names, int *n);
+static int OidCacheResolveList(NamedOid *objects, int count, OidResolveKind kind,
+		bool include, char **names, int n, Oid *target, int size);
+
+static char *defaultTablespaces[] = {"pg_default", "pg_global"};
+static char *defaultDatabases[] = {"template0", "template1"};
+
+/*
+ * Lay out the cache for the current configuration. Must be called before
+ * forking.
+ */
+void
+WbOidCacheInit()
+{
+	wb_config_list_entry *listitem;
+	int i;
+
+	if (!CurrentConfig->oid_refresh_interval)
+		return;
+
+	for (listitem = CurrentConfig->configurations; listitem; listitem = listitem->next)
+		numEntries++;
+
+	listOffsets = wballoc(sizeof(int) * numEntries * OIDCACHE_LISTS);
+
+	for (listitem = CurrentConfig->configurations, i = 0; listitem; listitem = listitem->next, i++)
+	{
+		int list;
+
+		for (list = 0; list < OIDCACHE_LISTS; list++)
+		{
+			OidResolveKind kind;
+			bool include;
+			char **names;
+			int n;
+
+			if (!OidCacheListInfo(&listitem->entry, list, &kind, &include, &names, &n))
+			{
+				listOffsets[i * OIDCACHE_LISTS + list] = -1;
+				continue;
+			}
+			listOffsets[i * OIDCACHE_LISTS + list] = cacheSize;
+			/* Room for the defaults and the terminator */
+			cacheSize += n + 3 + wb_filter_count_patterns(names, n) * OIDCACHE_PATTERN_MATCHES;
+		}
+	}
+
+	/* Nothing to resolve */
+	if (!cacheSize)
+		return;
+
+	oidCache = mmap(NULL, offsetof(OidCacheShmem, oids) + sizeof(Oid) * cacheSize,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (oidCache == MAP_FAILED)
+		error("Could not allocate shared memory for OID cache");
+	resolveBuffer = wballoc(sizeof(Oid) * cacheSize);
+}
+
+bool
+WbOidCacheEnabled()
+{
+	return oidCache != NULL;
+}
+
+/*
+ * Describe list number list of a configuration entry, returns false if it
+ * is not used.
+ */
+static bool
+OidCacheListInfo(wb_config_entry *entry, int list, OidResolveKind *kind,
+		bool *include, char ***names, int *n)
+{
+	switch (list)
+	{
+		case 0:
+			*kind = OID_RESOLVE_TABLESPACES;
+			*include = true;
+			*names = entry->filter.include_tablespaces;
+			*n = entry->filter.n_include_tablespaces;
+			break;
+		case 1:
+			*kind = OID_RESOLVE_DATABASES;
+			*include = true;
+			*names = entry->filter.include_databases;
+			*n = entry->filter.n_include_databases;
+			break;
+		case 2:
+			*kind = OID_RESOLVE_TABLESPACES;
+			*include = false;
+			*names = entry->filter.exclude_tablespaces;
+			*n = entry->filter.n_exclude_tablespaces;
+			break;
+		default:
+			*kind = OID_RESOLVE_DATABASES;
+			*include = false;
+			*names = entry->filter.exclude_databases;
+			*n = entry->filter.n_exclude_databases;
+			break;
+	}
+	return *n > 0;
+}
+
+/*
+ * Pick the objects matching names out of all objects of the master. Lists
+ * of included objects always contain the system tablespaces or template
+ * databases. Returns the number of Oids stored in target, or -1 if more than
+ * size - 1 objects match.
+ */
+static int
+OidCacheResolveList(NamedOid *objects, int count, OidResolveKind kind,
+		bool include, char **names, int n, Oid *target, int size)
+{
+	char **defaults = kind == OID_RESOLVE_TABLESPACES ?
+			defaultTablespaces : defaultDatabases;
+	int found = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (objects[i].kind != kind)
+			continue;
+
+		if (wb_filter_name_matches(names, n, objects[i].name) ||
+				(include && wb_filter_name_matches(defaults, 2, objects[i].name)))
+		{
+			/* Keep room for the terminator */
+			if (found == size - 1)
+				return -1;
+			log_debug1("Found %s oid for %s: %d",
+					kind == OID_RESOLVE_TABLESPACES ? "tablespaces" : "databases",
+					objects[i].name, objects[i].oid);
+			target[found++] = objects[i].oid;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Main loop of the OID cache process. Resolving blocks while the master is
+ * unreachable, so it is kept out of the main process that accepts clients.
+ */
+void
+WbOidCacheMain()
+{
+	for (;;)
+	{
+		int wait = OidCacheRefresh();
+
+		for (; wait > 0; wait--)
+		{
+			if (!DaemonIsAlive())
+				error("Main process died, OID cache exiting!");
+			sleep(1);
+		}
+	}
+}
+
+/*
+ * Resolve all filtering rules again. Returns the number of seconds until the
+ * next refresh is due.
+ */
+static int
+OidCacheRefresh()
+{
+	char conninfo[MAX_CONNINFO_LEN+1];
+	char *buf = conninfo;
+	char *buf_end = &(conninfo[MAX_CONNINFO_LEN]);
+	wb_config_list_entry *listitem;
+	MasterConn *master;
+	NamedOid *objects;
+	int count;
+	bool valid;
+	int i;
+
+	memset(conninfo, 0, sizeof(conninfo));
+
+	if (CurrentConfig->master.host)
+		buf += snprintf(buf, buf_end - buf, "host=%s ", CurrentConfig->master.host);
+
+	if (CurrentConfig->master.port)
+		buf += snprintf(buf, buf_end - buf, "port=%d ", CurrentConfig->master.port);
+
+	if (CurrentConfig->master.user)
+		buf += snprintf(buf, buf_end - buf, "user=%s ", CurrentConfig->master.user);
+
+	buf += snprintf(buf, buf_end - buf, "dbname=postgres application_name=walbouncer connect_timeout=10");
+
+	master = WbMcTryOpenConnection(conninfo);
+	if (!master)
+		return OIDCACHE_RETRY_INTERVAL;
+
+	objects = WbMcListNamedOids(master, &count);
+	WbMcCloseConnection(master);
+	if (!objects)
+		return OIDCACHE_RETRY_INTERVAL;
+
+	memset(resolveBuffer, 0, sizeof(Oid) * cacheSize);
+	valid = true;
+	for (listitem = CurrentConfig->configurations, i = 0; listitem; listitem = listitem->next, i++)
+	{
+		int list;
+
+		for (list = 0; list < OIDCACHE_LISTS; list++)
+		{
+			int offset = listOffsets[i * OIDCACHE_LISTS + list];
+			OidResolveKind kind;
+			bool include;
+			char **names;
+			int n;
+
+			if (offset < 0)
+				continue;
+			OidCacheListInfo(&listitem->entry, list, &kind, &include, &names, &n);
+			if (OidCacheResolveList(objects, count, kind, include, names, n,
+					resolveBuffer + offset,
+					n + 3 + wb_filter_count_patterns(names, n) * OIDCACHE_PATTERN_MATCHES) < 0)
+			{
+				/* Streams will resolve them on their own until this is fixed */
+				log_warning("Too many objects match the filtering rules of %s to cache them",
+						listitem->entry.name);
+				valid = false;
+			}
+		}
+	}
+	wbfree(objects);
+
+	__atomic_add_fetch(&oidCache->changeCount, 1, __ATOMIC_SEQ_CST);
+	memcpy(oidCache->oids, resolveBuffer, sizeof(Oid) * cacheSize);
+	oidCache->valid = valid;
+	__atomic_add_fetch(&oidCache->changeCount, 1, __ATOMIC_SEQ_CST);
+
+	log_debug1("Resolved filtering OIDs of %d configurations", numEntries);
+
+	return CurrentConfig->oid_refresh_interval;
+}
+
+/*
+ * Set up the filtering OIDs of fl for a configuration entry from the cache.
+ * Returns false if they have not been resolved yet.
+ */
+bool
+WbOidCacheLookup(wb_config_entry *entry, FilterData *fl)
+{
+	wb_config_list_entry *listitem;
+	Oid *lists[OIDCACHE_LISTS];
+	int tries;
+	int i;
+
+	if (!oidCache)
+		return false;
+
+	for (listitem = CurrentConfig->configurations, i = 0; listitem; listitem = listitem->next, i++)
+		if (&listitem->entry == entry)
+			break;
+	if (!listitem)
+		return false;
+
+	for (tries = 0; ; tries++)
+	{
+		uint32 count;
+		int list;
+
+		/* The OID cache process may have died in the middle of an update */
+		if (tries == OIDCACHE_LOOKUP_RETRIES)
+		{
+			log_warning("Filtering OIDs are being updated, resolving them directly");
+			return false;
+		}
+
+		count = CacheLoad(oidCache->changeCount);
+		if (count & 1)
+			continue;
+		if (!oidCache->valid)
+			return false;
+
+		for (list = 0; list < OIDCACHE_LISTS; list++)
+		{
+			int offset = listOffsets[i * OIDCACHE_LISTS + list];
+			int n = 0;
+
+			lists[list] = NULL;
+			if (offset < 0)
+				continue;
+
+			while (oidCache->oids[offset + n])
+				n++;
+			lists[list] = wballoc0(sizeof(Oid) * (n + 1));
+			memcpy(lists[list], oidCache->oids + offset, sizeof(Oid) * n);
+		}
+
+		CacheFence();
+		if (count == CacheLoad(oidCache->changeCount))
+			break;
+
+		/* Updated while we were copying */
+		for (list = 0; list < OIDCACHE_LISTS; list++)
+			if (lists[list])
+				wbfree(lists[list]);
+	}
+
+	fl->include_tablespaces = lists[0];
+	fl->include_databases = lists[1];
+	fl->exclude_tablespaces = lists[2];
+	fl->exclude_databases = lists[3];
+	return true;
+}
+
+/*
+ * Find out the names of objects created while streaming with fl and add the
+ * ones named in the filtering rules of entry to its lists. Objects that are
+ * not visible on the master yet stay pending. Returns false if the master
+ * could not be queried.
+ */
+bool
+WbOidCacheResolvePending(wb_config_entry *entry, FilterData *fl, MasterConn *master)
+{
+	Oid **lists[OIDCACHE_LISTS] = {
+		&(fl->include_tablespaces),
+		&(fl->include_databases),
+		&(fl->exclude_tablespaces),
+		&(fl->exclude_databases)
+	};
+	NamedOid *objects;
+	NamedOid *created;
+	Oid *found;
+	int count;
+	int numCreated = 0;
+	int list;
+	int i;
+
+	objects = WbMcListNamedOids(master, &count);
+	if (!objects)
+		return false;
+
+	/* Pick out the pending objects that have been committed */
+	created = wballoc(sizeof(NamedOid) * (count + 1));
+	for (i = 0; i < count; i++)
+	{
+		Oid *pending = objects[i].kind == OID_RESOLVE_TABLESPACES ?
+				fl->pending_tablespaces : fl->pending_databases;
+
+		if (pending && WbFRemoveOid(pending, objects[i].oid))
+			created[numCreated++] = objects[i];
+	}
+
+	found = wballoc(sizeof(Oid) * (numCreated + 1));
+	for (list = 0; list < OIDCACHE_LISTS; list++)
+	{
+		OidResolveKind kind;
+		bool include;
+		char **names;
+		int n;
+		int nfound;
+
+		if (!OidCacheListInfo(entry, list, &kind, &include, &names, &n))
+			continue;
+
+		nfound = OidCacheResolveList(created, numCreated, kind, include, names, n,
+				found, numCreated + 1);
+		for (i = 0; i < nfound; i++)
+			WbFAddOid(lists[list], found[i]);
+	}
+	WbFRulesChanged(fl);
+
+	for (i = 0; i < numCreated; i++)
+		log_info("%s %s has OID %u", created[i].kind == OID_RESOLVE_TABLESPACES ?
+				"Tablespace" : "Database", created[i].name, created[i].oid);
+
+	wbfree(found);
+	wbfree(created);
+	wbfree(objects);
+	return true;
+}
@@ -0,0 +1,529 @@
+#include "wbpipeline.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "wbutils.h"
+
+/* Entries in each queue, a power of two */
+#define PIPE_QUEUE_LEN 16
+/* Output handed to the sender in one entry */
+#define PIPE_CHUNK_SIZE (64*1024)
+/* Nothing should be missed, but don't count on it */
+#define PIPE_POLL_TIMEOUT 1000
+/* Seconds the client gets to accept queued output when the stream ends */
+#define PIPE_DRAIN_TIMEOUT 60
+
+#define PipeLoad(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define PipeStore(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define PipeFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * Positions in a ring with one producer and one consumer. Entries from
+ * tail up to head belong to the consumer, the rest to the producer. Each
+ * position is only advanced by its own side.
+ */
+typedef struct {
+	uint32 head;
+	uint32 tail;
+} PipeQueue;
+
+/*
+ * A thread sets waiting before it checks a queue one last time and goes to
+ * sleep. The other side checks it after moving the queue and wakes it up.
+ */
+typedef struct {
+	int wakeFd;
+	bool waiting;
+} PipeWaiter;
+
+typedef struct {
+	ReplMessage msg;
+	/* Copy of the WAL data, msg.data points here */
+	char *buf;
+	int bufSize;
+} PipeMessage;
+
+typedef struct {
+	int len;
+	char data[PIPE_CHUNK_SIZE];
+} PipeChunk;
+
+struct WbPipeline {
+	WbConn conn;
+	/* The stream's thread */
+	PipeWaiter main;
+
+	/* Master the receiver reads from, NULL while not receiving */
+	MasterConn *master;
+	pthread_t receiveThread;
+	PipeWaiter receiver;
+	bool stopReceiving;
+	bool receiveFailed;
+	PipeQueue received;
+	PipeMessage messages[PIPE_QUEUE_LEN];
+	/* Next message for the stream, the one before it is in use until then */
+	uint32 receiveNext;
+
+	pthread_t sendThread;
+	PipeWaiter sender;
+	/* Stop once everything is sent, or right away */
+	bool stopSending;
+	bool abortSending;
+	bool sendFailed;
+	PipeQueue output;
+	PipeChunk *chunks;
+};
+
+static void* PipeReceiverMain(void *arg);
+static void* PipeSenderMain(void *arg);
+static void PipeCopyMessage(PipeMessage *entry, ReplMessage *msg);
+static void PipeInitWaiter(PipeWaiter *waiter);
+static void PipeSleep(PipeWaiter *waiter, int fd, short events);
+static void PipeWake(PipeWaiter *waiter);
+static void PipeSignal(PipeWaiter *waiter);
+
+/*
+ * Start the sender for a client that is streaming. Output must only be
+ * handed over with WbPipeFlush() until the pipeline is freed.
+ */
+WbPipeline*
+WbPipeCreate(WbConn conn)
+{
+	WbPipeline *pl = wballoc0(sizeof(WbPipeline));
+
+	pl->conn = conn;
+	pl->chunks = wballoc(sizeof(PipeChunk) * PIPE_QUEUE_LEN);
+	PipeInitWaiter(&pl->main);
+	PipeInitWaiter(&pl->receiver);
+	PipeInitWaiter(&pl->sender);
+
+	if (pthread_create(&pl->sendThread, NULL, PipeSenderMain, pl))
+		error("Could not start sender thread");
+
+	log_info("Streaming with separate receiver and sender threads");
+	return pl;
+}
+
+/*
+ * Stop both threads. With drain the output queued so far is sent first,
+ * anything not handed over yet is still pending on the connection. Returns
+ * false if sending failed or the client did not take the output in time.
+ */
+bool
+WbPipeFree(WbPipeline *pl, bool drain)
+{
+	bool sent;
+	int i;
+
+	WbPipeStopReceiving(pl);
+
+	if (drain)
+		PipeStore(pl->stopSending, true);
+	else
+		PipeStore(pl->abortSending, true);
+	PipeSignal(&pl->sender);
+	pthread_join(pl->sendThread, NULL);
+	sent = !pl->sendFailed;
+
+	close(pl->main.wakeFd);
+	close(pl->receiver.wakeFd);
+	close(pl->sender.wakeFd);
+	for (i = 0; i < PIPE_QUEUE_LEN; i++)
+	{
+		if (pl->messages[i].buf)
+			wbfree(pl->messages[i].buf);
+	}
+	wbfree(pl->chunks);
+	wbfree(pl);
+	return sent;
+}
+
+/*
+ * Descriptor that becomes readable when the threads have moved on after
+ * WbPipeIsReady() returned false.
+ */
+int
+WbPipeGetSocket(WbPipeline *pl)
+{
+	return pl->main.wakeFd;
+}
+
+/*
+ * Returns true if the stream can continue without waiting: a message has
+ * been received, if wantReceive, or there is room for output, if
+ * wantFlush. Either thread having failed counts too, the next receive or
+ * flush raises the error.
+ */
+bool
+WbPipeIsReady(WbPipeline *pl, bool wantReceive, bool wantFlush)
+{
+	uint64 count;
+	bool ready;
+
+	if (read(pl->main.wakeFd, &count, sizeof(count)) < 0 &&
+			errno != EAGAIN && errno != EWOULDBLOCK)
+		error("Could not read wakeup handle of pipeline");
+
+	PipeStore(pl->main.waiting, true);
+	PipeFence();
+
+	ready = PipeLoad(pl->receiveFailed) || PipeLoad(pl->sendFailed) ||
+			(wantReceive && pl->master &&
+				pl->receiveNext != PipeLoad(pl->received.head)) ||
+			(wantFlush &&
+				pl->output.head - PipeLoad(pl->output.tail) < PIPE_QUEUE_LEN);
+
+	if (ready)
+		PipeStore(pl->main.waiting, false);
+	return ready;
+}
+
+/*
+ * Receive from master in the receiver thread, from now on until the end of
+ * the WAL or WbPipeStopReceiving(). Only natively read streams can be
+ * received from while the stream sends replies, otherwise the stream has
+ * to keep receiving itself.
+ */
+void
+WbPipeStartReceiving(WbPipeline *pl, MasterConn *master)
+{
+	Assert(pl->master == NULL);
+
+	if (!WbMcCanSendWhileReceiving(master))
+	{
+		log_info("Master connection can not be shared, receiving in the stream thread");
+		return;
+	}
+
+	pl->master = master;
+	pl->stopReceiving = false;
+	pl->receiveFailed = false;
+	pl->received.head = 0;
+	pl->received.tail = 0;
+	pl->receiveNext = 0;
+
+	if (pthread_create(&pl->receiveThread, NULL, PipeReceiverMain, pl))
+		error("Could not start receiver thread");
+}
+
+/*
+ * Stop the receiver, discarding what the stream has not taken yet. Needed
+ * before streaming from the master ends or restarts.
+ */
+void
+WbPipeStopReceiving(WbPipeline *pl)
+{
+	if (!pl->master)
+		return;
+
+	PipeStore(pl->stopReceiving, true);
+	PipeSignal(&pl->receiver);
+	pthread_join(pl->receiveThread, NULL);
+	pl->master = NULL;
+}
+
+bool
+WbPipeIsReceiving(WbPipeline *pl)
+{
+	return pl->master != NULL;
+}
+
+/*
+ * WbMcReceiveWalMessage() for a stream with a receiver thread. The message
+ * stays valid until the next call.
+ */
+bool
+WbPipeReceiveWalMessage(WbPipeline *pl, ReplMessage *msg)
+{
+	PipeQueue *q = &pl->received;
+
+	/* The previous message is not needed anymore */
+	if (q->tail != pl->receiveNext)
+	{
+		PipeStore(q->tail, pl->receiveNext);
+		PipeWake(&pl->receiver);
+	}
+
+	if (pl->receiveNext == PipeLoad(q->head))
+	{
+		if (PipeLoad(pl->receiveFailed))
+			error("Receiving WAL from master failed");
+		msg->type = MSG_NOTHING;
+		return false;
+	}
+
+	*msg = pl->messages[pl->receiveNext % PIPE_QUEUE_LEN].msg;
+	pl->receiveNext++;
+	return true;
+}
+
+/*
+ * Hand the pending output of the connection to the sender. What does not
+ * fit in the queue stays pending as ConnHasDataToFlush() tells, copied so
+ * that the caller's memory is free like after ConnFlush().
+ */
+void
+WbPipeFlush(WbPipeline *pl)
+{
+	PipeQueue *q = &pl->output;
+	WbConn conn = pl->conn;
+	bool queued = false;
+
+	if (PipeLoad(pl->sendFailed))
+		error("Could not send data to client");
+
+	while (ConnHasDataToFlush(conn) &&
+			q->head - PipeLoad(q->tail) < PIPE_QUEUE_LEN)
+	{
+		PipeChunk *chunk = &pl->chunks[q->head % PIPE_QUEUE_LEN];
+
+		chunk->len = ConnTakeOutput(conn, chunk->data, PIPE_CHUNK_SIZE);
+		PipeStore(q->head, q->head + 1);
+		queued = true;
+	}
+	ConnCopyExtData(conn);
+
+	if (queued)
+		PipeWake(&pl->sender);
+}
+
+static void*
+PipeReceiverMain(void *arg)
+{
+	WbPipeline *pl = arg;
+	PipeQueue *q = &pl->received;
+	jmp_buf handler;
+
+	/* The error has been logged, the stream raises its own */
+	if (setjmp(handler))
+	{
+		errorHandler = NULL;
+		PipeStore(pl->receiveFailed, true);
+		PipeWake(&pl->main);
+		return NULL;
+	}
+	errorHandler = &handler;
+
+	while (!PipeLoad(pl->stopReceiving))
+	{
+		uint32 head = q->head;
+		ReplMessage msg;
+
+		if (head - PipeLoad(q->tail) == PIPE_QUEUE_LEN)
+		{
+			/* Wait for the stream to take a message */
+			PipeStore(pl->receiver.waiting, true);
+			PipeFence();
+			if (head - PipeLoad(q->tail) == PIPE_QUEUE_LEN)
+				PipeSleep(&pl->receiver, -1, 0);
+			PipeStore(pl->receiver.waiting, false);
+			continue;
+		}
+
+		if (!WbMcReceiveWalMessage(pl->master, &msg))
+		{
+			PipeSleep(&pl->receiver, WbMcGetSocket(pl->master), POLLIN);
+			continue;
+		}
+
+		PipeCopyMessage(&pl->messages[head % PIPE_QUEUE_LEN], &msg);
+		PipeStore(q->head, head + 1);
+		PipeWake(&pl->main);
+
+		if (msg.type == MSG_END_OF_WAL)
+			break;
+	}
+
+	errorHandler = NULL;
+	return NULL;
+}
+
+/*
+ * Send out all queued chunks with one system call per round.
+ */
+static void*
+PipeSenderMain(void *arg)
+{
+	WbPipeline *pl = arg;
+	PipeQueue *q = &pl->output;
+	int fd = ConnGetSocket(pl->conn);
+	/* Bytes of the chunk at tail sent already */
+	int offset = 0;
+	/* Set once asked to stop */
+	TimestampTz deadline = 0;
+	jmp_buf handler;
+
+	/* The error has been logged, the stream raises its own */
+	if (setjmp(handler))
+	{
+		errorHandler = NULL;
+		PipeStore(pl->sendFailed, true);
+		PipeWake(&pl->main);
+		return NULL;
+	}
+	errorHandler = &handler;
+
+	while (!PipeLoad(pl->abortSending))
+	{
+		struct iovec iov[PIPE_QUEUE_LEN];
+		struct msghdr mh;
+		uint32 tail = q->tail;
+		uint32 head = PipeLoad(q->head);
+		uint32 i;
+		ssize_t r;
+
+		if (tail == head)
+		{
+			if (PipeLoad(pl->stopSending))
+				break;
+
+			/* Wait for the stream to hand over more */
+			PipeStore(pl->sender.waiting, true);
+			PipeFence();
+			if (tail == PipeLoad(q->head) && !PipeLoad(pl->stopSending))
+				PipeSleep(&pl->sender, -1, 0);
+			PipeStore(pl->sender.waiting, false);
+			continue;
+		}
+
+		/* A client that stopped reading must not keep the stream from ending */
+		if (PipeLoad(pl->stopSending))
+		{
+			TimestampTz now = GetCurrentTimestamp();
+
+			if (!deadline)
+				deadline = now + (TimestampTz) PIPE_DRAIN_TIMEOUT * 1000000;
+			else if (now >= deadline)
+				error("Client did not accept the remaining WAL within %d seconds",
+						PIPE_DRAIN_TIMEOUT);
+		}
+
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		for (i = tail; i != head; i++)
+		{
+			PipeChunk *chunk = &pl->chunks[i % PIPE_QUEUE_LEN];
+			int skip = i == tail ? offset : 0;
+
+			iov[mh.msg_iovlen].iov_base = chunk->data + skip;
+			iov[mh.msg_iovlen].iov_len = chunk->len - skip;
+			mh.msg_iovlen++;
+		}
+
+		r = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				PipeSleep(&pl->sender, fd, POLLOUT);
+				continue;
+			}
+
+			error("Could not send data to client: %s", strerror(errno));
+		}
+
+		/* Give back the chunks that are out completely */
+		while (tail != head && r >= pl->chunks[tail % PIPE_QUEUE_LEN].len - offset)
+		{
+			r -= pl->chunks[tail % PIPE_QUEUE_LEN].len - offset;
+			offset = 0;
+			tail++;
+		}
+		offset += r;
+
+		if (tail != q->tail)
+		{
+			PipeStore(q->tail, tail);
+			PipeWake(&pl->main);
+		}
+	}
+
+	errorHandler = NULL;
+	return NULL;
+}
+
+static void
+PipeCopyMessage(PipeMessage *entry, ReplMessage *msg)
+{
+	entry->msg = *msg;
+	if (msg->type != MSG_WAL_DATA)
+		return;
+
+	if (entry->bufSize < msg->dataLen)
+	{
+		entry->buf = rewballoc(entry->buf, msg->dataLen);
+		entry->bufSize = msg->dataLen;
+	}
+	memcpy(entry->buf, msg->data, msg->dataLen);
+	entry->msg.data = entry->buf;
+}
+
+static void
+PipeInitWaiter(PipeWaiter *waiter)
+{
+	waiter->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (waiter->wakeFd < 0)
+		error("Could not create wakeup handle for pipeline");
+	waiter->waiting = false;
+}
+
+/*
+ * Wait until woken up or, if fd is given, for events on it.
+ */
+static void
+PipeSleep(PipeWaiter *waiter, int fd, short events)
+{
+	struct pollfd fds[2];
+	int numfds = 0;
+	uint64 count;
+
+	fds[numfds].fd = waiter->wakeFd;
+	fds[numfds].events = POLLIN;
+	fds[numfds].revents = 0;
+	numfds++;
+
+	if (fd >= 0)
+	{
+		fds[numfds].fd = fd;
+		fds[numfds].events = events;
+		fds[numfds].revents = 0;
+		numfds++;
+	}
+
+	if (poll(fds, numfds, PIPE_POLL_TIMEOUT) < 0 && errno != EINTR)
+		error("poll failed in pipeline thread");
+
+	if (read(waiter->wakeFd, &count, sizeof(count)) < 0 &&
+			errno != EAGAIN && errno != EWOULDBLOCK)
+		error("Could not read wakeup handle of pipeline");
+}
+
+/*
+ * Wake up a thread that sleeps waiting for us to move a queue.
+ */
+static void
+PipeWake(PipeWaiter *waiter)
+{
+	PipeFence();
+	if (!PipeLoad(waiter->waiting))
+		return;
+
+	PipeStore(waiter->waiting, false);
+	PipeSignal(waiter);
+}
+
+static void
+PipeSignal(PipeWaiter *waiter)
+{
+	uint64 one = 1;
+
+	if (write(waiter->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		error("Could not wake up pipeline thread");
+}
@@ -0,0 +1,205 @@
+#include "wbpool.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wbclientconn.h"
+#include "wbconfig.h"
+#include "wboidcache.h"
+#include "wbsocket.h"
+#include "wbutils.h"
+
+#define MAX_CONNINFO_LEN 4000
+#define POOL_POLL_TIMEOUT 1000
+#define POOL_RECONNECT_INTERVAL 5
+
+/* Connections to master established before a client arrives */
+static MasterConn *warmReplConn = NULL;
+static MasterConn *warmQueryConn = NULL;
+
+static bool PoolNeedsQueryConn();
+static MasterConn* PoolConnect(bool replication);
+static void PoolCheckConn(MasterConn **master);
+
+/*
+ * Only keep a connection for looking up filtering OIDs if some
+ * configuration does filtering.
+ */
+static bool
+PoolNeedsQueryConn()
+{
+	wb_config_list_entry *listitem;
+
+	/* Looked up in the cache instead */
+	if (WbOidCacheEnabled())
+		return false;
+
+	for (listitem = CurrentConfig->configurations;
+		 listitem;
+		 listitem = listitem->next)
+	{
+		wb_config_entry *entry = &listitem->entry;
+		if (entry->filter.n_include_tablespaces + entry->filter.n_include_databases +
+				entry->filter.n_exclude_tablespaces + entry->filter.n_exclude_databases)
+			return true;
+	}
+	return false;
+}
+
+static MasterConn*
+PoolConnect(bool replication)
+{
+	char conninfo[MAX_CONNINFO_LEN+1];
+	char *buf = conninfo;
+	char *buf_end = &(conninfo[MAX_CONNINFO_LEN]);
+
+	memset(conninfo, 0, sizeof(conninfo));
+
+	if (CurrentConfig->master.host)
+		buf += snprintf(buf, buf_end - buf, "host=%s ", CurrentConfig->master.host);
+
+	if (CurrentConfig->master.port)
+		buf += snprintf(buf, buf_end - buf, "port=%d ", CurrentConfig->master.port);
+
+	if (CurrentConfig->master.user)
+		buf += snprintf(buf, buf_end - buf, "user=%s ", CurrentConfig->master.user);
+
+	if (replication)
+		buf += snprintf(buf, buf_end - buf, "dbname=replication replication=true application_name=walbouncer");
+	else
+		buf += snprintf(buf, buf_end - buf, "dbname=postgres application_name=walbouncer");
+
+	log_debug1("Worker connecting ahead of time to %s", conninfo);
+	return WbMcTryOpenConnection(conninfo);
+}
+
+/*
+ * Drop an idle connection the master has closed, e.g. after a failover.
+ */
+static void
+PoolCheckConn(MasterConn **master)
+{
+	if (*master && !WbMcCheckConnection(*master))
+	{
+		log_info("Idle master connection was lost");
+		WbMcCloseConnection(*master);
+		*master = NULL;
+	}
+}
+
+/*
+ * Wait for a client. With replication, a replication connection is kept
+ * ready too.
+ */
+void
+WbPoolWorkerMain(int channel, bool replication)
+{
+	bool needQueryConn = PoolNeedsQueryConn();
+	time_t lastAttempt = 0;
+	WbConn conn = NULL;
+
+	while (!conn)
+	{
+		struct pollfd fds[3];
+		int numfds = 0;
+		int i;
+
+		if (!DaemonIsAlive())
+			error("Main process died, exiting!");
+
+		if (((replication && !warmReplConn) || (needQueryConn && !warmQueryConn)) &&
+				time(NULL) - lastAttempt >= POOL_RECONNECT_INTERVAL)
+		{
+			lastAttempt = time(NULL);
+			if (replication && !warmReplConn)
+				warmReplConn = PoolConnect(true);
+			if (needQueryConn && !warmQueryConn)
+				warmQueryConn = PoolConnect(false);
+		}
+
+		fds[numfds].fd = channel;
+		fds[numfds].events = POLLIN;
+		fds[numfds].revents = 0;
+		numfds++;
+
+		if (warmReplConn)
+		{
+			fds[numfds].fd = WbMcGetSocket(warmReplConn);
+			fds[numfds].events = POLLIN;
+			fds[numfds].revents = 0;
+			numfds++;
+		}
+		if (warmQueryConn)
+		{
+			fds[numfds].fd = WbMcGetSocket(warmQueryConn);
+			fds[numfds].events = POLLIN;
+			fds[numfds].revents = 0;
+			numfds++;
+		}
+
+		if (poll(fds, numfds, POOL_POLL_TIMEOUT) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error("poll failed in worker process");
+		}
+
+		for (i = 1; i < numfds; i++)
+		{
+			if (fds[i].revents)
+			{
+				PoolCheckConn(&warmReplConn);
+				PoolCheckConn(&warmQueryConn);
+				break;
+			}
+		}
+
+		if (fds[0].revents)
+			conn = ConnReceiveFromProcess(channel);
+	}
+
+	close(channel);
+
+	conn->master_host = CurrentConfig->master.host;
+	conn->master_port = CurrentConfig->master.port;
+
+	log_debug2("Worker process received new connection");
+
+	WbCCInitConnection(conn);
+
+	WbCCPerformAuthentication(conn);
+
+	WbCCCommandLoop(conn);
+
+	CloseConn(conn);
+
+	exit(0);
+}
+
+/*
+ * Hand out the connection established ahead of time if it can be used for
+ * user. Returns NULL if there is none, the caller has to connect on its own.
+ */
+MasterConn*
+WbPoolTakeMasterConn(const char *user, bool replication)
+{
+	MasterConn **warm = replication ? &warmReplConn : &warmQueryConn;
+	MasterConn *master = *warm;
+
+	if (!master)
+		return NULL;
+	*warm = NULL;
+
+	if (!user || strcmp(WbMcGetUser(master), user) != 0 ||
+			!WbMcCheckConnection(master))
+	{
+		WbMcCloseConnection(master);
+		return NULL;
+	}
+
+	log_debug1("Using master connection established ahead of time");
+	return master;
+}
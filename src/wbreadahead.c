@@ -0,0 +1,265 @@
+#include "wbreadahead.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wbconfig.h"
+#include "wbutils.h"
+
+#define RA_MAX_PATH 1024
+
+typedef struct RaEntry {
+	struct RaEntry *next;
+	XLogRecPtr dataStart;
+	XLogRecPtr walEnd;
+	TimestampTz sendTime;
+	int len;
+	char data[1];
+} RaEntry;
+
+/* Header of a message in the spill file, followed by the data */
+typedef struct {
+	XLogRecPtr dataStart;
+	XLogRecPtr walEnd;
+	TimestampTz sendTime;
+	int len;
+} RaSpillHeader;
+
+struct WbReadAhead {
+	RaEntry *head;
+	RaEntry *tail;
+	size_t memUsed;
+	size_t memLimit;
+
+	/* Messages newer than the ones in memory, once we have started spilling */
+	int spillFd;
+	off_t spillReadPtr;
+	off_t spillWritePtr;
+	off_t spillLimit;
+
+	/* Message returned by WbRaGet(), valid until the next call */
+	RaEntry *current;
+	char *readBuffer;
+	int readBufferLen;
+};
+
+static void RaSpill(WbReadAhead *ra, FilterOutput *out);
+static bool RaUnspill(WbReadAhead *ra, FilterOutput *out);
+static void RaWrite(WbReadAhead *ra, const char *buf, int len);
+static void RaRead(WbReadAhead *ra, char *buf, int len);
+
+WbReadAhead*
+WbRaCreate()
+{
+	WbReadAhead *ra;
+
+	if (!CurrentConfig->read_ahead.buffer_size)
+		return NULL;
+
+	ra = wballoc0(sizeof(WbReadAhead));
+	ra->memLimit = (size_t) CurrentConfig->read_ahead.buffer_size * 1024 * 1024;
+	ra->spillFd = -1;
+	if (CurrentConfig->read_ahead.spill_directory)
+		ra->spillLimit = (off_t) CurrentConfig->read_ahead.spill_size * 1024 * 1024;
+
+	return ra;
+}
+
+void
+WbRaFree(WbReadAhead *ra)
+{
+	while (ra->head)
+	{
+		RaEntry *next = ra->head->next;
+		wbfree(ra->head);
+		ra->head = next;
+	}
+	if (ra->current)
+		wbfree(ra->current);
+	if (ra->readBuffer)
+		wbfree(ra->readBuffer);
+	if (ra->spillFd >= 0)
+		close(ra->spillFd);
+	wbfree(ra);
+}
+
+bool
+WbRaIsEmpty(WbReadAhead *ra)
+{
+	return !ra->head && ra->spillReadPtr == ra->spillWritePtr;
+}
+
+bool
+WbRaIsFull(WbReadAhead *ra)
+{
+	return ra->memUsed >= ra->memLimit && ra->spillWritePtr >= ra->spillLimit;
+}
+
+/*
+ * Add a message to the end of the queue. The data is copied.
+ */
+void
+WbRaPut(WbReadAhead *ra, FilterOutput *out)
+{
+	int len = out->prefixLen + out->dataLen;
+	RaEntry *entry;
+
+	/* Once spilling, newer messages have to go after the spilled ones */
+	if (ra->spillLimit && (ra->spillWritePtr > ra->spillReadPtr ||
+			ra->memUsed + len > ra->memLimit))
+	{
+		RaSpill(ra, out);
+		return;
+	}
+
+	entry = wballoc(offsetof(RaEntry, data) + len);
+	entry->next = NULL;
+	entry->dataStart = out->dataStart;
+	entry->walEnd = out->walEnd;
+	entry->sendTime = out->sendTime;
+	entry->len = len;
+	if (out->prefixLen)
+		memcpy(entry->data, out->prefix, out->prefixLen);
+	memcpy(entry->data + out->prefixLen, out->data, out->dataLen);
+
+	if (ra->tail)
+		ra->tail->next = entry;
+	else
+		ra->head = entry;
+	ra->tail = entry;
+	ra->memUsed += len;
+}
+
+/*
+ * Take the oldest message from the queue. Its data stays valid until the
+ * next call. Returns false if the queue is empty.
+ */
+bool
+WbRaGet(WbReadAhead *ra, FilterOutput *out)
+{
+	RaEntry *entry = ra->head;
+
+	if (ra->current)
+	{
+		wbfree(ra->current);
+		ra->current = NULL;
+	}
+
+	if (!entry)
+		return RaUnspill(ra, out);
+
+	ra->head = entry->next;
+	if (!ra->head)
+		ra->tail = NULL;
+	ra->memUsed -= entry->len;
+	ra->current = entry;
+
+	out->dataStart = entry->dataStart;
+	out->walEnd = entry->walEnd;
+	out->sendTime = entry->sendTime;
+	out->prefix = NULL;
+	out->prefixLen = 0;
+	out->data = entry->data;
+	out->dataLen = entry->len;
+	return true;
+}
+
+static void
+RaSpill(WbReadAhead *ra, FilterOutput *out)
+{
+	RaSpillHeader header;
+
+	if (ra->spillFd < 0)
+	{
+		char path[RA_MAX_PATH];
+
+		snprintf(path, RA_MAX_PATH, "%s/walbouncer-readahead-XXXXXX",
+				CurrentConfig->read_ahead.spill_directory);
+		ra->spillFd = mkstemp(path);
+		if (ra->spillFd < 0)
+			error("Could not create read-ahead spill file %s: %s", path, strerror(errno));
+		/* Nobody else needs to see it, have it removed when we close it */
+		unlink(path);
+	}
+
+	header.dataStart = out->dataStart;
+	header.walEnd = out->walEnd;
+	header.sendTime = out->sendTime;
+	header.len = out->prefixLen + out->dataLen;
+
+	RaWrite(ra, (char*) &header, sizeof(header));
+	if (out->prefixLen)
+		RaWrite(ra, out->prefix, out->prefixLen);
+	RaWrite(ra, out->data, out->dataLen);
+}
+
+static bool
+RaUnspill(WbReadAhead *ra, FilterOutput *out)
+{
+	RaSpillHeader header;
+
+	if (ra->spillReadPtr == ra->spillWritePtr)
+		return false;
+
+	RaRead(ra, (char*) &header, sizeof(header));
+	if (header.len > ra->readBufferLen)
+	{
+		ra->readBuffer = rewballoc(ra->readBuffer, header.len);
+		ra->readBufferLen = header.len;
+	}
+	RaRead(ra, ra->readBuffer, header.len);
+
+	/* Start from the beginning of the file once it has been read */
+	if (ra->spillReadPtr == ra->spillWritePtr)
+	{
+		ra->spillReadPtr = 0;
+		ra->spillWritePtr = 0;
+		if (ftruncate(ra->spillFd, 0))
+			log_warning("Could not truncate read-ahead spill file: %s", strerror(errno));
+	}
+
+	out->dataStart = header.dataStart;
+	out->walEnd = header.walEnd;
+	out->sendTime = header.sendTime;
+	out->prefix = NULL;
+	out->prefixLen = 0;
+	out->data = ra->readBuffer;
+	out->dataLen = header.len;
+	return true;
+}
+
+static void
+RaWrite(WbReadAhead *ra, const char *buf, int len)
+{
+	while (len > 0)
+	{
+		ssize_t rc = pwrite(ra->spillFd, buf, len, ra->spillWritePtr);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error("Could not write to read-ahead spill file: %s", strerror(errno));
+		}
+		buf += rc;
+		len -= rc;
+		ra->spillWritePtr += rc;
+	}
+}
+
+static void
+RaRead(WbReadAhead *ra, char *buf, int len)
+{
+	while (len > 0)
+	{
+		ssize_t rc = pread(ra->spillFd, buf, len, ra->spillReadPtr);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			error("Could not read from read-ahead spill file");
+		buf += rc;
+		len -= rc;
+		ra->spillReadPtr += rc;
+	}
+}
@@ -5,12 +5,15 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <linux/errqueue.h>
 
 #include "wbsocket.h"
 #include "wbutils.h"
@@ -19,6 +22,9 @@
 #define SEND_BUFFER_INIT_SIZE (256*1024)
 #define RECV_BUFFER_SIZE 8192
 
+static void ConnEnsureFreeSpace(WbConn conn, int amount);
+static void ConnReapZeroCopy(WbConn conn);
+
 WbSocket
 OpenServerSocket(int port)
 {
@@ -60,23 +66,12 @@ OpenServerSocket(int port)
 	return sock;
 }
 
-WbConn
-ConnCreate(WbSocket server)
+static WbConn
+ConnInitialize(int fd)
 {
-	struct sockaddr_storage their_addr;
-	socklen_t addr_size = sizeof(struct sockaddr_storage);
 	WbConn conn = wballoc0(sizeof(WbPortStruct));
 
-	log_debug2("Waiting for connections...");
-	conn->fd = accept(server->fd, (struct sockaddr *) &their_addr, &addr_size);
-	//FIXME: handle errors here
-
-	if (their_addr.ss_family == AF_INET)
-	{
-		struct sockaddr_in* ip_addr = ((struct sockaddr_in*) &their_addr);
-		conn->client.addr = ip_addr->sin_addr.s_addr;
-		conn->client.port = ip_addr->sin_port;
-	}
+	conn->fd = fd;
 
 	conn->recvBuffer = wballoc(RECV_BUFFER_SIZE);
 	conn->recvPointer = 0;
@@ -99,12 +94,131 @@ ConnCreate(WbSocket server)
 	return conn;
 }
 
+WbConn
+ConnCreate(WbSocket server)
+{
+	struct sockaddr_storage their_addr;
+	socklen_t addr_size = sizeof(struct sockaddr_storage);
+	WbConn conn;
+	int fd;
+
+	log_debug2("Waiting for connections...");
+	fd = accept(server->fd, (struct sockaddr *) &their_addr, &addr_size);
+	//FIXME: handle errors here
+
+	conn = ConnInitialize(fd);
+
+	if (their_addr.ss_family == AF_INET)
+	{
+		struct sockaddr_in* ip_addr = ((struct sockaddr_in*) &their_addr);
+		conn->client.addr = ip_addr->sin_addr.s_addr;
+		conn->client.port = ip_addr->sin_port;
+	}
+
+	return conn;
+}
+
+/*
+ * Pass the client socket of conn to another process over a Unix domain
+ * socket. The caller still has to close its own copy of the connection.
+ */
+bool
+ConnSendToProcess(int channel, WbConn conn)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+
+	// Client address travels along with the socket
+	iov.iov_base = &(conn->client);
+	iov.iov_len = sizeof(conn->client);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &(conn->fd), sizeof(int));
+
+	while (sendmsg(channel, &msg, 0) < 0)
+	{
+		if (errno == EINTR)
+			continue;
+		log_warning("Could not pass connection to worker process: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Receive a client connection passed with ConnSendToProcess(). Returns NULL
+ * if there is nothing to receive.
+ */
+WbConn
+ConnReceiveFromProcess(int channel)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	WbConn conn;
+	int fd;
+	ssize_t r;
+	struct {
+		uint32 addr;
+		uint16 port;
+	} client;
+
+	memset(&msg, 0, sizeof(msg));
+
+	iov.iov_base = &client;
+	iov.iov_len = sizeof(client);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	r = recvmsg(channel, &msg, MSG_DONTWAIT);
+	if (r < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return NULL;
+		error("Could not receive connection from main process");
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (r != sizeof(client) || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+			cmsg->cmsg_type != SCM_RIGHTS)
+		error("Invalid connection handoff from main process");
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	conn = ConnInitialize(fd);
+	conn->client.addr = client.addr;
+	conn->client.port = client.port;
+
+	return conn;
+}
+
 bool
 ConnHasDataToFlush(WbConn conn)
 {
-	return conn->sendBufFlushPtr < conn->sendBufLen;
+	if (conn->zeroCopyOutstanding)
+		ConnReapZeroCopy(conn);
+	return conn->sendBufFlushPtr < conn->sendBufLen || conn->sendExtLen > 0;
 }
 
+/*
+ * Send out sendBuffer followed by the external data with one system call
+ * per round. What the socket does not take right away in async mode is
+ * copied into sendBuffer, so the caller's memory is free when we return.
+ */
 int
 ConnFlush(WbConn conn, ConnFlushMode mode)
 {
@@ -119,12 +233,35 @@ ConnFlush(WbConn conn, ConnFlushMode mode)
 	if (mode == FLUSH_ASYNC)
 		flags |= MSG_DONTWAIT;
 
-	while (remaining > 0)
+	while (remaining > 0 || conn->sendExtLen > 0)
 	{
+		struct iovec iov[2];
+		struct msghdr mh;
+		int sendFlags = flags;
 		int r;
-		log_debug1("Conn: Sending to client %d bytes of data", remaining);
+		log_debug1("Conn: Sending to client %d bytes of data", remaining + conn->sendExtLen);
+
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		if (remaining > 0)
+		{
+			iov[mh.msg_iovlen].iov_base = conn->sendBuffer + sent;
+			iov[mh.msg_iovlen].iov_len = remaining;
+			mh.msg_iovlen++;
+		}
+		if (conn->sendExtLen > 0)
+		{
+			iov[mh.msg_iovlen].iov_base = (void *) conn->sendExtData;
+			iov[mh.msg_iovlen].iov_len = conn->sendExtLen;
+			mh.msg_iovlen++;
+#ifdef MSG_ZEROCOPY
+			if (conn->sendExtStable && conn->zeroCopyThreshold &&
+					conn->sendExtLen >= conn->zeroCopyThreshold)
+				sendFlags |= MSG_ZEROCOPY;
+#endif
+		}
 
-		r = send(conn->fd, conn->sendBuffer + sent, remaining, flags);
+		r = sendmsg(conn->fd, &mh, sendFlags);
 		if (r <= 0)
 		{
 			if (errno == EINTR)
@@ -136,17 +273,33 @@ ConnFlush(WbConn conn, ConnFlushMode mode)
 					error("Socket returned %d on a blocking send call", errno);
 				log_debug1("Sending out data to client would have blocked.");
 				conn->sendBufFlushPtr = sent;
+				ConnCopyExtData(conn);
 				return 0;
 			}
 
 			error("Could not send data to client");
 			return EOF;
 		}
-		sent += r;
-		if (r < remaining)
-			log_debug1("Sent out %d/%d bytes", sent, remaining);
-		remaining -= r;
+		if (sendFlags != flags)
+			conn->zeroCopyOutstanding++;
+		if (r < remaining + conn->sendExtLen)
+			log_debug1("Sent out %d/%d bytes", r, remaining + conn->sendExtLen);
+		if (r <= remaining)
+		{
+			sent += r;
+			remaining -= r;
+		}
+		else
+		{
+			r -= remaining;
+			sent += remaining;
+			remaining = 0;
+			conn->sendExtData += r;
+			conn->sendExtLen -= r;
+		}
 	}
+	conn->sendExtData = NULL;
+	conn->sendExtLen = 0;
 	conn->sendBufFlushPtr = 0;
 	conn->sendBufLen = 0;
 	conn->sendBufMsgLenPtr = -1;
@@ -158,6 +311,43 @@ ConnFlush(WbConn conn, ConnFlushMode mode)
 	return 0;
 }
 
+/*
+ * Move up to len bytes of pending output to buf, for sending it from
+ * another thread. Returns the number of bytes moved. The external data is
+ * still referenced afterwards unless it was moved completely, see
+ * ConnCopyExtData().
+ */
+int
+ConnTakeOutput(WbConn conn, char *buf, int len)
+{
+	int taken = conn->sendBufLen - conn->sendBufFlushPtr;
+	int n;
+
+	Assert(conn->sendBufMsgLenPtr == -1);
+
+	if (taken > len)
+		taken = len;
+	memcpy(buf, conn->sendBuffer + conn->sendBufFlushPtr, taken);
+	conn->sendBufFlushPtr += taken;
+
+	if (conn->sendBufFlushPtr < conn->sendBufLen)
+		return taken;
+
+	conn->sendBufFlushPtr = 0;
+	conn->sendBufLen = 0;
+
+	n = conn->sendExtLen < len - taken ? conn->sendExtLen : len - taken;
+	if (n > 0)
+	{
+		memcpy(buf + taken, conn->sendExtData, n);
+		conn->sendExtData += n;
+		conn->sendExtLen -= n;
+		taken += n;
+	}
+
+	return taken;
+}
+
 bool
 ConnSetNonBlocking(WbConn conn, bool nonblocking)
 {
@@ -291,6 +481,13 @@ void
 CloseConn(WbConn conn)
 {
 	close(conn->fd);
+	wbfree(conn->recvBuffer);
+	wbfree(conn->sendBuffer);
+	wbfree(conn->database_name);
+	wbfree(conn->user_name);
+	wbfree(conn->application_name);
+	wbfree(conn->cmdline_options);
+	wbfree(conn->guc_options);
 	free(conn);
 }
 
@@ -307,14 +504,132 @@ static
 void
 ConnEnsureFreeSpace(WbConn conn, int amount)
 {
+	// Anything added goes after the external data
+	if (conn->sendExtLen > 0)
+		ConnCopyExtData(conn);
+
 	if (conn->sendBufSize - conn->sendBufLen < amount)
 	{
 		int new_size = conn->sendBufSize*2;
+
+		while (new_size - conn->sendBufLen < amount)
+			new_size *= 2;
 		conn->sendBuffer = rewballoc(conn->sendBuffer, new_size);
 		conn->sendBufSize = new_size;
 	}
 }
 
+/*
+ * Take a copy of the unsent external data, the caller may reuse its memory.
+ */
+void
+ConnCopyExtData(WbConn conn)
+{
+	int n = conn->sendExtLen;
+
+	if (n == 0)
+		return;
+
+	conn->sendExtLen = 0;
+	ConnEnsureFreeSpace(conn, n);
+	memcpy(conn->sendBuffer + conn->sendBufLen, conn->sendExtData, n);
+	conn->sendBufLen += n;
+	conn->sendExtData = NULL;
+}
+
+/*
+ * Read completion notifications of zero copy sends. We only send data that
+ * is never modified that way, so there is nothing to release, but unread
+ * notifications would use up the socket's memory.
+ */
+static void
+ConnReapZeroCopy(WbConn conn)
+{
+	char control[128];
+	struct msghdr mh;
+	struct cmsghdr *cm;
+
+	while (conn->zeroCopyOutstanding)
+	{
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+
+		if (recvmsg(conn->fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+		{
+			struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cm);
+
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// Notifications cover a range of sends
+			if (serr->ee_data - serr->ee_info + 1 >= conn->zeroCopyOutstanding)
+				conn->zeroCopyOutstanding = 0;
+			else
+				conn->zeroCopyOutstanding -= serr->ee_data - serr->ee_info + 1;
+		}
+	}
+}
+
+/*
+ * Use MSG_ZEROCOPY for stable data of at least threshold bytes. Returns
+ * false if the kernel does not support it.
+ */
+bool
+ConnEnableZeroCopy(WbConn conn, int threshold)
+{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	int one = 1;
+
+	if (setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+	{
+		conn->zeroCopyThreshold = threshold;
+		return true;
+	}
+#endif
+	return false;
+}
+
+/* Unsent data kept in the socket buffer of a low latency connection */
+#define LOW_LATENCY_NOTSENT_LOWAT 16384
+
+/*
+ * Send small writes of a TCP socket right away and keep little unsent data
+ * queued, so that urgent messages don't wait behind bulk data. busyPoll
+ * microseconds are spent busy polling the device queue before sleeping on
+ * the socket, 0 disables it. Returns false if any of it is not supported.
+ */
+bool
+SocketSetLowLatency(int fd, int busyPoll)
+{
+	int one = 1;
+	bool ok = true;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+		ok = false;
+#ifdef TCP_NOTSENT_LOWAT
+	{
+		int lowat = LOW_LATENCY_NOTSENT_LOWAT;
+
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)))
+			ok = false;
+	}
+#endif
+	if (busyPoll)
+	{
+#ifdef SO_BUSY_POLL
+		/* Raising it above net.core.busy_read needs CAP_NET_ADMIN */
+		if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll)))
+			ok = false;
+#else
+		ok = false;
+#endif
+	}
+	return ok;
+}
+
 int
 ConnGetSocket(WbConn conn)
 {
@@ -336,8 +651,10 @@ ConnBeginMessage(WbConn conn, char type)
 void
 ConnSendInt(WbConn conn, int i, int b)
 {
-	char *target = conn->sendBuffer + conn->sendBufLen;
+	char *target;
+
 	ConnEnsureFreeSpace(conn, b);
+	target = conn->sendBuffer + conn->sendBufLen;
 
 	switch (b)
 	{
@@ -391,15 +708,34 @@ ConnSendBytes(WbConn conn, const char *str, int n)
 	conn->sendBufLen += n;
 }
 
+/*
+ * Append n bytes to the message without copying them. The data must stay
+ * unchanged until the next ConnFlush, or for good if stable is set, which
+ * allows zero copy sends. Nothing else may be added to the message after
+ * it.
+ */
+void
+ConnSendBytesNoCopy(WbConn conn, const char *data, int n, bool stable)
+{
+	Assert(conn->sendBufMsgLenPtr > 0);
+
+	ConnCopyExtData(conn);
+	conn->sendExtData = data;
+	conn->sendExtLen = n;
+	conn->sendExtStable = stable;
+}
+
 void
 ConnEndMessage(WbConn conn)
 {
 	uint32 n32;
+	int len;
 
 	Assert(conn->sendBufMsgLenPtr > 0);
 
-	n32 = htonl((uint32) (conn->sendBufLen - conn->sendBufMsgLenPtr));
-	log_debug3("Buffering message %c with length %d", conn->sendBuffer[conn->sendBufMsgLenPtr-1], (conn->sendBufLen - conn->sendBufMsgLenPtr));
+	len = conn->sendBufLen + conn->sendExtLen - conn->sendBufMsgLenPtr;
+	n32 = htonl((uint32) len);
+	log_debug3("Buffering message %c with length %d", conn->sendBuffer[conn->sendBufMsgLenPtr-1], len);
 
 	// TODO: handle unaligned access
 	*((uint32*)(conn->sendBuffer + conn->sendBufMsgLenPtr)) = n32;
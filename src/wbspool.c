@@ -0,0 +1,438 @@
+#include "wbspool.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wbconfig.h"
+#include "wbpgtypes.h"
+#include "wbutils.h"
+
+#define SPOOL_READ_CHUNK (128*1024)
+#define SPOOL_MAX_PATH 1024
+#define SPOOL_PARTIAL_SUFFIX ".partial"
+
+struct WbSpoolReader {
+	TimeLineID tli;
+	XLogRecPtr readPtr;
+	/* Segment currently mapped, or NULL */
+	char *map;
+	uint64 segNo;
+};
+
+typedef struct {
+	TimeLineID tli;
+	uint64 segNo;
+} SpoolSegment;
+
+static char *spoolDir = NULL;
+
+/* Only used in the hub process */
+static int spoolFd = -1;
+static TimeLineID spoolTli = 0;
+static uint64 spoolSegNo = 0;
+static XLogRecPtr spoolWritePtr = 0;
+
+static void SpoolSegmentPath(char *path, TimeLineID tli, uint64 segNo, bool partial);
+static bool SpoolOpenSegment(TimeLineID tli, XLogRecPtr pos);
+static void SpoolDiscardSegment();
+static void SpoolCompleteSegment();
+static void SpoolRemoveOldSegments();
+static bool SpoolMapSegment(WbSpoolReader *reader);
+
+void
+WbSpoolInit()
+{
+	if (!CurrentConfig->hub.enabled || !CurrentConfig->hub.spool_directory)
+		return;
+
+	spoolDir = CurrentConfig->hub.spool_directory;
+	if (mkdir(spoolDir, 0700) && errno != EEXIST)
+		error("Could not create spool directory %s: %s", spoolDir, strerror(errno));
+
+	log_info("Spooling WAL to %s, keeping up to %d MB",
+			spoolDir, CurrentConfig->hub.spool_size);
+}
+
+bool
+WbSpoolEnabled()
+{
+	return spoolDir != NULL;
+}
+
+static void
+SpoolSegmentPath(char *path, TimeLineID tli, uint64 segNo, bool partial)
+{
+	char fname[MAXFNAMELEN];
+
+	XLogFileName(fname, tli, segNo);
+	snprintf(path, SPOOL_MAX_PATH, "%s/%s%s", spoolDir, fname,
+			partial ? SPOOL_PARTIAL_SUFFIX : "");
+}
+
+/*
+ * Start writing the segment that begins at pos.
+ */
+static bool
+SpoolOpenSegment(TimeLineID tli, XLogRecPtr pos)
+{
+	char path[SPOOL_MAX_PATH];
+
+	XLByteToSeg(pos, spoolSegNo);
+	spoolTli = tli;
+	SpoolSegmentPath(path, tli, spoolSegNo, true);
+
+	spoolFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (spoolFd < 0)
+	{
+		log_warning("Could not create spool file %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	spoolWritePtr = pos;
+	return true;
+}
+
+/*
+ * Throw away the segment being written, e.g. when the stream skipped ahead.
+ * Spooling continues at the next segment boundary.
+ */
+static void
+SpoolDiscardSegment()
+{
+	char path[SPOOL_MAX_PATH];
+
+	SpoolSegmentPath(path, spoolTli, spoolSegNo, true);
+	close(spoolFd);
+	unlink(path);
+	spoolFd = -1;
+	spoolWritePtr = 0;
+}
+
+static void
+SpoolCompleteSegment()
+{
+	char partialPath[SPOOL_MAX_PATH];
+	char path[SPOOL_MAX_PATH];
+	int dirfd;
+
+	SpoolSegmentPath(partialPath, spoolTli, spoolSegNo, true);
+	SpoolSegmentPath(path, spoolTli, spoolSegNo, false);
+
+	if (fdatasync(spoolFd))
+	{
+		log_warning("Could not sync spool file %s: %s", partialPath, strerror(errno));
+		SpoolDiscardSegment();
+		return;
+	}
+	close(spoolFd);
+	spoolFd = -1;
+
+	if (rename(partialPath, path))
+	{
+		log_warning("Could not rename spool file %s: %s", partialPath, strerror(errno));
+		unlink(partialPath);
+		spoolWritePtr = 0;
+		return;
+	}
+
+	/* Spooled segments are served again after a restart */
+	dirfd = open(spoolDir, O_RDONLY);
+	if (dirfd >= 0)
+	{
+		fsync(dirfd);
+		close(dirfd);
+	}
+
+	spoolWritePtr = 0;
+	log_debug1("Spooled segment %s", path);
+
+	SpoolRemoveOldSegments();
+}
+
+static int
+SpoolCompareSegments(const void *a, const void *b)
+{
+	const SpoolSegment *sa = a;
+	const SpoolSegment *sb = b;
+
+	if (sa->segNo != sb->segNo)
+		return sa->segNo < sb->segNo ? -1 : 1;
+	if (sa->tli != sb->tli)
+		return sa->tli < sb->tli ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Remove the oldest complete segments while the spool is over its size
+ * limit.
+ */
+static void
+SpoolRemoveOldSegments()
+{
+	DIR *dir;
+	struct dirent *de;
+	SpoolSegment *segments = NULL;
+	int numSegments = 0;
+	int maxSegments = 0;
+	int keep = (int) (((uint64) CurrentConfig->hub.spool_size * 1024 * 1024) / XLogSegSize);
+	int i;
+
+	dir = opendir(spoolDir);
+	if (!dir)
+	{
+		log_warning("Could not open spool directory %s: %s", spoolDir, strerror(errno));
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL)
+	{
+		if (strlen(de->d_name) != 24 ||
+				strspn(de->d_name, "0123456789ABCDEF") != 24)
+			continue;
+
+		if (numSegments == maxSegments)
+		{
+			maxSegments = maxSegments ? maxSegments * 2 : 64;
+			segments = rewballoc(segments, sizeof(SpoolSegment) * maxSegments);
+		}
+		XLogFromFileName(de->d_name, &(segments[numSegments].tli),
+				&(segments[numSegments].segNo));
+		numSegments++;
+	}
+	closedir(dir);
+
+	if (numSegments > keep)
+	{
+		qsort(segments, numSegments, sizeof(SpoolSegment), SpoolCompareSegments);
+
+		for (i = 0; i < numSegments - keep; i++)
+		{
+			char path[SPOOL_MAX_PATH];
+
+			SpoolSegmentPath(path, segments[i].tli, segments[i].segNo, false);
+			log_debug1("Removing spool file %s", path);
+			if (unlink(path) && errno != ENOENT)
+				log_warning("Could not remove spool file %s: %s", path, strerror(errno));
+		}
+	}
+
+	if (segments)
+		wbfree(segments);
+}
+
+/*
+ * Append WAL received by the hub to the spool. Errors are not fatal, the
+ * affected segment is just not spooled.
+ */
+void
+WbSpoolWrite(TimeLineID tli, XLogRecPtr dataStart, const char *data, int len)
+{
+	if (!spoolDir)
+		return;
+
+	while (len > 0)
+	{
+		XLogRecPtr segEnd;
+		int chunk;
+		int written = 0;
+
+		if (spoolFd >= 0 && (dataStart != spoolWritePtr || tli != spoolTli))
+			SpoolDiscardSegment();
+
+		if (spoolFd < 0)
+		{
+			/* Only spool whole segments */
+			uint32 offset = dataStart % XLogSegSize;
+			if (offset)
+			{
+				int skip = (XLogSegSize - offset) < len ? (XLogSegSize - offset) : len;
+				dataStart += skip;
+				data += skip;
+				len -= skip;
+				continue;
+			}
+			if (!SpoolOpenSegment(tli, dataStart))
+				return;
+		}
+
+		segEnd = dataStart - dataStart % XLogSegSize + XLogSegSize;
+		chunk = (segEnd - dataStart) < len ? (segEnd - dataStart) : len;
+
+		while (written < chunk)
+		{
+			ssize_t rc = pwrite(spoolFd, data + written, chunk - written,
+					dataStart % XLogSegSize + written);
+			if (rc < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				log_warning("Could not write to spool: %s", strerror(errno));
+				SpoolDiscardSegment();
+				return;
+			}
+			written += rc;
+		}
+
+		dataStart += chunk;
+		data += chunk;
+		len -= chunk;
+		spoolWritePtr = dataStart;
+
+		if (dataStart == segEnd)
+			SpoolCompleteSegment();
+	}
+}
+
+/*
+ * Start reading WAL at startPos from the spool. Returns NULL if the segment
+ * containing startPos is not spooled.
+ */
+WbSpoolReader*
+WbSpoolOpen(TimeLineID tli, XLogRecPtr startPos)
+{
+	WbSpoolReader *reader;
+
+	if (!spoolDir)
+		return NULL;
+
+	reader = wballoc0(sizeof(WbSpoolReader));
+	reader->tli = tli;
+	reader->readPtr = startPos;
+
+	if (!SpoolMapSegment(reader))
+	{
+		wbfree(reader);
+		return NULL;
+	}
+
+	log_info("Streaming from spool at %X/%X", FormatRecPtr(startPos));
+	return reader;
+}
+
+void
+WbSpoolClose(WbSpoolReader *reader)
+{
+	if (reader->map)
+		munmap(reader->map, XLogSegSize);
+	wbfree(reader);
+}
+
+/*
+ * Map the segment containing readPtr. The mapping is private because the
+ * filter rewrites WAL in place, only pages that are modified get copied.
+ */
+static bool
+SpoolMapSegment(WbSpoolReader *reader)
+{
+	char path[SPOOL_MAX_PATH];
+	struct stat st;
+	uint64 segNo;
+	char *map;
+	int fd;
+
+	XLByteToSeg(reader->readPtr, segNo);
+	if (reader->map && reader->segNo == segNo)
+		return true;
+
+	if (reader->map)
+	{
+		munmap(reader->map, XLogSegSize);
+		reader->map = NULL;
+	}
+
+	SpoolSegmentPath(path, reader->tli, segNo, false);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) || st.st_size != XLogSegSize)
+	{
+		log_warning("Ignoring spool file %s with invalid size", path);
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, XLogSegSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		log_warning("Could not map spool file %s: %s", path, strerror(errno));
+		return false;
+	}
+	madvise(map, XLogSegSize, MADV_SEQUENTIAL);
+
+	reader->map = map;
+	reader->segNo = segNo;
+	return true;
+}
+
+/*
+ * Fill msg with the next chunk of spooled WAL. The data points into the
+ * mapped segment and stays valid until the next call. Reports
+ * MSG_END_OF_WAL at the end of the spool, the caller should continue from
+ * WbSpoolGetReadPtr() elsewhere.
+ */
+bool
+WbSpoolReceiveWalMessage(WbSpoolReader *reader, ReplMessage *msg)
+{
+	uint32 offset;
+	int len;
+
+	if (!SpoolMapSegment(reader))
+	{
+		msg->type = MSG_END_OF_WAL;
+		return true;
+	}
+
+	offset = reader->readPtr % XLogSegSize;
+	len = XLogSegSize - offset;
+	if (len > SPOOL_READ_CHUNK)
+	{
+		/* Don't split page headers */
+		len = SPOOL_READ_CHUNK;
+		len -= (reader->readPtr + len) % XLOG_BLCKSZ;
+	}
+
+	msg->type = MSG_WAL_DATA;
+	msg->dataStart = reader->readPtr;
+	msg->walEnd = reader->readPtr - offset + XLogSegSize;
+	msg->sendTime = GetCurrentTimestamp();
+	msg->replyRequested = false;
+	msg->dataPtr = 0;
+	msg->dataLen = len;
+	msg->data = reader->map + offset;
+	msg->nextPageBoundary = (XLOG_BLCKSZ - msg->dataStart) & (XLOG_BLCKSZ-1);
+
+	log_debug1("Read %d byte WAL block from spool. dataStart: %X/%X",
+			len, FormatRecPtr(msg->dataStart));
+
+	reader->readPtr += len;
+	return true;
+}
+
+/*
+ * Move the read position. WAL we already returned may have been modified by
+ * the filter, so the segment is mapped again from the file.
+ */
+void
+WbSpoolSeek(WbSpoolReader *reader, XLogRecPtr pos)
+{
+	if (reader->map)
+	{
+		munmap(reader->map, XLogSegSize);
+		reader->map = NULL;
+	}
+	reader->readPtr = pos;
+}
+
+XLogRecPtr
+WbSpoolGetReadPtr(WbSpoolReader *reader)
+{
+	return reader->readPtr;
+}
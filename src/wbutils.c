@@ -1,11 +1,20 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/time.h>
 #include "wbutils.h"
 
 LogLevel loggingLevel = LOG_INFO;
 
+/*
+ * Where error() continues in the current thread. When not set, errors
+ * terminate the process.
+ */
+__thread jmp_buf *errorHandler = NULL;
+
 /* Error reporting functions */
 
 void error(const char *message, ...)
@@ -15,6 +24,8 @@ void error(const char *message, ...)
 	vfprintf(stderr, message, args);
 	fprintf(stderr, "\n");
 	va_end(args);
+	if (errorHandler)
+		longjmp(*errorHandler, 1);
 	exit(1);
 }
 
@@ -37,8 +48,7 @@ void do_wb_log(LogLevel logLevel, const char* logLevelStr, const char *file, con
 
 void showPQerror(PGconn *mc, char *message)
 {
-	log_error("%s: %s", message, PQerrorMessage(mc));
-	exit(1);
+	error("%s: %s", message, PQerrorMessage(mc));
 }
 
 /* Memory allocation functions */
@@ -132,12 +142,12 @@ write32(char *buf, uint32 v)
  *
  * This is mostly for use in emitting messages.  The primary difference
  * from timestamptz_out is that we force the output format to ISO.  Note
- * also that the result is in a static buffer, not pstrdup'd.
+ * also that the result is in a per-thread static buffer, not pstrdup'd.
  */
 const char *
 timestamptz_to_str(TimestampTz t)
 {
-	static char buf[MAXDATELEN];
+	static __thread char buf[MAXDATELEN];
 	struct tm tm;
 	time_t time;
 	int offset;
@@ -150,6 +160,18 @@ timestamptz_to_str(TimestampTz t)
 	return buf;
 }
 
+/*
+ * Current time as a PostgreSQL timestamp, microseconds since 2000-01-01.
+ */
+TimestampTz
+GetCurrentTimestamp()
+{
+	struct timeval tp;
+
+	gettimeofday(&tp, NULL);
+	return ((TimestampTz) (tp.tv_sec - 946684800) * USECS_PER_SEC) + tp.tv_usec;
+}
+
 bool
 parse_hostmask(char *string, hostmask *result)
 {
@@ -173,6 +195,39 @@ parse_hostmask(char *string, hostmask *result)
 	return true;
 }
 
+/*
+ * Parse a size the way the server shows it, e.g. "16MB" or "8192".
+ */
+bool
+parse_byte_size(const char *string, uint64 *result)
+{
+	static const struct {
+		const char *suffix;
+		uint64 multiplier;
+	} units[] = {
+		{"", 1}, {"B", 1}, {"kB", 1024}, {"MB", 1024 * 1024},
+		{"GB", 1024 * 1024 * 1024}, {"TB", UINT64CONST(1024) * 1024 * 1024 * 1024}
+	};
+	unsigned long long value;
+	char *end;
+	int i;
+
+	errno = 0;
+	value = strtoull(string, &end, 10);
+	if (end == string || errno || *string == '-')
+		return false;
+
+	for (i = 0; i < sizeof(units) / sizeof(units[0]); i++)
+	{
+		if (strcmp(end, units[i].suffix) == 0)
+		{
+			*result = (uint64) value * units[i].multiplier;
+			return true;
+		}
+	}
+	return false;
+}
+
 bool match_hostmask(hostmask *match, uint32 host)
 {
 	uint32 bitmask = htonl(0xFFFFFFFF << (32 - match->mask));
@@ -0,0 +1,104 @@
+#include "wbwalindex.h"
+
+#include <sys/mman.h>
+
+#include "wb_pg_config.h"
+#include "wbutils.h"
+
+/* Enough to cover the last 512MB of WAL */
+#define WALINDEX_ENTRIES 65536
+
+#define IndexLoad(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define IndexStore(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define IndexFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * Entries are addressed by page number, a newer page replaces whatever was
+ * there. Odd changeCount means that somebody is updating the entry.
+ */
+typedef struct {
+	uint32 changeCount;
+	TimeLineID tli;
+	XLogRecPtr pagePtr;
+	XLogRecPtr recordPtr;
+} WalIndexEntry;
+
+static WalIndexEntry *walIndex = NULL;
+
+/*
+ * Set up the index in shared memory, must be called before forking.
+ */
+void
+WbWalIndexInit()
+{
+	void *shmem = mmap(NULL, sizeof(WalIndexEntry) * WALINDEX_ENTRIES,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (shmem == MAP_FAILED)
+		error("Could not allocate shared memory for WAL index");
+	walIndex = shmem;
+}
+
+/*
+ * Remember that the record continuing onto the page at pagePtr starts at
+ * recordPtr.
+ */
+void
+WbWalIndexAdd(TimeLineID tli, XLogRecPtr pagePtr, XLogRecPtr recordPtr)
+{
+	WalIndexEntry *entry;
+	uint32 count;
+
+	if (!walIndex)
+		return;
+
+	entry = &(walIndex[(pagePtr / XLOG_BLCKSZ) % WALINDEX_ENTRIES]);
+	count = IndexLoad(entry->changeCount);
+
+	if (entry->pagePtr == pagePtr && entry->tli == tli && !(count & 1))
+		return;
+
+	/* Somebody else is updating the entry, their data is as good as ours */
+	if ((count & 1) || !__atomic_compare_exchange_n(&(entry->changeCount), &count,
+			count + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return;
+
+	entry->tli = tli;
+	entry->pagePtr = pagePtr;
+	entry->recordPtr = recordPtr;
+	IndexFence();
+	IndexStore(entry->changeCount, count + 2);
+}
+
+/*
+ * Find the start of the record continuing onto the page at pagePtr. Returns
+ * false if the page is not in the index.
+ */
+bool
+WbWalIndexLookup(TimeLineID tli, XLogRecPtr pagePtr, XLogRecPtr *recordPtr)
+{
+	WalIndexEntry *entry;
+	WalIndexEntry copy;
+	uint32 count;
+
+	if (!walIndex)
+		return false;
+
+	entry = &(walIndex[(pagePtr / XLOG_BLCKSZ) % WALINDEX_ENTRIES]);
+
+	count = IndexLoad(entry->changeCount);
+	if (count & 1)
+		return false;
+	copy.tli = entry->tli;
+	copy.pagePtr = entry->pagePtr;
+	copy.recordPtr = entry->recordPtr;
+	IndexFence();
+	if (count != IndexLoad(entry->changeCount))
+		return false;
+
+	if (count == 0 || copy.pagePtr != pagePtr || copy.tli != tli)
+		return false;
+
+	*recordPtr = copy.recordPtr;
+	return true;
+}